@@ -0,0 +1,425 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+
+/*
+ * End-to-end benchmark of wav2mp3. Generates a synthetic wav corpus, which
+ * covers the supported formats (8/16/24/32-bit, mono/stereo), files with
+ * several data chunks, tiny files and a huge file, then runs the wav2mp3
+ * binary on it with different numbers of encoding threads and work queue sizes.
+ * Prints one CSV line per run:
+ * jobs,queue_size,wav_files,audio_seconds,seconds,files_per_sec,audio_sec_per_sec,peak_rss_kb
+ * (the fastest of the repeats, peak RSS of the wav2mp3 process).
+ *
+ * Usage: pipeline_bench [options] [-- wav2mp3 options]
+ *   -w PATH   wav2mp3 binary (default ./wav2mp3)
+ *   -d DIR    corpus folder, created if missing (default ./bench_corpus)
+ *   -j N      run with 1, 2, 4, ... N encoding threads (default CPU cores)
+ *   -q LIST   comma separated work queue sizes (default 2,8,32)
+ *   -s SCALE  multiply the durations of the corpus files (default 1.0)
+ *   -r N      repeat each run N times (default 1)
+ *   -g        generate the corpus only
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+namespace {
+
+/// Audio format of a data chunk
+struct ChunkSpec
+{
+    uint16_t bits;
+    uint16_t channels;
+    uint32_t rate;
+    double   seconds;
+};
+
+/// A corpus file with one or more data chunks
+struct FileSpec
+{
+    std::string name;
+    std::vector<ChunkSpec> chunks;
+};
+
+
+ChunkSpec chunk( uint16_t bits, uint16_t channels, uint32_t rate, double seconds )
+{
+    ChunkSpec c = { bits, channels, rate, seconds };
+    return c;
+}
+
+
+FileSpec file( const std::string& name, const ChunkSpec& c )
+{
+    FileSpec f;
+    f.name = name;
+    f.chunks.push_back(c);
+    return f;
+}
+
+
+/// The corpus, durations multiplied by scale
+std::vector<FileSpec> corpusSpec( double scale )
+{
+    static const uint16_t bits[] = { 8, 16, 24, 32 };
+    static const uint32_t rates[] = { 44100, 48000, 22050, 32000 };
+    std::vector<FileSpec> files;
+
+    // Every format branch of the encoder
+    for( int b=0; b<4; b++ )
+    {
+        for( uint16_t ch=1; ch<=2; ch++ )
+        {
+            std::ostringstream name;
+            name << "pcm" << bits[b] << "_" << (ch == 1 ? "mono" : "stereo") << ".wav";
+            files.push_back(file(name.str(), chunk(bits[b], ch, 44100, 30 * scale)));
+        }
+    }
+
+    // Several data chunks with different formats in one file
+    FileSpec multi;
+    multi.name = "multi_chunk.wav";
+    multi.chunks.push_back(chunk(16, 2, 44100, 10 * scale));
+    multi.chunks.push_back(chunk(8, 1, 22050, 5 * scale));
+    multi.chunks.push_back(chunk(24, 2, 48000, 5 * scale));
+    files.push_back(multi);
+
+    // Tiny files - per file overhead
+    for( int i=0; i<16; i++ )
+    {
+        std::ostringstream name;
+        name << "tiny_" << i << ".wav";
+        files.push_back(file(name.str(), chunk(bits[i % 4], 1 + (i / 4) % 2, rates[(i / 8) % 4],
+                                               0.05)));
+    }
+
+    // A huge file - streaming and splitting
+    files.push_back(file("huge.wav", chunk(16, 2, 44100, 900 * scale)));
+    return files;
+}
+
+
+uint64_t getNumFrames( const ChunkSpec& c )
+{
+    return (uint64_t)(c.seconds * c.rate + 0.5);
+}
+
+
+uint64_t getChunkSize( const ChunkSpec& c )
+{
+    return getNumFrames(c) * c.channels * (c.bits / 8);
+}
+
+
+uint64_t getFileSize( const FileSpec& f )
+{
+    uint64_t size = 12;  // RIFF header
+    for( size_t i=0; i<f.chunks.size(); i++ )
+        size += 8 + 16 + 8 + getChunkSize(f.chunks[i]);  // fmt and data chunks
+    return size;
+}
+
+
+double getAudioSeconds( const std::vector<FileSpec>& files )
+{
+    double secs = 0;
+    for( size_t f=0; f<files.size(); f++ )
+        for( size_t c=0; c<files[f].chunks.size(); c++ )
+            secs += (double) getNumFrames(files[f].chunks[c]) / files[f].chunks[c].rate;
+    return secs;
+}
+
+
+void putLE( std::vector<char>& buf, uint64_t val, int bytes )
+{
+    for( int i=0; i<bytes; i++ ) buf.push_back((char)((val >> (8 * i)) & 0xFF));
+}
+
+
+/// Writes a chunk header and a PCM fmt chunk
+void putFmt( std::vector<char>& buf, const ChunkSpec& c )
+{
+    buf.insert(buf.end(), "fmt ", "fmt " + 4);
+    putLE(buf, 16, 4);
+    putLE(buf, 1, 2);  // PCM
+    putLE(buf, c.channels, 2);
+    putLE(buf, c.rate, 4);
+    putLE(buf, c.rate * c.channels * (c.bits / 8), 4);
+    putLE(buf, c.channels * (c.bits / 8), 2);
+    putLE(buf, c.bits, 2);
+}
+
+
+/**
+ * Writes the audio of a chunk: a tone sweeping over a few hundred Hz with some
+ * noise, so the encoder has real work (silence encodes much faster).
+ */
+bool writeAudio( std::ofstream& out, const ChunkSpec& c, uint32_t seed )
+{
+    static const uint64_t BLOCK_FRAMES = 65536;
+    uint64_t numFrames = getNumFrames(c);
+    std::vector<char> buf;
+    uint32_t rnd = seed;
+    double phase = 0;
+    for( uint64_t first=0; first<numFrames; first+=BLOCK_FRAMES )
+    {
+        uint64_t count = std::min(BLOCK_FRAMES, numFrames - first);
+        buf.clear();
+        for( uint64_t i=0; i<count; i++ )
+        {
+            double t = (double)(first + i) / c.rate;
+            phase += 2 * M_PI * (220 + 200 * sin(2 * M_PI * 0.1 * t)) / c.rate;
+            for( uint16_t ch=0; ch<c.channels; ch++ )
+            {
+                rnd = rnd * 1664525 + 1013904223;
+                double v = 0.5 * sin(phase + ch) + 0.1 * ((int32_t) rnd / 2147483648.0);
+                int32_t s32 = (int32_t)(v * 2147483647.0);
+                switch( c.bits )
+                {
+                    case 8:  putLE(buf, (uint8_t)((s32 >> 24) + 128), 1); break;
+                    case 16: putLE(buf, (uint16_t)(s32 >> 16), 2); break;
+                    case 24: putLE(buf, (uint32_t)(s32 >> 8), 3); break;
+                    default: putLE(buf, (uint32_t) s32, 4); break;
+                }
+            }
+        }
+        out.write(&buf[0], buf.size());
+    }
+    return out.good();
+}
+
+
+bool writeWavFile( const std::string& uri, const FileSpec& f, uint32_t seed )
+{
+    std::ofstream out(uri.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if( !out.is_open() ) return false;
+
+    std::vector<char> hdr;
+    hdr.insert(hdr.end(), "RIFF", "RIFF" + 4);
+    putLE(hdr, getFileSize(f) - 8, 4);
+    hdr.insert(hdr.end(), "WAVE", "WAVE" + 4);
+    out.write(&hdr[0], hdr.size());
+
+    for( size_t i=0; i<f.chunks.size(); i++ )
+    {
+        hdr.clear();
+        putFmt(hdr, f.chunks[i]);
+        hdr.insert(hdr.end(), "data", "data" + 4);
+        putLE(hdr, getChunkSize(f.chunks[i]), 4);
+        out.write(&hdr[0], hdr.size());
+        if( !writeAudio(out, f.chunks[i], seed + i) ) return false;
+    }
+    out.close();
+    return !out.fail();
+}
+
+
+/// Writes the corpus files which are missing or have a different size
+bool generateCorpus( const std::string& dir, const std::vector<FileSpec>& files )
+{
+    if( (mkdir(dir.c_str(), 0777) != 0) && (errno != EEXIST) ) return false;
+    for( size_t i=0; i<files.size(); i++ )
+    {
+        std::string uri = dir + "/" + files[i].name;
+        struct stat st;
+        if( (stat(uri.c_str(), &st) == 0) && ((uint64_t) st.st_size == getFileSize(files[i])) )
+            continue;
+        std::cerr << "Generating " << uri << std::endl;
+        if( !writeWavFile(uri, files[i], i + 1) )
+        {
+            std::cerr << "Error writing " << uri << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/// Removes the mp3 files of the previous run
+void removeMp3Files( const std::string& dir )
+{
+    DIR* d = opendir(dir.c_str());
+    if( NULL == d ) return;
+    struct dirent* e;
+    while( (e = readdir(d)) != NULL )
+    {
+        std::string name(e->d_name);
+        if( (name.size() > 4) && (name.compare(name.size() - 4, 4, ".mp3") == 0) )
+            unlink((dir + "/" + name).c_str());
+    }
+    closedir(d);
+}
+
+
+double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+
+/**
+ * Runs wav2mp3 on the corpus.
+ *
+ * @param[out] seconds - wall time
+ * @param[out] peakRssKb - peak resident set size of the process
+ * @return true if it exited with 0
+ */
+bool runWav2Mp3( const std::string& binary, const std::vector<std::string>& args,
+                 double& seconds, long& peakRssKb )
+{
+    std::vector<char*> argv;
+    argv.push_back(const_cast<char*>(binary.c_str()));
+    for( size_t i=0; i<args.size(); i++ ) argv.push_back(const_cast<char*>(args[i].c_str()));
+    argv.push_back(NULL);
+
+    double start = now();
+    pid_t pid = fork();
+    if( pid < 0 ) return false;
+    if( 0 == pid )
+    {
+        int null = open("/dev/null", O_WRONLY);
+        if( null >= 0 )
+        {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        execv(binary.c_str(), &argv[0]);
+        _exit(127);
+    }
+
+    int status = 0;
+    struct rusage ru;
+    memset(&ru, 0, sizeof(ru));
+    if( wait4(pid, &status, 0, &ru) != pid ) return false;
+    seconds = now() - start;
+    peakRssKb = ru.ru_maxrss;  // Kilobytes on Linux
+    return WIFEXITED(status) && (0 == WEXITSTATUS(status));
+}
+
+
+void printUsage( const char* prog )
+{
+    std::cerr << "Usage: " << prog << " [-w wav2mp3] [-d corpus_dir] [-j max_jobs]"
+              << " [-q queue_sizes] [-s scale] [-r repeats] [-g] [-- wav2mp3 options]" << std::endl;
+}
+
+} // anonymous namespace
+
+
+int main( int argc, char* argv[] )
+{
+    std::string binary("./wav2mp3");
+    std::string dir("./bench_corpus");
+    long maxJobs = sysconf(_SC_NPROCESSORS_ONLN);
+    std::string queueSizes("2,8,32");
+    double scale = 1.0;
+    int repeats = 1;
+    bool generateOnly = false;
+
+    int opt;
+    while( (opt = getopt(argc, argv, "w:d:j:q:s:r:g")) != -1 )
+    {
+        switch( opt )
+        {
+            case 'w': binary = optarg; break;
+            case 'd': dir = optarg; break;
+            case 'j': maxJobs = atol(optarg); break;
+            case 'q': queueSizes = optarg; break;
+            case 's': scale = atof(optarg); break;
+            case 'r': repeats = atoi(optarg); break;
+            case 'g': generateOnly = true; break;
+            default:
+                printUsage(argv[0]);
+                return 1;
+        }
+    }
+    std::vector<std::string> extraArgs(argv + optind, argv + argc);
+
+    std::vector<unsigned int> queues;
+    std::istringstream list(queueSizes);
+    std::string item;
+    while( std::getline(list, item, ',') )
+    {
+        if( atoi(item.c_str()) > 0 ) queues.push_back(atoi(item.c_str()));
+    }
+    if( (maxJobs < 1) || (scale <= 0) || (repeats < 1) || queues.empty() )
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    std::vector<FileSpec> files = corpusSpec(scale);
+    if( !generateCorpus(dir, files) ) return 1;
+    if( generateOnly ) return 0;
+    double audioSeconds = getAudioSeconds(files);
+
+    std::vector<long> jobs;
+    for( long j=1; j<maxJobs; j*=2 ) jobs.push_back(j);
+    jobs.push_back(maxJobs);
+
+    int result = 0;
+    std::cout << "jobs,queue_size,wav_files,audio_seconds,seconds,files_per_sec,"
+              << "audio_sec_per_sec,peak_rss_kb" << std::endl;
+    for( size_t j=0; j<jobs.size(); j++ )
+    {
+        for( size_t q=0; q<queues.size(); q++ )
+        {
+            std::vector<std::string> args;
+            std::ostringstream jobsArg, queueArg;
+            jobsArg << "--jobs=" << jobs[j];
+            queueArg << "--queue-size=" << queues[q];
+            args.push_back(jobsArg.str());
+            args.push_back(queueArg.str());
+            args.insert(args.end(), extraArgs.begin(), extraArgs.end());
+            args.push_back(dir);
+
+            double best = 0;
+            long peakRssKb = 0;
+            bool ok = true;
+            for( int r=0; (r<repeats) && ok; r++ )
+            {
+                removeMp3Files(dir);
+                double secs = 0;
+                long rss = 0;
+                ok = runWav2Mp3(binary, args, secs, rss);
+                if( (0 == r) || (secs < best) ) best = secs;
+                if( rss > peakRssKb ) peakRssKb = rss;
+            }
+            if( !ok )
+            {
+                std::cerr << "Error running " << binary << " with " << jobsArg.str() << " "
+                          << queueArg.str() << std::endl;
+                result = 1;
+                continue;
+            }
+
+            std::cout << jobs[j] << "," << queues[q] << "," << files.size() << ","
+                      << audioSeconds << "," << best << "," << files.size() / best << ","
+                      << audioSeconds / best << "," << peakRssKb << std::endl;
+        }
+    }
+    removeMp3Files(dir);
+    return result;
+}
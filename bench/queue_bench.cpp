@@ -0,0 +1,127 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+
+/*
+ * Microbenchmark of the work queues: SyncQueue vs LockFreeQueue.
+ * Producers enqueue shared pointers (like the work manager does) and consumers
+ * dequeue them. Prints one line per run: queue,producers,consumers,items,seconds,ops_per_sec
+ *
+ * Usage: queue_bench [max_threads [items [capacity]]]
+ */
+
+#if defined(__GXX_EXPERIMENTAL_CXX0X) || __cplusplus >= 201103L
+ #include <memory>
+ using std::shared_ptr;
+#else  // TR1
+ #include <tr1/memory>
+ using std::tr1::shared_ptr;
+#endif  // c++11
+
+#include <pthread.h>
+#include <sys/time.h>
+#include <cstdlib>
+#include <iostream>
+#include "SyncQueue.h"
+#include "LockFreeQueue.h"
+
+using namespace wav2mp3;
+
+
+namespace {
+
+typedef shared_ptr<int> Item;
+
+template <typename Queue>
+struct BenchArgs
+{
+    Queue* queue;
+    long   count;  // Items for this thread
+};
+
+
+template <typename Queue>
+void* producer( void* arg )
+{
+    BenchArgs<Queue>* args = static_cast<BenchArgs<Queue>*>(arg);
+    Item item(new int(0));
+    for( long i=0; i<args->count; i++ ) args->queue->enqueue(item);
+    return NULL;
+}
+
+
+template <typename Queue>
+void* consumer( void* arg )
+{
+    BenchArgs<Queue>* args = static_cast<BenchArgs<Queue>*>(arg);
+    long sum = 0;
+    for( long i=0; i<args->count; i++ ) sum += *args->queue->dequeue();
+    return (void*) sum;
+}
+
+
+double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+
+/// @return elapsed seconds
+template <typename Queue>
+double run( int numProducers, int numConsumers, long items, unsigned int capacity )
+{
+    Queue queue(capacity);
+    std::vector<pthread_t> threads(numProducers + numConsumers);
+    std::vector< BenchArgs<Queue> > args(numProducers + numConsumers);
+
+    double start = now();
+    for( int i=0; i<numProducers + numConsumers; i++ )
+    {
+        bool isProducer = (i < numProducers);
+        int n = isProducer ? numProducers : numConsumers;
+        int idx = isProducer ? i : i - numProducers;
+        args[i].queue = &queue;
+        args[i].count = items / n + ((idx < items % n) ? 1 : 0);
+        pthread_create(&threads[i], NULL, isProducer ? producer<Queue> : consumer<Queue>, &args[i]);
+    }
+    for( size_t i=0; i<threads.size(); i++ ) pthread_join(threads[i], NULL);
+    return now() - start;
+}
+
+
+template <typename Queue>
+void report( const char* name, int numProducers, int numConsumers, long items,
+             unsigned int capacity )
+{
+    double secs = run<Queue>(numProducers, numConsumers, items, capacity);
+    std::cout << name << "," << numProducers << "," << numConsumers << "," << items << ","
+              << secs << "," << (long)(items / secs) << std::endl;
+}
+
+} // anonymous namespace
+
+
+int main( int argc, char* argv[] )
+{
+    int maxThreads = (argc > 1) ? atoi(argv[1]) : 8;
+    long items = (argc > 2) ? atol(argv[2]) : 1000000;
+    unsigned int capacity = (argc > 3) ? atoi(argv[3]) : 64;
+    if( (maxThreads < 1) || (items < 1) || (capacity < 1) )
+    {
+        std::cerr << "Usage: " << argv[0] << " [max_threads [items [capacity]]]" << std::endl;
+        return 1;
+    }
+
+    std::cout << "queue,producers,consumers,items,seconds,ops_per_sec" << std::endl;
+    for( int consumers=1; consumers<=maxThreads; consumers*=2 )
+    {
+        for( int producers=1; producers<=consumers; producers*=2 )
+        {
+            report< SyncQueue<Item> >("SyncQueue", producers, consumers, items, capacity);
+            report< LockFreeQueue<Item> >("LockFreeQueue", producers, consumers, items, capacity);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,252 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+
+/*
+ * Client and load generator of the wav2mp3 server (wav2mp3 --listen=SOCKET).
+ * Sends wav files to the server and measures the request latency. With one
+ * request and -o the mp3 data is saved. Files are sent round robin over the
+ * requests. Prints the number of requests, the throughput and the latency
+ * percentiles (in ms), measured from sending a request to receiving its
+ * response.
+ *
+ * Usage: wav2mp3_client [options] file.wav...
+ *   -s PATH   server socket (default /tmp/wav2mp3.sock)
+ *   -n N      number of requests (default 1)
+ *   -c N      concurrent connections (default 1)
+ *   -p        send the file paths - the server writes the mp3 files
+ *   -o FILE   save the mp3 data of the first request in FILE
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include "ServerProtocol.h"
+
+using namespace wav2mp3;
+
+
+namespace {
+
+struct Options
+{
+    std::string socketUri;
+    unsigned int requests;
+    unsigned int connections;
+    bool paths;
+    std::string outputUri;
+    std::vector<std::string> files;
+
+    Options(): socketUri("/tmp/wav2mp3.sock"), requests(1), connections(1), paths(false),
+               outputUri(), files() {}
+};
+
+Options gOptions;
+std::vector< std::vector<unsigned char> > gWavData;  // Contents of the files, unless paths are sent
+
+pthread_mutex_t gMutex = PTHREAD_MUTEX_INITIALIZER;
+unsigned int gNextRequest = 0;
+unsigned int gNumFailed = 0;   // Requests answered with FAIL
+std::vector<double> gLatencies;  // ms
+
+
+double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+
+/// @return socket connected to the server, -1 on error
+int connectServer()
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, gOptions.socketUri.c_str(), sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if( fd < 0 ) return -1;
+    if( connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 )
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+/// @return false if the file can't be read
+bool readFile( const std::string& uri, std::vector<unsigned char>& data )
+{
+    std::ifstream file(uri.c_str(), std::ios::in | std::ios::binary);
+    if( !file ) return false;
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return true;
+}
+
+
+/// Takes the next request. @return false when all are taken
+bool takeRequest( unsigned int& request )
+{
+    pthread_mutex_lock(&gMutex);
+    request = gNextRequest;
+    bool ok = (gNextRequest < gOptions.requests);
+    if( ok ) gNextRequest++;
+    pthread_mutex_unlock(&gMutex);
+    return ok;
+}
+
+
+/// A connection sending requests until all are taken
+void* connectionMain( void* /*arg*/ )
+{
+    int fd = connectServer();
+    if( fd < 0 )
+    {
+        std::cerr << "Can't connect to '" << gOptions.socketUri << "': " << strerror(errno) << std::endl;
+        return NULL;
+    }
+
+    std::vector<double> latencies;
+    unsigned int numFailed = 0;
+    unsigned int request;
+    std::vector<unsigned char> response;
+    while( takeRequest(request) )
+    {
+        size_t f = request % gOptions.files.size();
+        double start = now();
+        bool sent = gOptions.paths ?
+            protocol::writeFrame(fd, protocol::PATH, gOptions.files[f]) :
+            protocol::writeFrame(fd, protocol::WAV, gWavData[f].empty() ? NULL : &gWavData[f][0],
+                                 (uint32_t) gWavData[f].size());
+        char type[4];
+        if( !sent || !protocol::readFrame(fd, type, response) )
+        {
+            std::cerr << "Connection to the server failed" << std::endl;
+            break;
+        }
+        latencies.push_back((now() - start) * 1000);
+
+        if( protocol::isType(type, protocol::FAIL) )
+        {
+            std::cerr << "Request for '" << gOptions.files[f] << "' failed: " <<
+                    std::string(response.begin(), response.end()) << std::endl;
+            numFailed++;
+        }
+        else if( (0 == request) && !gOptions.outputUri.empty() && protocol::isType(type, protocol::MP3) )
+        {
+            std::ofstream out(gOptions.outputUri.c_str(), std::ios::out | std::ios::binary);
+            out.write(reinterpret_cast<const char*>(response.empty() ? NULL : &response[0]),
+                      response.size());
+            if( !out ) std::cerr << "Error writing '" << gOptions.outputUri << "'" << std::endl;
+        }
+    }
+    close(fd);
+
+    pthread_mutex_lock(&gMutex);
+    gLatencies.insert(gLatencies.end(), latencies.begin(), latencies.end());
+    gNumFailed += numFailed;
+    pthread_mutex_unlock(&gMutex);
+    return NULL;
+}
+
+
+/// @return the p-th percentile (0 - 100) of sorted values
+double percentile( const std::vector<double>& sorted, double p )
+{
+    if( sorted.empty() ) return 0;
+    size_t i = (size_t) (p / 100 * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(i, sorted.size() - 1)];
+}
+
+
+void printUsage( const char* prog )
+{
+    std::cerr << "Usage: " << prog << " [-s socket] [-n requests] [-c connections] [-p] [-o file.mp3]"
+              << " file.wav..." << std::endl;
+}
+
+} // anonymous namespace
+
+
+int main( int argc, char* argv[] )
+{
+    int opt;
+    while( (opt = getopt(argc, argv, "s:n:c:po:")) != -1 )
+    {
+        switch( opt )
+        {
+            case 's': gOptions.socketUri = optarg; break;
+            case 'n': gOptions.requests = atoi(optarg); break;
+            case 'c': gOptions.connections = atoi(optarg); break;
+            case 'p': gOptions.paths = true; break;
+            case 'o': gOptions.outputUri = optarg; break;
+            default:
+                printUsage(argv[0]);
+                return 1;
+        }
+    }
+    for( int i=optind; i<argc; i++ ) gOptions.files.push_back(argv[i]);
+    if( gOptions.files.empty() || (0 == gOptions.connections) )
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if( !gOptions.paths )
+    {
+        gWavData.resize(gOptions.files.size());
+        for( size_t i=0; i<gOptions.files.size(); i++ )
+        {
+            if( !readFile(gOptions.files[i], gWavData[i]) )
+            {
+                std::cerr << "Can't read '" << gOptions.files[i] << "'" << std::endl;
+                return 1;
+            }
+        }
+    }
+    else
+    {
+        // The server resolves the paths, maybe in another working directory
+        for( size_t i=0; i<gOptions.files.size(); i++ )
+        {
+            char* path = realpath(gOptions.files[i].c_str(), NULL);
+            if( path ) gOptions.files[i] = path;
+            free(path);
+        }
+    }
+
+    double start = now();
+    std::vector<pthread_t> threads(gOptions.connections);
+    for( size_t i=0; i<threads.size(); i++ ) pthread_create(&threads[i], NULL, connectionMain, NULL);
+    for( size_t i=0; i<threads.size(); i++ ) pthread_join(threads[i], NULL);
+    double seconds = now() - start;
+
+    // Requests without a response (connection failures) are lost
+    std::sort(gLatencies.begin(), gLatencies.end());
+    unsigned int numDone = gLatencies.size();
+    printf("requests: %u, failed: %u, lost: %u, connections: %u, seconds: %.3f, requests/s: %.1f\n",
+           numDone, gNumFailed, gOptions.requests - numDone, gOptions.connections, seconds,
+           seconds > 0 ? numDone / seconds : 0);
+    printf("latency ms: min %.2f, p50 %.2f, p90 %.2f, p99 %.2f, p99.9 %.2f, max %.2f\n",
+           percentile(gLatencies, 0), percentile(gLatencies, 50), percentile(gLatencies, 90),
+           percentile(gLatencies, 99), percentile(gLatencies, 99.9), percentile(gLatencies, 100));
+    return (gNumFailed || (numDone < gOptions.requests)) ? 1 : 0;
+}
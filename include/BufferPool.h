@@ -0,0 +1,143 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+
+#ifndef __BUFFERPOOL_H__
+#define __BUFFERPOOL_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <cstring>
+#include <vector>
+
+namespace wav2mp3 {
+
+
+/**
+ * Pool of reusable memory blocks in size classes (powers of two and 1.5 times
+ * powers of two, so at most 1/3 is wasted). Released blocks are kept for reuse,
+ * up to maxCachedBytes, so repeated jobs don't hit the allocator and don't
+ * page-fault fresh memory. Blocks are not zero-filled.
+ * Each worker thread has its own pool for encoding buffers, and there is a
+ * shared pool for wav file data (which is allocated and released by different
+ * threads). Pools are thread-safe anyway - blocks may be released by any thread.
+ * Big blocks may be backed by transparent huge pages (Linux).
+ */
+class BufferPool
+{
+  public:
+    static const size_t MIN_BLOCK_SIZE = 4096;
+    static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+    /**
+     * @param[in] maxCachedBytes - max bytes kept in released blocks
+     * @param[in] hugePages - allocate blocks of HUGE_PAGE_SIZE or more with
+     *            mmap() and ask for transparent huge pages
+     */
+    explicit BufferPool( size_t maxCachedBytes, bool hugePages=false );
+    ~BufferPool();
+
+    /**
+     * @param[in] size - bytes needed
+     * @param[out] capacity - size of the block, >= size
+     * @return the block, NULL if out of memory
+     */
+    void* allocate( size_t size, size_t& capacity );
+
+    /// Returns a block for reuse (or frees it if the cache is full)
+    void release( void* block, size_t capacity );
+
+    size_t getCachedBytes() const;
+    uint64_t getNumAllocations() const;  // Blocks allocated from the system
+    uint64_t getNumReuses() const;       // Blocks taken from the cache
+
+    /// Shared pool for wav file data
+    static BufferPool& getShared();
+    /// Sets the parameters of the shared pool. Call it before it is used.
+    static void configureShared( size_t maxCachedBytes, bool hugePages );
+
+  private:
+    BufferPool( const BufferPool& );  // Disable copying.
+    BufferPool& operator=( const BufferPool& );  // Disable assignment.
+
+    static size_t getClassCapacity( int sizeClass );
+    static int getSizeClass( size_t size, size_t& capacity );
+    void* allocateBlock( size_t capacity );
+    void freeBlock( void* block, size_t capacity );
+
+    size_t mMaxCachedBytes;
+    bool   mHugePages;
+    size_t mCachedBytes;
+    uint64_t mNumAllocations;
+    uint64_t mNumReuses;
+    std::vector< std::vector<void*> > mFreeBlocks;  // By size class
+    mutable pthread_mutex_t mMutex;
+
+    static size_t sSharedMaxCachedBytes;
+    static bool   sSharedHugePages;
+};
+
+
+/**
+ * A growable array of trivially copyable elements in a pool block. Unlike
+ * std::vector, growing doesn't initialize the new elements.
+ */
+template <typename T>
+class PooledBuffer
+{
+  public:
+    explicit PooledBuffer( BufferPool& pool ): mPool(&pool), mData(NULL), mSize(0), mCapacity(0) {}
+    ~PooledBuffer() { clear(); }
+
+    T* data() { return mData; }
+    const T* data() const { return mData; }
+    T& operator[]( size_t i ) { return mData[i]; }
+    const T& operator[]( size_t i ) const { return mData[i]; }
+    size_t size() const { return mSize; }
+    bool empty() const { return 0 == mSize; }
+
+    /**
+     * Changes the size. New elements are not initialized, the old ones are kept.
+     *
+     * @return false if out of memory (the buffer is unchanged)
+     */
+    bool resize( size_t size )
+    {
+        if( size * sizeof(T) > mCapacity )
+        {
+            size_t capacity;
+            T* data = static_cast<T*>(mPool->allocate(size * sizeof(T), capacity));
+            if( NULL == data ) return false;
+            if( mSize ) memcpy(data, mData, mSize * sizeof(T));
+            if( mData ) mPool->release(mData, mCapacity);
+            mData = data;
+            mCapacity = capacity;
+        }
+        mSize = size;
+        return true;
+    }
+
+    /// Returns the memory to the pool
+    void clear()
+    {
+        if( mData ) mPool->release(mData, mCapacity);
+        mData = NULL;
+        mSize = 0;
+        mCapacity = 0;
+    }
+
+  private:
+    PooledBuffer( const PooledBuffer& );  // Disable copying.
+    PooledBuffer& operator=( const PooledBuffer& );  // Disable assignment.
+
+    BufferPool* mPool;
+    T*          mData;
+    size_t      mSize;
+    size_t      mCapacity;  // In bytes
+};
+
+
+} // namespace
+
+#endif // __BUFFERPOOL_H__
@@ -0,0 +1,188 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+
+#ifndef __CONVERTER_H__
+#define __CONVERTER_H__
+
+#if defined(__GXX_EXPERIMENTAL_CXX0X) || __cplusplus >= 201103L
+ #include <memory>
+ using std::shared_ptr;
+#else  // TR1
+ #include <tr1/memory>
+ using std::tr1::shared_ptr;
+#endif  // c++11
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "Stage.h"
+#include "WavFile.h"
+#include "Mp3Writer.h"
+#include "Encoder.h"
+#include "EncodeProfile.h"
+#include "BufferPool.h"
+
+namespace wav2mp3 {
+
+
+/**
+ * Library interface of wav2mp3: converts wav data in memory or read from a
+ * stream to mp3 data in memory or passed to a sink, without touching the file
+ * system. Conversions run on a pool of threads owned by the converter, so one
+ * converter can be shared by a whole application. Thread safe.
+ *
+ *     Converter converter;
+ *     std::vector<unsigned char> mp3;
+ *     bool ok = converter.encode(wavData, wavSize, mp3);
+ *
+ * A wav file with several WAV chunks gives the mp3 streams of the chunks one
+ * after the other. Wav files aren't split in segments - the pool encodes
+ * several files in parallel instead.
+ */
+class Converter
+{
+  public:
+    /// Result of a submitted conversion, which is ready when the conversion is done
+    class Result
+    {
+      public:
+        Result();
+        ~Result();
+
+        /// @return true if the conversion is done
+        bool isReady() const;
+        /// Blocks until the conversion is done
+        void wait() const;
+        /// Waits. @return true if the whole input was converted.
+        bool isOk() const;
+        /// Waits. @return the mp3 data, empty if it was passed to a sink.
+        const std::vector<unsigned char>& getMp3() const;
+
+      private:
+        Result( const Result& );  // Disable copying.
+        Result& operator=( const Result& );  // Disable assignment.
+
+        friend class Converter;
+        void finish( bool ok );
+
+        std::vector<unsigned char> mMp3;
+        bool                       mReady;
+        bool                       mOk;
+        mutable pthread_mutex_t    mMutex;
+        mutable pthread_cond_t     mReadyCond;
+    };
+
+    typedef shared_ptr<Result> Future;
+
+    /**
+     * Constructor. Starts the threads.
+     *
+     * @param[in] numThreads - encoding threads, 0 - one per usable CPU
+     * @param[in] profile - encoding parameters of all conversions
+     * @param[in] blockFrames - number of frames encoded at once, bounds the memory
+     *            used by a conversion (besides the input and output data)
+     */
+    explicit Converter( unsigned int numThreads=0, const EncodeProfile& profile=EncodeProfile(),
+                        uint32_t blockFrames=Encoder::DEFAULT_BLOCK_FRAMES );
+
+    /// Destructor. Finishes the submitted conversions and stops the threads.
+    ~Converter();
+
+    /**
+     * Queues the conversion of a wav file image in memory. Blocks while the
+     * queue is full. The data is not copied and must be valid until the
+     * result is ready.
+     *
+     * @param[in] name - used in logs
+     */
+    Future submit( const void* wav, size_t size, const std::string& name="memory.wav" );
+
+    /**
+     * Queues the conversion of a wav stream to a sink. The wav data is read
+     * (and the mp3 data written) block by block by a worker, so memory use
+     * doesn't depend on the stream length. The stream and the sink must be
+     * valid until the result is ready.
+     */
+    Future submit( WavStream& wav, Mp3Sink& mp3, const std::string& name="stream.wav" );
+
+    /**
+     * Queues the conversion of a wav file to mp3 files next to it, named as by
+     * the command line tool. The file is read block by block. Partial mp3
+     * files are removed.
+     */
+    Future submit( const std::string& wavUri );
+
+    /**
+     * Converts a wav file image in memory and waits for the result. Must not be
+     * called from a sink or a stream of this converter - it would wait for itself.
+     *
+     * @return true on success. On error mp3 has the data converted so far.
+     */
+    bool encode( const void* wav, size_t size, std::vector<unsigned char>& mp3 );
+
+    /// Converts a wav stream to a sink and waits for the result. @return true on success.
+    bool encode( WavStream& wav, Mp3Sink& mp3 );
+
+    /// Converts a wav file to mp3 files and waits for the result. @return true on success.
+    bool encode( const std::string& wavUri );
+
+    /**
+     * Conversions in progress stop and fail when *abort becomes non-zero (see
+     * Encoder::setAbortFlag()). Set it before submitting. NULL - never abort.
+     */
+    void setAbortFlag( const int* abort ) { mAbort = abort; }
+
+    unsigned int getNumThreads() const { return mNumThreads; }
+    const EncodeProfile& getProfile() const { return mProfile; }
+
+    /// Enables or disables logging to stderr (of all converters). Enabled by default.
+    static void setLogging( bool enable );
+
+    /// @return the number of CPUs the process may use (affinity mask and cgroup quota)
+    static unsigned int getNumCpus();
+
+  private:
+    Converter( const Converter& );  // Disable copying.
+    Converter& operator=( const Converter& );  // Disable assignment.
+
+    struct Job
+    {
+        Future      result;
+        const char* data;    // Wav file image, or NULL for a stream or a file
+        size_t      size;
+        WavStream*  stream;
+        Mp3Sink*    sink;    // NULL - collect the mp3 data in the result
+        std::string name;
+        bool        toFiles; // Encode the wav file named name to mp3 files
+    };
+
+    /// Encodes the jobs with a buffer pool per thread
+    class Worker: public Stage< shared_ptr<Job> >::Handler
+    {
+      public:
+        Worker( Converter& converter, unsigned int numThreads );
+        virtual ~Worker();
+        virtual void initThread( unsigned int thread );
+        virtual void process( shared_ptr<Job>& job, unsigned int thread );
+
+      private:
+        Converter&               mConverter;
+        std::vector<BufferPool*> mPools;  // One per thread
+    };
+
+    Future submit( shared_ptr<Job> job );
+
+    EncodeProfile mProfile;
+    uint32_t      mBlockFrames;
+    unsigned int  mNumThreads;
+    const int*    mAbort;
+    Worker        mWorker;
+    Stage< shared_ptr<Job> > mStage;
+};
+
+
+} // namespace
+
+#endif // __CONVERTER_H__
@@ -0,0 +1,77 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+
+#ifndef __CPUAFFINITY_H__
+#define __CPUAFFINITY_H__
+
+#include <string>
+#include <vector>
+
+namespace wav2mp3 {
+
+
+/**
+ * Finds the CPUs the process may use and places threads on them. The usable
+ * CPUs are the ones in the process affinity mask (the cpuset of a container),
+ * limited by the cgroup CPU quota (cgroup v2 cpu.max or v1 cpu.cfs_quota_us).
+ *
+ * With pinning, each worker is pinned to a single CPU (CORE) or to the CPUs of
+ * a NUMA node, round robin (NUMA). The manager is pinned to the CPUs not used
+ * by the workers, so reading files doesn't compete with encoding.
+ * Affinity and cgroups are Linux only, elsewhere all CPUs are used and
+ * threads are not pinned.
+ */
+class CpuAffinity
+{
+  public:
+    enum Mode { NONE, CORE, NUMA };
+
+    /// @return false if the name is not none, core or numa
+    static bool parseMode( const std::string& name, Mode& mode );
+    static const char* getModeName( Mode mode );
+
+    /**
+     * @param[in] numCores - number of online CPUs, used if the affinity mask is unknown
+     * @return the CPUs in the process affinity mask
+     */
+    static std::vector<int> getAllowedCpus( long numCores );
+
+    /// @return the cgroup CPU quota in CPUs (rounded up), 0 if unlimited or unknown
+    static unsigned int getCgroupCpuLimit();
+
+    /// @return NUMA node of a CPU, 0 if unknown
+    static int getNumaNode( int cpu );
+
+    /**
+     * Plans the placement of the threads.
+     *
+     * @param[in] mode - pinning mode, NONE pins nothing
+     * @param[in] cpus - the allowed CPUs
+     * @param[in] numWorkers - number of encoding threads
+     */
+    CpuAffinity( Mode mode, const std::vector<int>& cpus, unsigned int numWorkers );
+
+    Mode getMode() const { return mMode; }
+
+    /// @return CPUs of a worker (0 based), empty if not pinned
+    const std::vector<int>& getWorkerCpus( unsigned int worker ) const;
+    /// @return CPUs of the manager, empty if not pinned (no CPU is free of workers)
+    const std::vector<int>& getManagerCpus() const { return mManagerCpus; }
+
+    /// Pins the calling thread to cpus. @return false on error or if cpus is empty
+    static bool pinCurrentThread( const std::vector<int>& cpus );
+
+    /// @return the CPUs as a list, e.g. "0,1,2"
+    static std::string toString( const std::vector<int>& cpus );
+
+  private:
+    Mode mMode;
+    std::vector< std::vector<int> > mWorkerCpus;
+    std::vector<int> mManagerCpus;
+};
+
+
+} // namespace
+
+#endif // __CPUAFFINITY_H__
@@ -0,0 +1,70 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+
+#ifndef __DOWNMIX_H__
+#define __DOWNMIX_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include "SampleConv.h"
+
+namespace wav2mp3 {
+
+
+/**
+ * Matrix which mixes 3 to MAX_CHANNELS wav channels down to stereo for LAME.
+ * Standard matrices follow ITU-R BS.775: center and surround channels are
+ * added at -3 dB, LFE is dropped. They are normalized so a full scale signal
+ * in all channels doesn't clip. Custom matrices are used as given.
+ */
+class Downmix
+{
+  public:
+    static const size_t MAX_CHANNELS = SampleConv::DOWNMIX_LANES;
+
+    /// Speaker positions (bits of the WAVE_FORMAT_EXTENSIBLE channel mask)
+    enum Speaker
+    {
+        FRONT_LEFT = 0x1, FRONT_RIGHT = 0x2, FRONT_CENTER = 0x4, LOW_FREQUENCY = 0x8,
+        BACK_LEFT = 0x10, BACK_RIGHT = 0x20, FRONT_LEFT_OF_CENTER = 0x40,
+        FRONT_RIGHT_OF_CENTER = 0x80, BACK_CENTER = 0x100, SIDE_LEFT = 0x200, SIDE_RIGHT = 0x400
+    };
+
+    /// Empty matrix (0 channels)
+    Downmix();
+
+    /**
+     * Sets the standard matrix for numchan channels in the positions of
+     * chanmask. If chanmask is 0 or doesn't have numchan positions, the usual
+     * layout for numchan is assumed (3.0, quad, 5.0, 5.1, 6.1, 7.1).
+     *
+     * @return false if numchan is not in 3..MAX_CHANNELS
+     */
+    bool setStandard( unsigned int numchan, uint32_t chanmask );
+
+    /**
+     * Sets a custom matrix from "L1,L2,...,Ln/R1,R2,...,Rn" - the coefficients
+     * of the n channels in the left and the right output.
+     *
+     * @return false on syntax error or if n is not in 3..MAX_CHANNELS
+     */
+    bool parse( const std::string& spec );
+
+    unsigned int getNumChannels() const { return mNumChannels; }
+
+    /// Coefficients of the channels in the outputs, MAX_CHANNELS elements (see SampleConv::downmixF32())
+    const float* getLeft() const { return mLeft; }
+    const float* getRight() const { return mRight; }
+
+  private:
+    unsigned int mNumChannels;
+    float mLeft[MAX_CHANNELS];
+    float mRight[MAX_CHANNELS];
+};
+
+
+} // namespace
+
+#endif // __DOWNMIX_H__
@@ -0,0 +1,130 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+
+#ifndef __ENCODECACHE_H__
+#define __ENCODECACHE_H__
+
+#if defined(__GXX_EXPERIMENTAL_CXX0X) || __cplusplus >= 201103L
+ #include <memory>
+ using std::shared_ptr;
+#else  // TR1
+ #include <tr1/memory>
+ using std::tr1::shared_ptr;
+#endif  // c++11
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <fstream>
+#include <map>
+
+namespace wav2mp3 {
+
+
+/**
+ * Persistent manifest of encoded wav files, used to skip files whose mp3 files
+ * are up to date. An entry is keyed by the wav file URI and holds its size,
+ * modification time, optionally a content hash, the encoder settings and the
+ * number of mp3 files produced. A file is up to date if its entry matches
+ * (size and mtime, or size and hash in hash mode), the settings are the same
+ * and all its mp3 files exist.
+ *
+ * The manifest is a text file with one tab-separated entry per line. New
+ * entries are appended as files are encoded, so an interrupted run keeps what
+ * was done. Later lines override earlier ones, and the file is compacted on
+ * load when it has grown with overridden entries.
+ */
+class EncodeCache
+{
+  public:
+    struct Entry
+    {
+        uint64_t    size;
+        int64_t     mtimeSec;
+        int64_t     mtimeNsec;
+        std::string hash;      // Hex content hash, "-" if not computed
+        std::string settings;
+        int         numOutputs;
+
+        Entry(): size(0), mtimeSec(0), mtimeNsec(0), hash("-"), settings(), numOutputs(0) {}
+    };
+
+    /**
+     * A wav file being encoded. Shared by all its jobs. When the last job is done
+     * (the ticket is destroyed) the entry is stored in the cache, unless a job failed.
+     */
+    class Ticket
+    {
+      public:
+        Ticket( EncodeCache& cache, const std::string& uri, const Entry& entry );
+        ~Ticket();
+
+        void setNumOutputs( int numOutputs );
+        void fail();
+        /// @return true if the content hash of the file is still to be set (hash mode)
+        bool needsHash();
+        /// Sets the content hash, computed from data read anyway. Empty - hashing failed.
+        void setHash( const std::string& hash );
+
+      private:
+        Ticket( const Ticket& );  // Disable copying.
+        Ticket& operator=( const Ticket& );  // Disable assignment.
+
+        EncodeCache&    mCache;
+        std::string     mUri;
+        Entry           mEntry;
+        bool            mFailed;
+        pthread_mutex_t mMutex;
+    };
+
+    /**
+     * Constructor. Loads the manifest, if it exists.
+     *
+     * @param[in] manifestUri - manifest file URI
+     * @param[in] settings - encoder settings (no tabs or new lines)
+     * @param[in] useHash - compare content hashes instead of modification times
+     */
+    EncodeCache( const std::string& manifestUri, const std::string& settings, bool useHash );
+    ~EncodeCache();
+
+    /**
+     * Checks if a wav file needs to be encoded. In hash mode only files whose
+     * size and settings match are hashed here - new and changed files are hashed
+     * later, from their data (see Ticket::setHash()).
+     *
+     * @param[in] uri - wav file URI
+     * @param[out] ticket - set if the file needs encoding, to be passed with its jobs
+     * @return true if the file is up to date
+     */
+    bool check( const std::string& uri, shared_ptr<Ticket>& ticket );
+
+    size_t getNumEntries() const;
+
+    /// @return FNV-1a 64-bit hash of the file contents in hex, empty string on error
+    static std::string hashFile( const std::string& uri );
+    /// @return FNV-1a 64-bit hash of data in memory in hex, as by hashFile()
+    static std::string hashData( const void* data, size_t size );
+
+  private:
+    EncodeCache( const EncodeCache& );  // Disable copying.
+    EncodeCache& operator=( const EncodeCache& );  // Disable assignment.
+
+    void load();
+    bool compact();  // Rewrites the manifest with the current entries only
+    void store( const std::string& uri, const Entry& entry );  // Called by Ticket
+    static void writeEntry( std::ostream& out, const std::string& uri, const Entry& entry );
+    static bool statFile( const std::string& uri, Entry& entry );
+
+    std::string mManifestUri;
+    std::string mSettings;
+    bool        mUseHash;
+    std::map<std::string, Entry> mEntries;
+    std::ofstream mManifest;  // Opened for appending
+    mutable pthread_mutex_t mMutex;
+};
+
+
+} // namespace
+
+#endif // __ENCODECACHE_H__
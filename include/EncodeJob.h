@@ -0,0 +1,45 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+
+#ifndef __ENCODEJOB_H__
+#define __ENCODEJOB_H__
+
+#if defined(__GXX_EXPERIMENTAL_CXX0X) || __cplusplus >= 201103L
+ #include <memory>
+ using std::shared_ptr;
+#else  // TR1
+ #include <tr1/memory>
+ using std::tr1::shared_ptr;
+#endif  // c++11
+
+#include "WavFile.h"
+#include "SegmentedChunk.h"
+#include "EncodeCache.h"
+#include "Progress.h"
+
+namespace wav2mp3 {
+
+
+/// A unit of work for the encoding threads - a whole wav file or a segment of a wav chunk
+struct EncodeJob
+{
+    shared_ptr<WavFile>        wavFile;  // Empty for segments
+    shared_ptr<SegmentedChunk> chunk;    // Empty for whole files
+    int                        segment;  // Segment index in chunk
+    shared_ptr<EncodeCache::Ticket> ticket;  // Shared by the jobs of a file. Empty without cache.
+    shared_ptr<Progress::Ticket> progress;   // Shared by the jobs of a file. May be empty.
+
+    explicit EncodeJob( shared_ptr<WavFile> wav,
+                        shared_ptr<EncodeCache::Ticket> tkt = shared_ptr<EncodeCache::Ticket>() ):
+        wavFile(wav), chunk(), segment(0), ticket(tkt), progress() {}
+
+    EncodeJob( shared_ptr<SegmentedChunk> chk, int seg,
+               shared_ptr<EncodeCache::Ticket> tkt = shared_ptr<EncodeCache::Ticket>() ):
+        wavFile(), chunk(chk), segment(seg), ticket(tkt), progress() {}
+};
+
+
+} // namespace
+
+#endif // __ENCODEJOB_H__
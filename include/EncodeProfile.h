@@ -0,0 +1,60 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+
+#ifndef __ENCODEPROFILE_H__
+#define __ENCODEPROFILE_H__
+
+#include <string>
+
+namespace wav2mp3 {
+
+
+/**
+ * LAME encoding parameters, which trade CPU time and mp3 size for quality.
+ * Named profiles:
+ * standard - CBR, bitrate from the wav byte rate (320 kbps for CD audio), quality 5
+ * fast     - CBR 128 kbps, quality 7. For preview transcodes.
+ * archive  - VBR V2 (~190 kbps), quality 3
+ */
+struct EncodeProfile
+{
+    enum Mode { CBR, ABR, VBR };
+
+    static const int MIN_BITRATE = 8;    // kbps
+    static const int MAX_BITRATE = 320;  // kbps
+
+    Mode mode;
+    int  quality;     // Algorithm quality 0 (best, slowest) - 9 (worst, fastest)
+    int  bitrate;     // CBR bitrate or ABR mean bitrate in kbps, 0 - from the wav byte rate
+    int  vbrQuality;  // VBR quality 0 (best, biggest) - 9 (smallest)
+    std::string downmix;  // Custom downmix matrix for its number of channels (see Downmix::parse())
+
+    /// The standard profile
+    EncodeProfile(): mode(CBR), quality(5), bitrate(0), vbrQuality(4), downmix() {}
+
+    /**
+     * Sets a named profile: "standard", "fast" or "archive".
+     *
+     * @return false if the name is unknown
+     */
+    bool setName( const std::string& name );
+
+    /**
+     * Sets the mode by name: "cbr", "abr" or "vbr".
+     *
+     * @return false if the name is unknown
+     */
+    bool setMode( const std::string& name );
+
+    /// @return true if the parameters are in range
+    bool isValid() const;
+
+    /// @return description of the parameters, which affect the mp3 output
+    std::string getId() const;
+};
+
+
+} // namespace
+
+#endif // __ENCODEPROFILE_H__
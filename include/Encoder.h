@@ -12,10 +12,18 @@
  using std::tr1::shared_ptr;
 #endif  // c++11
 
+#include <stdint.h>
 #include <string>
 #include <fstream>
+#include <vector>
 #include "lame/lame.h"
 #include "WavFile.h"
+#include "SegmentedChunk.h"
+#include "Mp3Writer.h"
+#include "EncodeCache.h"
+#include "BufferPool.h"
+#include "EncodeProfile.h"
+#include "Downmix.h"
 
 namespace wav2mp3 {
 
@@ -23,12 +31,20 @@ namespace wav2mp3 {
 class Encoder
 {
   public:
+    /// Default number of frames (samples per channel) converted and encoded at once
+    static const uint32_t DEFAULT_BLOCK_FRAMES = 65536;
+
     /**
      * Constructor
      *
      * @param[in] wavFilePtr - shared pointer to WavFile object
+     * @param[in] blockFrames - number of frames encoded at once. Bounds the size
+     *            of the conversion and mp3 buffers.
+     * @param[in] writer - output stage for mp3 files, NULL - write synchronously
+     * @param[in] pool - buffer pool of the thread, NULL - the shared pool
      */
-    Encoder( shared_ptr<WavFile> wavFilePtr );
+    Encoder( shared_ptr<WavFile> wavFilePtr, uint32_t blockFrames=DEFAULT_BLOCK_FRAMES,
+             Mp3Writer* writer=NULL, BufferPool* pool=NULL );
 
     ~Encoder();
 
@@ -38,8 +54,54 @@ class Encoder
      * may be different. Mp3 files after the first will have an index in the name.
      * Need to to copy and convert 8-bit unsigned data to 16-bit signed, and 24-bit
      * to 32-bit, because LAME lib works only with 16-bit and 32-bit buffers.
+     * Float data is passed as floats (doubles are narrowed to floats).
+     * More than 2 channels are converted to floats and mixed down to stereo.
+     * Conversion is done by SIMD kernels (see SampleConv).
+     * Audio data is converted and encoded in blocks of frames and mp3 frames are
+     * written to the file as they are produced, so memory usage is constant.
+     */
+    int encode();
+
+    /// Sets the encoding parameters for encode() and encodeSegment(). Standard by default.
+    void setProfile( const EncodeProfile& profile ) { mProfile = profile; }
+    const EncodeProfile& getProfile() const { return mProfile; }
+
+    /// The mp3 files of encode() fail the ticket if they can't be written
+    void setCacheTicket( shared_ptr<EncodeCache::Ticket> ticket ) { mTicket = ticket; }
+    /// The mp3 files of encode() fail the progress ticket if they can't be written
+    void setProgressTicket( shared_ptr<Progress::Ticket> progress ) { mProgress = progress; }
+
+    /**
+     * encode() passes the mp3 data to the sink as it is produced, instead of
+     * writing mp3 files. The mp3 streams of several wav chunks follow each
+     * other. On error the data passed so far is partial. NULL - write files.
+     */
+    void setSink( Mp3Sink* sink ) { mSink = sink; }
+
+    /// @return the number of wav chunks which failed in the last encode() call
+    int getNumErrors() const { return mNumErrors; }
+
+    /**
+     * Encoding stops with an error when *abort becomes non-zero (checked before
+     * each block). The partial mp3 file is removed. NULL - never abort.
+     */
+    void setAbortFlag( const int* abort ) { mAbort = abort; }
+    /// @return true if the last encode() or encodeSegment() call was aborted
+    bool isAborted() const { return mAborted; }
+
+    /**
+     * Encode one segment of a wav chunk, which is split to be encoded in parallel
+     * by several workers. The mp3 frames are passed to the chunk to be written.
+     *
+     * @return true on success
      */
-    int encode();  // TODO Add encoding parameters?
+    bool encodeSegment( SegmentedChunk& chunk, int segment );
+
+    /// @return mp3 file URI for the wav chunk with index chunkNum of a wav file
+    static std::string getMp3Uri( const std::string& wavUri, int chunkNum );
+
+    /// @return description of the encoder and its settings, which affect the mp3 output
+    static std::string getSettingsId( const EncodeProfile& profile=EncodeProfile() );
 
   private:
     // Helper functions
@@ -47,10 +109,51 @@ class Encoder
     static std::string int2str(int i);
     static int getStdBRate(int brate);
 
+    int initLame( bool segmented );
+
+    /**
+     * Converts (if needed) and encodes a block of whole frames from the current
+     * wav chunk in mMp3BufVec.
+     *
+     * @return the number of mp3 bytes in mMp3BufVec, negative on error
+     */
+    int encodeBlock( const char* datap, uint32_t datasz );
+
+    /**
+     * Collects mp3 bytes and passes them to the writer in big blocks.
+     *
+     * @return false on error
+     */
+    bool writeMp3( const unsigned char* data, size_t size );
+
+    /// @return true if the abort flag is set. Logs it once.
+    bool checkAbort();
+
     shared_ptr<WavFile> mWavFilePtr;
     std::string         mMp3Uri;
     lame_global_flags*  mLameContext;
-    std::ofstream       mMp3File;
+    Mp3Writer*          mWriter;
+    shared_ptr<Mp3Writer::File> mMp3File;  // Output of encode()
+    std::vector<unsigned char>  mMp3Out;   // Collected for mMp3File
+    shared_ptr<EncodeCache::Ticket> mTicket;
+    shared_ptr<Progress::Ticket>    mProgress;
+    Mp3Sink*            mSink;     // Output of encode() instead of mp3 files, may be NULL
+    uint32_t            mBlockFrames;
+    EncodeProfile       mProfile;
+    FMTHeader           mFmt;  // Format of the current wav chunk
+    uint32_t            mChannelMask;  // Speaker positions of the current wav chunk
+    Downmix             mDownmix;      // Matrix for the current wav chunk, if it has > 2 channels
+    int                 mNumErrors;
+    const int*          mAbort;    // Non-zero when encoding should stop, may be NULL
+    bool                mAborted;
+
+    // Buffers for a single block. Reused for all blocks and chunks, and taken
+    // from the thread's pool, so they are reused by the next encoder too.
+    BufferPool&                 mPool;
+    PooledBuffer<unsigned char> mMp3Buf;
+    PooledBuffer<uint8_t>       mCopiedDataLBuf;
+    PooledBuffer<uint8_t>       mCopiedDataRBuf;
+    PooledBuffer<float>         mDownmixBuf;  // Interleaved float channels
 };
 
 
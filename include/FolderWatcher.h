@@ -0,0 +1,74 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+
+#ifndef __FOLDERWATCHER_H__
+#define __FOLDERWATCHER_H__
+
+#include <string>
+#include <vector>
+#include <map>
+
+namespace wav2mp3 {
+
+
+/**
+ * Finds wav files in a folder and watches it for new ones (with inotify, Linux
+ * only). A file is reported when it is closed after writing or moved in the
+ * folder, so files which are still being written are not picked up. Subfolders
+ * created later are watched too (in recursive mode) and the files already in
+ * them are reported - the rest of the tree is never rescanned.
+ * Folder URIs end with '/'.
+ */
+class FolderWatcher
+{
+  public:
+    /**
+     * Constructor. Starts watching the folder (and its subfolders in recursive mode).
+     * Check isWatching() for errors.
+     */
+    FolderWatcher( const std::string& folder, bool recursive );
+    ~FolderWatcher();
+
+    bool isWatching() const { return mFd >= 0; }
+
+    /**
+     * Blocks until wav files are completed in the watched folders.
+     *
+     * @param[out] uris - URIs of the completed files are appended here
+     * @return false on error (watching can't continue) or if stopped
+     */
+    bool waitForFiles( std::vector<std::string>& uris );
+
+    /// Makes waitForFiles() return false, now and later. May be called from another thread.
+    void stop();
+
+    /**
+     * Appends the URIs of the wav files in a folder (and its subfolders in
+     * recursive mode) to uris. Symbolic links to folders are not followed.
+     *
+     * @return false if the folder can't be opened
+     */
+    static bool findWavFiles( const std::string& folder, bool recursive,
+                              std::vector<std::string>& uris );
+
+    /// @return true if the name has .wav extension (case insensitive)
+    static bool isWavFileName( const char* name );
+
+  private:
+    FolderWatcher( const FolderWatcher& );  // Disable copying.
+    FolderWatcher& operator=( const FolderWatcher& );  // Disable assignment.
+
+    /// Watches a folder and, in recursive mode, its subfolders
+    bool addWatch( const std::string& folder );
+
+    int  mFd;         // inotify file descriptor, -1 if not watching
+    int  mStopFds[2]; // Pipe, which wakes up waitForFiles() when written
+    bool mRecursive;
+    std::map<int, std::string> mFolders;  // Watch descriptor -> folder URI
+};
+
+
+} // namespace
+
+#endif // __FOLDERWATCHER_H__
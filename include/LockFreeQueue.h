@@ -0,0 +1,465 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+
+#ifndef __LOCKFREEQUEUE_H__
+#define __LOCKFREEQUEUE_H__
+
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <stdint.h>
+#include <climits>
+#include <vector>
+
+#if defined(__GXX_EXPERIMENTAL_CXX0X) || __cplusplus >= 201103L
+ #include <utility>
+ #define LFQ_MOVE(x) std::move(x)
+#else
+ #define LFQ_MOVE(x) (x)
+#endif  // c++11
+
+namespace wav2mp3 {
+
+
+/**
+ * Bounded multi-producer multi-consumer queue, based on D. Vyukov's ring buffer.
+ * Each cell has a sequence number telling whether it is free for the producer
+ * (or ready for the consumer) of the current lap, so producers and consumers
+ * only contend on a CAS of their own position counter - there are no locks.
+ *
+ * tryEnqueue()/tryDequeue() never block. enqueue()/dequeue() and the timed
+ * versions spin for a while and then sleep on a condition variable. The mutex
+ * is touched only when some thread is already sleeping, so the fast path is
+ * lock-free. Works with move-only element types in C++11.
+ * T must be default constructible. Dequeued cells are reset, so they don't
+ * hold references to the elements.
+ * The interface is compatible with SyncQueue.
+ */
+template <typename T>
+class LockFreeQueue
+{
+  public:
+    LockFreeQueue( unsigned int maxElements=1024 );
+    ~LockFreeQueue();
+
+    bool tryEnqueue( const T& item );
+    bool tryDequeue( T& item );
+
+    /// Block while the queue is full
+    void enqueue( const T& item );
+    /// Block while the queue is empty
+    T dequeue();
+
+    /// @return false on timeout
+    bool timedEnqueue( const T& item, unsigned int timeoutMs );
+    bool timedDequeue( T& item, unsigned int timeoutMs );
+
+#if defined(__GXX_EXPERIMENTAL_CXX0X) || __cplusplus >= 201103L
+    bool tryEnqueue( T&& item );
+    void enqueue( T&& item );
+    bool timedEnqueue( T&& item, unsigned int timeoutMs );
+#endif  // c++11
+
+    /// Approximate number of elements - exact only if there are no concurrent operations
+    size_t getSize() const;
+    size_t getCapacity() const { return mMask + 1; }
+
+  private:
+    /// Disable copying
+    LockFreeQueue(const LockFreeQueue& other);
+    LockFreeQueue& operator=(const LockFreeQueue& other);
+
+    struct Cell
+    {
+        size_t sequence;
+        T      data;
+    };
+
+    enum { CACHE_LINE = 64, SPIN_COUNT = 64 };
+
+    /// @return the cell to enqueue in, NULL if the queue is full
+    Cell* claimEnqueueCell();
+    /// @return the cell to dequeue from, NULL if the queue is empty
+    Cell* claimDequeueCell();
+
+    // The operations without waking up the other side
+    bool push( const T& item );
+    bool pop( T& item );
+#if defined(__GXX_EXPERIMENTAL_CXX0X) || __cplusplus >= 201103L
+    bool push( T&& item );
+#endif  // c++11
+
+    void notify( size_t& waiters, pthread_cond_t& cond );
+    /**
+     * Waits until tryOp succeeds, then wakes up a thread waiting on the other side.
+     * timeoutMs < 0 means no timeout.
+     */
+    template <typename Op> bool wait( Op& tryOp, size_t& waiters, pthread_cond_t& cond,
+                                      size_t& otherWaiters, pthread_cond_t& otherCond,
+                                      long timeoutMs );
+    struct WaitState
+    {
+        pthread_mutex_t* mutex;
+        size_t*          waiters;
+    };
+    static void cleanupWait( void* arg );
+
+    // Operations for wait()
+    struct TryEnqueueCopy
+    {
+        LockFreeQueue& q; const T& item;
+        TryEnqueueCopy( LockFreeQueue& q_, const T& item_ ): q(q_), item(item_) {}
+        bool operator()() { return q.push(item); }
+    };
+#if defined(__GXX_EXPERIMENTAL_CXX0X) || __cplusplus >= 201103L
+    struct TryEnqueueMove
+    {
+        LockFreeQueue& q; T& item;
+        TryEnqueueMove( LockFreeQueue& q_, T& item_ ): q(q_), item(item_) {}
+        bool operator()() { return q.push(std::move(item)); }
+    };
+#endif  // c++11
+    struct TryDequeue
+    {
+        LockFreeQueue& q; T& item;
+        TryDequeue( LockFreeQueue& q_, T& item_ ): q(q_), item(item_) {}
+        bool operator()() { return q.pop(item); }
+    };
+
+    std::vector<Cell> mCells;
+    size_t mMask;
+
+    // Keep positions in separate cache lines to avoid false sharing
+    char mPad0[CACHE_LINE];
+    size_t mEnqueuePos;
+    char mPad1[CACHE_LINE];
+    size_t mDequeuePos;
+    char mPad2[CACHE_LINE];
+
+    // Sleeping support
+    size_t mWaitingProducers;
+    size_t mWaitingConsumers;
+    pthread_mutex_t mMutex;
+    pthread_cond_t  mNotFull;
+    pthread_cond_t  mNotEmpty;
+};
+
+
+template <typename T>
+LockFreeQueue<T>::LockFreeQueue( unsigned int maxElements ):
+        mCells(),
+        mMask(0),
+        mEnqueuePos(0),
+        mDequeuePos(0),
+        mWaitingProducers(0),
+        mWaitingConsumers(0)
+{
+    // Capacity is rounded up to a power of 2
+    size_t capacity = 2;
+    while( (capacity < maxElements) && (capacity < ((size_t)1 << 30)) ) capacity <<= 1;
+    mCells.resize(capacity);
+    mMask = capacity - 1;
+    for( size_t i=0; i<capacity; i++ ) mCells[i].sequence = i;
+
+    pthread_mutex_init(&mMutex, NULL);
+    pthread_cond_init(&mNotFull, NULL);
+    pthread_cond_init(&mNotEmpty, NULL);
+}
+
+
+template <typename T>
+LockFreeQueue<T>::~LockFreeQueue()
+{
+    // We MUST NOT try to use the queue any more. Elements are destroyed with mCells.
+    pthread_cond_destroy(&mNotEmpty);
+    pthread_cond_destroy(&mNotFull);
+    pthread_mutex_destroy(&mMutex);
+}
+
+
+template <typename T>
+typename LockFreeQueue<T>::Cell* LockFreeQueue<T>::claimEnqueueCell()
+{
+    size_t pos = __atomic_load_n(&mEnqueuePos, __ATOMIC_RELAXED);
+    while( true )
+    {
+        Cell* cell = &mCells[pos & mMask];
+        size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if( 0 == diff )
+        {
+            // The cell is free in this lap - try to claim it
+            if( __atomic_compare_exchange_n(&mEnqueuePos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+                return cell;
+        }
+        else if( diff < 0 )
+        {
+            return NULL;  // Full - the cell is still occupied from the previous lap
+        }
+        else
+        {
+            pos = __atomic_load_n(&mEnqueuePos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+template <typename T>
+typename LockFreeQueue<T>::Cell* LockFreeQueue<T>::claimDequeueCell()
+{
+    size_t pos = __atomic_load_n(&mDequeuePos, __ATOMIC_RELAXED);
+    while( true )
+    {
+        Cell* cell = &mCells[pos & mMask];
+        size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if( 0 == diff )
+        {
+            // The cell was filled in this lap - try to claim it
+            if( __atomic_compare_exchange_n(&mDequeuePos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+                return cell;
+        }
+        else if( diff < 0 )
+        {
+            return NULL;  // Empty
+        }
+        else
+        {
+            pos = __atomic_load_n(&mDequeuePos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+template <typename T>
+bool LockFreeQueue<T>::push( const T& item )
+{
+    Cell* cell = claimEnqueueCell();
+    if( NULL == cell ) return false;
+
+    cell->data = item;
+    size_t pos = cell->sequence;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);  // Ready for the consumer
+    return true;
+}
+
+
+#if defined(__GXX_EXPERIMENTAL_CXX0X) || __cplusplus >= 201103L
+template <typename T>
+bool LockFreeQueue<T>::push( T&& item )
+{
+    Cell* cell = claimEnqueueCell();
+    if( NULL == cell ) return false;
+
+    cell->data = std::move(item);
+    size_t pos = cell->sequence;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);  // Ready for the consumer
+    return true;
+}
+#endif  // c++11
+
+
+template <typename T>
+bool LockFreeQueue<T>::pop( T& item )
+{
+    Cell* cell = claimDequeueCell();
+    if( NULL == cell ) return false;
+
+    item = LFQ_MOVE(cell->data);
+    cell->data = T();  // Release the element
+    size_t pos = cell->sequence - 1;
+    __atomic_store_n(&cell->sequence, pos + mMask + 1, __ATOMIC_RELEASE);  // Free for the next lap
+    return true;
+}
+
+
+template <typename T>
+bool LockFreeQueue<T>::tryEnqueue( const T& item )
+{
+    if( !push(item) ) return false;
+    notify(mWaitingConsumers, mNotEmpty);
+    return true;
+}
+
+
+#if defined(__GXX_EXPERIMENTAL_CXX0X) || __cplusplus >= 201103L
+template <typename T>
+bool LockFreeQueue<T>::tryEnqueue( T&& item )
+{
+    if( !push(std::move(item)) ) return false;
+    notify(mWaitingConsumers, mNotEmpty);
+    return true;
+}
+#endif  // c++11
+
+
+template <typename T>
+bool LockFreeQueue<T>::tryDequeue( T& item )
+{
+    if( !pop(item) ) return false;
+    notify(mWaitingProducers, mNotFull);
+    return true;
+}
+
+
+/**
+ * Wakes up a sleeping thread, if any. The full fence pairs with the one in
+ * wait(): either the sleeper sees the new state, or we see the sleeper.
+ */
+template <typename T>
+void LockFreeQueue<T>::notify( size_t& waiters, pthread_cond_t& cond )
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if( __atomic_load_n(&waiters, __ATOMIC_RELAXED) > 0 )
+    {
+        pthread_mutex_lock(&mMutex);
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&mMutex);
+    }
+}
+
+
+/// Called when the wait ends normally or the thread is canceled while sleeping
+template <typename T>
+void LockFreeQueue<T>::cleanupWait( void* arg )
+{
+    WaitState* state = static_cast<WaitState*>(arg);
+    __atomic_sub_fetch(state->waiters, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(state->mutex);
+}
+
+
+template <typename T>
+template <typename Op>
+bool LockFreeQueue<T>::wait( Op& tryOp, size_t& waiters, pthread_cond_t& cond,
+                             size_t& otherWaiters, pthread_cond_t& otherCond, long timeoutMs )
+{
+    // Spin a little - the other side is usually quick
+    for( int i=0; i<SPIN_COUNT; i++ )
+    {
+        if( tryOp() )
+        {
+            notify(otherWaiters, otherCond);
+            return true;
+        }
+        sched_yield();
+    }
+
+    struct timespec deadline;
+    if( timeoutMs >= 0 )
+    {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        deadline.tv_sec  = now.tv_sec + timeoutMs / 1000;
+        deadline.tv_nsec = now.tv_usec * 1000 + (timeoutMs % 1000) * 1000000;
+        if( deadline.tv_nsec >= 1000000000 )
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    bool done = false;
+    WaitState state = { &mMutex, &waiters };
+    pthread_mutex_lock(&mMutex);
+    __atomic_add_fetch(&waiters, 1, __ATOMIC_RELAXED);
+    pthread_cleanup_push(cleanupWait, &state);  // pthread_cond_wait() is a cancellation point
+    while( true )
+    {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if( (done = tryOp()) ) break;
+
+        if( timeoutMs < 0 )
+        {
+            pthread_cond_wait(&cond, &mMutex);
+        }
+        else if( ETIMEDOUT == pthread_cond_timedwait(&cond, &mMutex, &deadline) )
+        {
+            done = tryOp();
+            break;
+        }
+    }
+    pthread_cleanup_pop(1);  // Decrement waiters and unlock
+
+    if( done ) notify(otherWaiters, otherCond);  // Not under the lock - notify() takes it
+    return done;
+}
+
+
+template <typename T>
+void LockFreeQueue<T>::enqueue( const T& item )
+{
+    if( tryEnqueue(item) ) return;
+    TryEnqueueCopy op(*this, item);
+    wait(op, mWaitingProducers, mNotFull, mWaitingConsumers, mNotEmpty, -1);
+}
+
+
+template <typename T>
+bool LockFreeQueue<T>::timedEnqueue( const T& item, unsigned int timeoutMs )
+{
+    if( tryEnqueue(item) ) return true;
+    TryEnqueueCopy op(*this, item);
+    return wait(op, mWaitingProducers, mNotFull, mWaitingConsumers, mNotEmpty, timeoutMs);
+}
+
+
+#if defined(__GXX_EXPERIMENTAL_CXX0X) || __cplusplus >= 201103L
+template <typename T>
+void LockFreeQueue<T>::enqueue( T&& item )
+{
+    if( tryEnqueue(std::move(item)) ) return;
+    TryEnqueueMove op(*this, item);  // item is not moved from if tryEnqueue() fails
+    wait(op, mWaitingProducers, mNotFull, mWaitingConsumers, mNotEmpty, -1);
+}
+
+
+template <typename T>
+bool LockFreeQueue<T>::timedEnqueue( T&& item, unsigned int timeoutMs )
+{
+    if( tryEnqueue(std::move(item)) ) return true;
+    TryEnqueueMove op(*this, item);
+    return wait(op, mWaitingProducers, mNotFull, mWaitingConsumers, mNotEmpty, timeoutMs);
+}
+#endif  // c++11
+
+
+template <typename T>
+T LockFreeQueue<T>::dequeue()
+{
+    T item;
+    if( tryDequeue(item) ) return item;
+    TryDequeue op(*this, item);
+    wait(op, mWaitingConsumers, mNotEmpty, mWaitingProducers, mNotFull, -1);
+    return item;
+}
+
+
+template <typename T>
+bool LockFreeQueue<T>::timedDequeue( T& item, unsigned int timeoutMs )
+{
+    if( tryDequeue(item) ) return true;
+    TryDequeue op(*this, item);
+    return wait(op, mWaitingConsumers, mNotEmpty, mWaitingProducers, mNotFull, timeoutMs);
+}
+
+
+template <typename T>
+size_t LockFreeQueue<T>::getSize() const
+{
+    size_t deq = __atomic_load_n(&mDequeuePos, __ATOMIC_ACQUIRE);
+    size_t enq = __atomic_load_n(&mEnqueuePos, __ATOMIC_ACQUIRE);
+    return (enq > deq) ? (enq - deq) : 0;
+}
+
+
+} // namespace
+
+#undef LFQ_MOVE
+
+#endif // __LOCKFREEQUEUE_H__
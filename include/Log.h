@@ -5,11 +5,17 @@
 #include <sstream>
 #include "Locker.h"
 
+namespace wav2mp3 {
+
 extern pthread_mutex_t gLogMutex;
+extern int gLogEnabled;  // Logs are written to stderr if non-zero (the default). Atomic.
+
+} // namespace
 
 #define LOG( text ) \
     do { \
-        Locker lock(gLogMutex); \
+        if( !__atomic_load_n(&wav2mp3::gLogEnabled, __ATOMIC_RELAXED) ) break; \
+        wav2mp3::Locker lock(wav2mp3::gLogMutex); \
         std::stringstream sstr; \
         sstr /*<< __FILE__ << ":" << __FUNCTION__ << "(): "*/ << text; \
         std::cerr << sstr.str(); \
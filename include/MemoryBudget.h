@@ -0,0 +1,74 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+
+#ifndef __MEMORYBUDGET_H__
+#define __MEMORYBUDGET_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+namespace wav2mp3 {
+
+
+/**
+ * Limits the number of bytes held in memory by in-flight wav files. The work
+ * manager acquires the size of a file before reading it and the bytes are
+ * released when the file object is destroyed (see Releaser). A request bigger
+ * than the whole budget is admitted when nothing else is in flight, so a big
+ * file can't block forever.
+ */
+class MemoryBudget
+{
+  public:
+    /// @param[in] budget - max bytes in flight, 0 means unlimited
+    explicit MemoryBudget( uint64_t budget );
+    ~MemoryBudget();
+
+    /// Blocks until bytes can be admitted
+    void acquire( uint64_t bytes );
+
+    /// @return true if bytes were admitted, false if they don't fit now
+    bool tryAcquire( uint64_t bytes );
+
+    void release( uint64_t bytes );
+
+    uint64_t getBudget() const { return mBudget; }
+    uint64_t getInFlight() const;
+    uint64_t getPeak() const;  // Max bytes in flight so far
+
+    /// Deleter for shared pointers, which releases the object's bytes
+    template <typename T>
+    class Releaser
+    {
+      public:
+        Releaser( MemoryBudget& budget, uint64_t bytes ): mBudget(&budget), mBytes(bytes) {}
+
+        void operator()( T* ptr ) const
+        {
+            delete ptr;
+            mBudget->release(mBytes);
+        }
+
+      private:
+        MemoryBudget* mBudget;
+        uint64_t      mBytes;
+    };
+
+  private:
+    MemoryBudget( const MemoryBudget& );  // Disable copying.
+    MemoryBudget& operator=( const MemoryBudget& );  // Disable assignment.
+
+    bool fits( uint64_t bytes ) const;
+
+    const uint64_t mBudget;
+    uint64_t mInFlight;
+    uint64_t mPeak;
+    mutable pthread_mutex_t mMutex;
+    pthread_cond_t  mReleased;
+};
+
+
+} // namespace
+
+#endif // __MEMORYBUDGET_H__
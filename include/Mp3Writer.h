@@ -0,0 +1,171 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+
+#ifndef __MP3WRITER_H__
+#define __MP3WRITER_H__
+
+#if defined(__GXX_EXPERIMENTAL_CXX0X) || __cplusplus >= 201103L
+ #include <memory>
+ using std::shared_ptr;
+#else  // TR1
+ #include <tr1/memory>
+ using std::tr1::shared_ptr;
+#endif  // c++11
+
+#include <pthread.h>
+#include <string>
+#include <fstream>
+#include <vector>
+#include "LockFreeQueue.h"
+#include "EncodeCache.h"
+#include "Progress.h"
+#include "Stage.h"
+
+namespace wav2mp3 {
+
+
+/// Receives mp3 data instead of a file, e.g. a memory buffer, a pipe or a callback
+class Mp3Sink
+{
+  public:
+    virtual ~Mp3Sink() {}
+
+    /// @return false on error - encoding stops and fails
+    virtual bool write( const unsigned char* data, size_t size ) = 0;
+};
+
+
+/**
+ * Output stage, which writes mp3 files in its own threads, so encoding threads
+ * don't wait for the file system. Writes are queued in bounded queues (one per
+ * writer thread), so memory use is bounded and encoders block only if the
+ * disk can't keep up. All writes to a file go to the same writer thread, in
+ * order. Encoders should pass big blocks (see COALESCE_BYTES).
+ * With atomic writes a file is written with a temporary name and renamed when
+ * it is complete, so readers never see a partial mp3 file.
+ * With 0 threads the writes are done synchronously by the calling thread.
+ * This is the last stage of the pipeline. Its queues are per thread (not a
+ * Stage), so the writes to a file stay in order, but its occupancy is measured
+ * the same way.
+ */
+class Mp3Writer
+{
+  public:
+    /// Encoders collect at least this many mp3 bytes before passing them for writing
+    static const size_t COALESCE_BYTES = 256 * 1024;
+    /// Default number of queued requests per writer thread
+    static const unsigned int DEFAULT_QUEUE_SIZE = 64;
+    /// Suffix of the temporary file names with atomic writes
+    static const char* const TEMP_SUFFIX;
+
+    class File;  // An mp3 file being written
+
+    /**
+     * Constructor. Starts the writer threads.
+     *
+     * @param[in] numThreads - number of writer threads, 0 - write synchronously
+     * @param[in] atomic - write with a temporary name and rename complete files
+     * @param[in] queueSize - max queued requests per writer thread
+     */
+    Mp3Writer( unsigned int numThreads, bool atomic, unsigned int queueSize=DEFAULT_QUEUE_SIZE );
+
+    /// Destructor. Finishes the queued writes.
+    ~Mp3Writer();
+
+    /**
+     * Starts a new mp3 file. The file is created with the first write.
+     *
+     * @param[in] uri - mp3 file URI
+     * @param[in] ticket - cache ticket of the wav file, fails if the file can't be
+     *            written and is kept until the file is closed. May be empty.
+     * @param[in] progress - progress ticket of the wav file, the same way. May be empty.
+     */
+    shared_ptr<File> open( const std::string& uri,
+                           shared_ptr<EncodeCache::Ticket> ticket = shared_ptr<EncodeCache::Ticket>(),
+                           shared_ptr<Progress::Ticket> progress = shared_ptr<Progress::Ticket>() );
+
+    /// Queues data for writing. Swaps data with an empty vector. May block.
+    void write( const shared_ptr<File>& file, std::vector<unsigned char>& data );
+
+    /**
+     * Queues closing of the file. If ok is false, or a write failed, the file
+     * is removed - if this writer created it. A file which was never written
+     * (e.g. an mp3 file left by an earlier run) is not touched. May block.
+     */
+    void close( const shared_ptr<File>& file, bool ok );
+
+    /// Finishes the queued writes and stops the writer threads
+    void stop();
+
+    /// Writer used when none is given - writes synchronously
+    static Mp3Writer& getSyncWriter();
+
+    /// Occupancy of the writer threads (or of the synchronous writes)
+    StageStats getStats() const { return mMeter.getStats(); }
+
+  private:
+    Mp3Writer( const Mp3Writer& );  // Disable copying.
+    Mp3Writer& operator=( const Mp3Writer& );  // Disable assignment.
+
+    struct Request
+    {
+        shared_ptr<File> file;
+        std::vector<unsigned char> data;
+        bool close;
+        bool ok;
+
+        Request(): file(), data(), close(false), ok(true) {}
+    };
+    typedef LockFreeQueue< shared_ptr<Request> > RequestQueue;
+
+    void submit( const shared_ptr<Request>& request );
+    void execute( Request& request );
+    static void* writerThread( void* arg );
+
+    struct Thread
+    {
+        Mp3Writer*    writer;
+        RequestQueue* queue;
+        pthread_t     thread;
+    };
+
+    bool mAtomic;
+    std::vector<Thread> mThreads;
+    unsigned int mNextThread;  // For new files, round-robin
+    pthread_mutex_t mMutex;
+    StageMeter mMeter;
+};
+
+
+class Mp3Writer::File
+{
+  public:
+    const std::string& getURI() const { return mUri; }
+
+  private:
+    friend class Mp3Writer;
+
+    File( const std::string& uri, const std::string& path, unsigned int thread,
+          shared_ptr<EncodeCache::Ticket> ticket, shared_ptr<Progress::Ticket> progress ):
+        mUri(uri), mPath(path), mThread(thread), mOut(), mOpened(false), mCreated(false),
+        mFailed(false), mTicket(ticket), mProgress(progress) {}
+
+    File( const File& );  // Disable copying.
+    File& operator=( const File& );  // Disable assignment.
+
+    std::string   mUri;
+    std::string   mPath;    // Temporary file with atomic writes
+    unsigned int  mThread;  // Writer thread index
+    std::ofstream mOut;
+    bool          mOpened;
+    bool          mCreated; // mPath was created or truncated by this writer
+    bool          mFailed;
+    shared_ptr<EncodeCache::Ticket> mTicket;
+    shared_ptr<Progress::Ticket>    mProgress;
+};
+
+
+} // namespace
+
+#endif // __MP3WRITER_H__
@@ -0,0 +1,76 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+
+#ifndef __PROGRESS_H__
+#define __PROGRESS_H__
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <set>
+
+namespace wav2mp3 {
+
+
+/**
+ * Keeps the outcome of the wav files of a run: done (encoded or up to date),
+ * failed (unsupported or broken) or still pending. A cancelled run reports
+ * the pending files, so the next run can pick them up. Thread safe.
+ */
+class Progress
+{
+  public:
+    /**
+     * A wav file being processed. Shared by all its jobs. When the last job is
+     * done (the ticket is destroyed) the file is done, failed or left pending
+     * if it was interrupted.
+     */
+    class Ticket
+    {
+      public:
+        Ticket( Progress& progress, const std::string& uri );
+        ~Ticket();
+
+        void fail();
+        /// The file was cancelled or aborted - it stays pending. Overrides fail().
+        void interrupt();
+
+      private:
+        Ticket( const Ticket& );  // Disable copying.
+        Ticket& operator=( const Ticket& );  // Disable assignment.
+
+        Progress&       mProgress;
+        std::string     mUri;
+        bool            mFailed;
+        bool            mInterrupted;
+        pthread_mutex_t mMutex;
+    };
+
+    Progress();
+    ~Progress();
+
+    /// A file to process - pending until finished
+    void add( const std::string& uri );
+    /// The file is done (ok) or failed (!ok)
+    void finish( const std::string& uri, bool ok );
+
+    size_t getNumDone() const;
+    size_t getNumFailed() const;
+    /// @return the pending files in sorted order
+    std::vector<std::string> getPending() const;
+
+  private:
+    Progress( const Progress& );  // Disable copying.
+    Progress& operator=( const Progress& );  // Disable assignment.
+
+    std::multiset<std::string> mPending;  // A file may be added again in watch mode
+    size_t mNumDone;
+    size_t mNumFailed;
+    mutable pthread_mutex_t mMutex;
+};
+
+
+} // namespace
+
+#endif // __PROGRESS_H__
@@ -0,0 +1,67 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+
+#ifndef __READAHEAD_H__
+#define __READAHEAD_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <deque>
+
+namespace wav2mp3 {
+
+
+/**
+ * Keeps several reads in flight for the read stage. The files queued for
+ * reading are hinted to the OS (posix_fadvise WILLNEED) in order, up to a
+ * window, so the OS reads them in the page cache in the background while the
+ * read threads are busy with the files before them. When a read thread takes
+ * a file, the next queued file is hinted. This pays off on SSD/NVMe storage,
+ * which serves parallel requests. A window of 0 gives no hints (one blocking
+ * read per read thread, best for a single spinning disk). Thread safe.
+ */
+class ReadAhead
+{
+  public:
+    /// @param[in] window - max files hinted ahead of the ones being read, 0 - none
+    explicit ReadAhead( unsigned int window );
+    ~ReadAhead();
+
+    /// A file was queued for reading. It is hinted if the window isn't full.
+    void queued( const std::string& uri );
+
+    /// A read thread took a file. Hints the next queued file(s).
+    void started( const std::string& uri );
+
+    unsigned int getWindow() const { return mWindow; }
+    uint64_t getNumHints() const;
+
+    /**
+     * Asks the OS to read a whole file in the page cache, without waiting for it.
+     * Does nothing where posix_fadvise() is not available.
+     *
+     * @return true if the hint was given
+     */
+    static bool adviseWillNeed( const std::string& uri );
+
+  private:
+    ReadAhead( const ReadAhead& );  // Disable copying.
+    ReadAhead& operator=( const ReadAhead& );  // Disable assignment.
+
+    /// Moves the queued files which fit in the window to uris. Called locked.
+    void takeHints( std::deque<std::string>& uris );
+    void giveHints( const std::deque<std::string>& uris );
+
+    unsigned int mWindow;
+    std::deque<std::string> mQueued;  // In reading order. The first mNumHinted are hinted.
+    size_t   mNumHinted;
+    uint64_t mNumHints;
+    mutable pthread_mutex_t mMutex;
+};
+
+
+} // namespace
+
+#endif // __READAHEAD_H__
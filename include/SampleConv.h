@@ -0,0 +1,100 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+
+#ifndef __SAMPLECONV_H__
+#define __SAMPLECONV_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace wav2mp3 {
+
+
+/**
+ * Sample format conversion and deinterleaving kernels, which prepare PCM data
+ * for LAME lib. There are scalar, SSE2/SSSE3, AVX2 and NEON implementations.
+ * The best one supported by the CPU is selected at run time, for each kernel.
+ * All implementations give bit-identical output. Buffers need not be aligned.
+ */
+class SampleConv
+{
+  public:
+    /// Downmix coefficient arrays have this many elements, zero after the channels
+    static const size_t DOWNMIX_LANES = 8;
+
+    /// Unsigned 8-bit to signed 16-bit (n samples)
+    static void u8ToS16( const uint8_t* in, int16_t* out, size_t n );
+
+    /// Unsigned 8-bit interleaved stereo to signed 16-bit L and R (n frames)
+    static void u8StereoToS16( const uint8_t* in, int16_t* outL, int16_t* outR, size_t n );
+
+    /// Packed 24-bit to 32-bit (24 bits in the MSBs, n samples)
+    static void s24ToS32( const uint8_t* in, int32_t* out, size_t n );
+
+    /// Packed 24-bit interleaved stereo to 32-bit L and R (n frames)
+    static void s24StereoToS32( const uint8_t* in, int32_t* outL, int32_t* outR, size_t n );
+
+    /// 32-bit interleaved stereo to L and R (n frames)
+    static void s32StereoSplit( const int32_t* in, int32_t* outL, int32_t* outR, size_t n );
+
+    /// 64-bit float to 32-bit float (n samples)
+    static void f64ToF32( const double* in, float* out, size_t n );
+
+    /// 64-bit float interleaved stereo to 32-bit float L and R (n frames)
+    static void f64StereoToF32( const double* in, float* outL, float* outR, size_t n );
+
+    /// Signed 16-bit to float in [-1, 1) (n samples)
+    static void s16ToF32( const int16_t* in, float* out, size_t n );
+
+    /// 32-bit to float in [-1, 1] (n samples)
+    static void s32ToF32( const int32_t* in, float* out, size_t n );
+
+    /**
+     * Mixes n frames of numchan interleaved float channels (up to DOWNMIX_LANES)
+     * to L and R: outL = sum(in[c] * coefL[c]), outR = sum(in[c] * coefR[c]).
+     * The coefficient arrays have DOWNMIX_LANES elements, zero after numchan.
+     */
+    static void downmixF32( const float* in, size_t numchan, const float* coefL,
+                            const float* coefR, float* outL, float* outR, size_t n );
+
+    /// @return the name of the selected implementation: "scalar", "sse2", "ssse3", "avx2" or "neon"
+    static const char* getImplName();
+
+    /**
+     * Selects an implementation by name, if it is supported by the CPU. Not
+     * thread-safe - call it before encoding starts (for testing and benchmarks).
+     *
+     * @return true on success
+     */
+    static bool selectImpl( const char* name );
+
+    struct Kernels
+    {
+        const char* name;
+        void (*u8ToS16)( const uint8_t*, int16_t*, size_t );
+        void (*u8StereoToS16)( const uint8_t*, int16_t*, int16_t*, size_t );
+        void (*s24ToS32)( const uint8_t*, int32_t*, size_t );
+        void (*s24StereoToS32)( const uint8_t*, int32_t*, int32_t*, size_t );
+        void (*s32StereoSplit)( const int32_t*, int32_t*, int32_t*, size_t );
+        void (*f64ToF32)( const double*, float*, size_t );
+        void (*f64StereoToF32)( const double*, float*, float*, size_t );
+        void (*s16ToF32)( const int16_t*, float*, size_t );
+        void (*s32ToF32)( const int32_t*, float*, size_t );
+        void (*downmixF32)( const float*, size_t, const float*, const float*, float*, float*,
+                            size_t );
+    };
+
+  private:
+    SampleConv();  // Static methods only
+
+    static void init();
+    static const Kernels& kernels();
+
+    static Kernels sKernels;
+};
+
+
+} // namespace
+
+#endif // __SAMPLECONV_H__
@@ -0,0 +1,63 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+
+#ifndef __SCHEDULEPOLICY_H__
+#define __SCHEDULEPOLICY_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace wav2mp3 {
+
+
+/// A wav file waiting to be enqueued by the work manager
+struct ScheduledFile
+{
+    std::string uri;
+    uint64_t    cost;  // Estimated encoding cost, set only if the policy uses it
+
+    explicit ScheduledFile( const std::string& fileUri ): uri(fileUri), cost(0) {}
+};
+
+
+/**
+ * Decides the order in which the work manager enqueues wav files.
+ * FIFO - directory order (default).
+ * LPT  - longest processing time first. Minimizes the makespan of a batch,
+ *        because a big file doesn't start last while the other cores idle.
+ * SJF  - shortest job first. Minimizes the mean latency per file.
+ */
+class SchedulePolicy
+{
+  public:
+    virtual ~SchedulePolicy() {}
+
+    virtual const char* getName() const = 0;
+
+    /// @return true if order() needs file costs
+    virtual bool usesCost() const = 0;
+
+    /// Sorts files in processing order
+    virtual void order( std::vector<ScheduledFile>& files ) const = 0;
+
+    /**
+     * Creates a policy by name: "fifo", "lpt" or "sjf".
+     *
+     * @return new policy (to be deleted by the caller), NULL if the name is unknown
+     */
+    static SchedulePolicy* create( const std::string& name );
+
+    /**
+     * Estimates the encoding cost of a wav file as the number of samples (in all
+     * channels) in its wav chunks. Reads only the headers. Falls back to the file
+     * size if the file can't be parsed.
+     */
+    static uint64_t estimateCost( const std::string& uri );
+};
+
+
+} // namespace
+
+#endif // __SCHEDULEPOLICY_H__
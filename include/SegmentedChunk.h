@@ -0,0 +1,134 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+
+#ifndef __SEGMENTEDCHUNK_H__
+#define __SEGMENTEDCHUNK_H__
+
+#if defined(__GXX_EXPERIMENTAL_CXX0X) || __cplusplus >= 201103L
+ #include <memory>
+ using std::shared_ptr;
+#else  // TR1
+ #include <tr1/memory>
+ using std::tr1::shared_ptr;
+#endif  // c++11
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <fstream>
+#include <vector>
+#include "WavFile.h"
+#include "Mp3Writer.h"
+#include "EncodeCache.h"
+#include "BufferPool.h"
+
+namespace wav2mp3 {
+
+
+/**
+ * A wav chunk split in time segments, which are encoded in parallel by several
+ * workers, each with its own LAME context. Segment boundaries are aligned to
+ * mp3 frames. Each segment is encoded starting OVERLAP_FRAMES mp3 frames earlier
+ * (to prime LAME's psychoacoustic model) and ending TAIL_FRAMES later (LAME's
+ * look-ahead), and only the mp3 frames which belong to the segment are kept.
+ * The bit reservoir is disabled, so mp3 frames don't depend on each other and
+ * segment outputs can be simply concatenated.
+ * The object collects segment outputs and writes them in order in the mp3 file.
+ */
+class SegmentedChunk
+{
+  public:
+    static const uint32_t OVERLAP_FRAMES     = 8;    // mp3 frames
+    static const uint32_t TAIL_FRAMES        = 4;    // mp3 frames
+    static const uint32_t MIN_SEGMENT_FRAMES = 256;  // mp3 frames, ~6.7 s at 44.1 kHz
+
+    /**
+     * Constructor. Takes the current wav chunk of wavFile, which must be read
+     * in memory, mapped, or streamed.
+     *
+     * @param[in] wavFilePtr - wav file positioned on the chunk
+     * @param[in] mp3Uri - output file URI
+     * @param[in] maxSegments - split in no more than that many segments
+     * @param[in] writer - output stage for the mp3 file, NULL - write synchronously
+     */
+    SegmentedChunk( shared_ptr<WavFile> wavFilePtr, const std::string& mp3Uri,
+                    unsigned int maxSegments, Mp3Writer* writer=NULL );
+    ~SegmentedChunk();
+
+    const std::string& getWavUri() const { return mWavUri; }
+    const std::string& getMp3Uri() const { return mMp3Uri; }
+    const FMTHeader& getFormat() const { return mFmt; }
+    uint32_t getChannelMask() const { return mChannelMask; }
+    uint64_t getNumFrames() const { return mNumFrames; }  // wav frames
+    uint32_t getMp3FrameSize() const { return mMp3FrameSize; }  // wav frames in an mp3 frame
+    int getNumSegments() const { return mBounds.size() - 1; }
+    uint64_t getSegmentBegin( int segment ) const { return mBounds[segment]; }
+    uint64_t getSegmentEnd( int segment ) const { return mBounds[segment+1]; }
+
+    /**
+     * Returns count wav frames starting from frame first. Points in the file
+     * data if it is in memory, otherwise reads the frames in buf from file.
+     *
+     * @return pointer to the frames, NULL on error
+     */
+    const char* readFrames( uint64_t first, uint32_t count, PooledBuffer<char>& buf,
+                            std::ifstream& file ) const;
+
+    /// The mp3 file fails the ticket if it can't be written. Set before encoding.
+    void setCacheTicket( shared_ptr<EncodeCache::Ticket> ticket ) { mTicket = ticket; }
+    /// The mp3 file fails the progress ticket if it can't be written. Set before encoding.
+    void setProgressTicket( shared_ptr<Progress::Ticket> progress ) { mProgress = progress; }
+
+    /**
+     * Stores the mp3 frames of an encoded segment (swaps mp3Data) and passes all
+     * segments completed so far in order to the writer. If a segment fails the
+     * mp3 file is removed, if any segment was written to it. Otherwise an mp3
+     * file left by an earlier run stays.
+     *
+     * @return true if this was the last segment to complete
+     */
+    bool addSegmentOutput( int segment, std::vector<unsigned char>& mp3Data, bool ok );
+
+    /// @return true if a segment failed
+    bool hasFailed() const;
+
+    /**
+     * Finds the beginning of an mp3 frame in a buffer with whole mp3 frames.
+     *
+     * @return offset of mp3 frame number frameIdx, size if there are fewer frames
+     */
+    static size_t findMp3FrameOffset( const unsigned char* buf, size_t size, uint32_t frameIdx );
+
+  private:
+    SegmentedChunk( const SegmentedChunk& );  // Disable copying.
+    SegmentedChunk& operator=( const SegmentedChunk& );  // Disable assignment.
+
+    shared_ptr<WavFile> mWavFilePtr;  // Keeps file data in memory
+    std::string mWavUri;
+    std::string mMp3Uri;
+    FMTHeader   mFmt;
+    uint32_t    mChannelMask;
+    const char* mData;          // NULL if the file is streamed
+    uint64_t    mDataOffset;    // File offset of the audio data
+    uint64_t    mNumFrames;
+    uint32_t    mMp3FrameSize;
+    std::vector<uint64_t> mBounds;  // Segment boundaries in wav frames
+
+    // Output state, protected by mMutex
+    std::vector< std::vector<unsigned char> > mOutputs;
+    std::vector<bool> mDone;
+    int  mNextToWrite;
+    int  mNumDone;
+    bool mFailed;
+    Mp3Writer* mWriter;
+    shared_ptr<Mp3Writer::File> mMp3File;
+    shared_ptr<EncodeCache::Ticket> mTicket;
+    shared_ptr<Progress::Ticket> mProgress;
+    mutable pthread_mutex_t mMutex;
+};
+
+
+} // namespace
+
+#endif // __SEGMENTEDCHUNK_H__
@@ -0,0 +1,98 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <set>
+#include "Converter.h"
+
+namespace wav2mp3 {
+
+
+/**
+ * Conversion server: accepts connections on a Unix domain socket and converts
+ * the requests (see ServerProtocol.h) with a converter, whose threads and
+ * buffer pools stay warm between requests. Each connection is served by its
+ * own thread, one request at a time, so clients get parallelism by opening
+ * several connections. Connections over a limit wait in the listen backlog
+ * until others close. POSIX only.
+ */
+class Server
+{
+  public:
+    static const unsigned int DEFAULT_MAX_CONNECTIONS = 64;
+
+    /**
+     * Constructor. Listens on the socket, replacing the socket file of a server
+     * which is gone. Fails if the path is another file or a socket in use.
+     * Check isListening() for errors.
+     *
+     * @param[in] converter - converts the requests, must outlive the server
+     * @param[in] socketUri - file system path of the socket
+     * @param[in] maxConnections - connections served at once (each has a thread)
+     * @param[in] maxPayload - bigger requests close the connection, 0 - the
+     *            protocol default (protocol::MAX_PAYLOAD)
+     */
+    Server( Converter& converter, const std::string& socketUri,
+            unsigned int maxConnections=DEFAULT_MAX_CONNECTIONS, uint32_t maxPayload=0 );
+
+    /// Destructor. Stops the server and removes the socket file.
+    ~Server();
+
+    bool isListening() const { return mFd >= 0; }
+
+    /**
+     * Accepts connections until stop() is called, then waits for the
+     * connections to finish their requests in progress.
+     *
+     * @return false on error
+     */
+    bool run();
+
+    /**
+     * Stops accepting connections and reading requests - idle connections are
+     * closed, busy ones after their response. May be called from another thread.
+     */
+    void stop();
+
+    /// @return the number of requests served (successful or not)
+    unsigned long getNumRequests() const;
+
+  private:
+    Server( const Server& );  // Disable copying.
+    Server& operator=( const Server& );  // Disable assignment.
+
+    struct Connection
+    {
+        Server* server;
+        int     fd;
+    };
+
+    static void* connectionMain( void* arg );
+    void serve( int fd );
+    /// Converts a request and sends the response. @return false if the connection failed.
+    bool handle( int fd, const char* type, const std::vector<unsigned char>& payload );
+    bool isStopping();
+
+    Converter&      mConverter;
+    std::string     mSocketUri;
+    int             mFd;          // Listening socket, -1 if not listening
+    int             mStopFds[2];  // Pipe, which wakes up run() when written
+    bool            mStopping;
+    std::set<int>   mConnections; // Sockets of the open connections
+    unsigned int    mMaxConnections;
+    uint32_t        mMaxPayload;
+    unsigned long   mNumRequests;
+    mutable pthread_mutex_t mMutex;
+    pthread_cond_t  mClosedCVar;  // Signaled when a connection is closed or on stop
+};
+
+
+} // namespace
+
+#endif // __SERVER_H__
@@ -0,0 +1,150 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+
+#ifndef __SERVERPROTOCOL_H__
+#define __SERVERPROTOCOL_H__
+
+#include <stdint.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+namespace wav2mp3 {
+
+
+/**
+ * Framed protocol of the conversion server (see Server), over a Unix domain
+ * stream socket. Each message is a frame: a 4-character type, the payload
+ * size (32-bit little-endian) and the payload. A connection carries any
+ * number of requests, each answered by one response, in order.
+ *
+ * Requests:
+ *   "WAV " - a wav file image. Response "MP3 " with the mp3 data.
+ *   "PATH" - URI of a wav file on the server. The mp3 files are written next
+ *            to it, as by the command line tool. Response "DONE".
+ * Any request may get "FAIL" with an error message instead.
+ */
+namespace protocol {
+
+const char WAV[]  = "WAV ";
+const char PATH[] = "PATH";
+const char MP3[]  = "MP3 ";
+const char DONE[] = "DONE";
+const char FAIL[] = "FAIL";
+
+const size_t   HEADER_SIZE = 8;
+/// Default limit of the payload size - bigger payloads are refused, they are held in memory
+const uint32_t MAX_PAYLOAD = 256 * 1024 * 1024;
+/// The payload buffer grows by at least this much as the bytes arrive
+const size_t   PAYLOAD_STEP = 1024 * 1024;
+
+
+/// Writes all bytes, retrying after signals. @return false on error.
+inline bool sendAll( int fd, const void* data, size_t size )
+{
+    const char* p = static_cast<const char*>(data);
+    while( size > 0 )
+    {
+#ifdef MSG_NOSIGNAL
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);  // No SIGPIPE if the peer is gone
+#else
+        ssize_t n = send(fd, p, size, 0);
+#endif  // MSG_NOSIGNAL
+        if( n < 0 )
+        {
+            if( EINTR == errno ) continue;
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+
+/// Reads exactly size bytes, retrying after signals. @return false on error or at the end.
+inline bool recvAll( int fd, void* data, size_t size )
+{
+    char* p = static_cast<char*>(data);
+    while( size > 0 )
+    {
+        ssize_t n = recv(fd, p, size, 0);
+        if( n < 0 )
+        {
+            if( EINTR == errno ) continue;
+            return false;
+        }
+        if( 0 == n ) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+
+/// @return false on error
+inline bool writeFrame( int fd, const char* type, const void* data, uint32_t size )
+{
+    unsigned char header[HEADER_SIZE];
+    memcpy(header, type, 4);
+    for( int i=0; i<4; i++ ) header[4 + i] = (unsigned char) (size >> (8 * i));
+    return sendAll(fd, header, sizeof(header)) && sendAll(fd, data, size);
+}
+
+
+inline bool writeFrame( int fd, const char* type, const std::string& text )
+{
+    return writeFrame(fd, type, text.data(), (uint32_t) text.size());
+}
+
+
+/**
+ * Reads a frame. The payload buffer grows as the bytes arrive, so a peer only
+ * announcing a big payload doesn't get the memory for it.
+ *
+ * @param[out] type - 4 characters, not terminated
+ * @param[out] payload - resized to the payload size
+ * @param[in] maxPayload - bigger payloads are refused
+ * @return false on error, at the end of the connection or if the payload is too big
+ */
+inline bool readFrame( int fd, char* type, std::vector<unsigned char>& payload,
+                       uint32_t maxPayload=MAX_PAYLOAD )
+{
+    unsigned char header[HEADER_SIZE];
+    if( !recvAll(fd, header, sizeof(header)) ) return false;
+    memcpy(type, header, 4);
+    uint32_t size = 0;
+    for( int i=0; i<4; i++ ) size |= (uint32_t) header[4 + i] << (8 * i);
+    if( size > maxPayload ) return false;
+
+    payload.clear();  // Keeps the capacity of earlier frames
+    while( payload.size() < size )
+    {
+        // Doubles the received size, for a linear total cost of the copies
+        size_t pos = payload.size();
+        size_t n = std::min<size_t>(size - pos, std::max(pos, PAYLOAD_STEP));
+        payload.resize(pos + n);
+        if( !recvAll(fd, &payload[pos], n) ) return false;
+    }
+    return true;
+}
+
+
+/// @return true if a frame type (4 characters) is the given one
+inline bool isType( const char* type, const char* expected )
+{
+    return !strncmp(type, expected, 4);
+}
+
+} // namespace protocol
+
+
+} // namespace
+
+#endif // __SERVERPROTOCOL_H__
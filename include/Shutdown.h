@@ -0,0 +1,80 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+
+#ifndef __SHUTDOWN_H__
+#define __SHUTDOWN_H__
+
+#include <pthread.h>
+
+namespace wav2mp3 {
+
+
+/**
+ * Cooperative cancellation on SIGINT and SIGTERM. The signals are blocked in
+ * all threads and taken by a signal thread (sigtimedwait), so no work is done
+ * in a signal handler. On the first signal the run is cancelled: no new work
+ * should be started, and the work in flight may finish within a grace period.
+ * When the grace period is over, or on a second signal, the run is aborted:
+ * the work in flight should stop and clean up.
+ * On Windows a signal handler sets the flags and the signal thread only
+ * watches the grace period.
+ */
+class Shutdown
+{
+  public:
+    typedef void (*Callback)( void* arg );
+
+    /// Blocks the signals in the calling thread and the threads it creates later. Call it first.
+    static void blockSignals();
+
+    /**
+     * Starts the signal thread.
+     *
+     * @param[in] graceSeconds - time for the work in flight after the first signal, 0 - abort at once
+     * @param[in] onCancel - called in the signal thread on the first signal (e.g. to wake up
+     *                       blocked threads), may be NULL
+     * @param[in] arg - passed to onCancel
+     */
+    Shutdown( unsigned int graceSeconds, Callback onCancel, void* arg );
+
+    /// Destructor. Stops the signal thread.
+    ~Shutdown();
+
+    /// Stops the signal thread. Signals received later stay pending.
+    void stop();
+
+    /// @return true after the first signal - don't start new work
+    static bool isCancelled();
+    /// @return true when the work in flight should stop
+    static bool isAborted();
+    /// @return flag which is non-zero when aborted (see Encoder::setAbortFlag())
+    static const int* getAbortFlag();
+    /// @return the first signal received, 0 if none
+    static int getSignal();
+
+    /// Cancels the run as a signal would - the second call aborts it. Safe in a signal handler.
+    static void onSignal( int sig );
+
+  private:
+    Shutdown( const Shutdown& );  // Disable copying.
+    Shutdown& operator=( const Shutdown& );  // Disable assignment.
+
+    static void* threadMain( void* arg );
+    void run();
+    bool isStopping();
+
+    unsigned int    mGraceSeconds;
+    Callback        mOnCancel;
+    void*           mArg;
+    bool            mStopping;
+    bool            mJoined;
+    pthread_t       mThread;
+    pthread_mutex_t mMutex;
+    pthread_cond_t  mStopCVar;
+};
+
+
+} // namespace
+
+#endif // __SHUTDOWN_H__
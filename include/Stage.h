@@ -0,0 +1,250 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+
+#ifndef __STAGE_H__
+#define __STAGE_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <ostream>
+#include "LockFreeQueue.h"
+#include "Locker.h"
+#include "Tracer.h"
+
+namespace wav2mp3 {
+
+
+/// Occupancy of a pipeline stage, to find the bottleneck
+struct StageStats
+{
+    std::string  name;
+    unsigned int threads;
+    uint64_t     tasks;           // Tasks done
+    double       busySeconds;     // Time spent on tasks, summed over the threads
+    double       elapsedSeconds;  // Since the stage was started
+    size_t       queueCapacity;   // Summed over the queues of the stage
+    double       avgQueueDepth;   // Mean number of queued tasks seen by new tasks
+    size_t       peakQueueDepth;
+    double       blockedSeconds;  // Time submitters waited for a full queue
+
+    StageStats(): name(), threads(0), tasks(0), busySeconds(0), elapsedSeconds(0),
+                  queueCapacity(0), avgQueueDepth(0), peakQueueDepth(0), blockedSeconds(0) {}
+
+    /// @return busy fraction of the stage's threads, 0 - 1
+    double getUtilization() const;
+
+    /// Prints a line like "encode: 8 thread(s), 120 task(s), busy 97.5%, queue 15.2/16 ..."
+    void print( std::ostream& out ) const;
+};
+
+
+/**
+ * Collects the occupancy of a stage: the busy time of its threads and the
+ * depth of its queue when tasks are submitted. Thread safe.
+ */
+class StageMeter
+{
+  public:
+    explicit StageMeter( const std::string& name );
+    ~StageMeter();
+
+    /// Starts the elapsed time
+    void start( unsigned int threads, size_t queueCapacity );
+    /// Records a submitted task, which found depth tasks queued
+    void addSubmit( size_t depth, double blockedUs );
+    /// Records a task done in the given time (in us)
+    void addTask( double busyUs );
+
+    StageStats getStats() const;
+
+  private:
+    StageMeter( const StageMeter& );  // Disable copying.
+    StageMeter& operator=( const StageMeter& );  // Disable assignment.
+
+    StageStats mStats;
+    double     mStartTime;   // us
+    double     mDepthSum;
+    uint64_t   mNumSubmits;
+    mutable pthread_mutex_t mMutex;
+};
+
+
+/**
+ * A pipeline stage: a bounded queue of tasks processed by a pool of threads.
+ * Submitting blocks while the queue is full, so a slow stage holds back the
+ * stages before it and memory use stays bounded.
+ * T is copyable and default constructible (e.g. a shared_ptr). The default
+ * value T() is reserved - it tells a thread to exit.
+ */
+template <typename T>
+class Stage
+{
+  public:
+    /// Processes the tasks of a stage
+    class Handler
+    {
+      public:
+        virtual ~Handler() {}
+        /// Called once in each thread (0 based index) before its first task
+        virtual void initThread( unsigned int /*thread*/ ) {}
+        virtual void process( T& task, unsigned int thread ) = 0;
+    };
+
+    /**
+     * Constructor. Threads are started by start().
+     *
+     * @param[in] name - stage name, threads are named "<name> <N>" in traces
+     * @param[in] numThreads - number of threads, at least 1
+     * @param[in] queueSize - queue capacity (rounded up to a power of 2)
+     * @param[in] handler - processes the tasks, must outlive the stage
+     */
+    Stage( const std::string& name, unsigned int numThreads, unsigned int queueSize,
+           Handler& handler );
+
+    /// Destructor. Stops the threads if not stopped.
+    ~Stage();
+
+    void start();
+
+    /// Queues a task. Blocks while the queue is full.
+    void submit( const T& task );
+
+    /// Lets the threads finish the queued tasks, then joins them
+    void stop();
+
+    const std::string& getName() const { return mName; }
+    unsigned int getNumThreads() const { return mNumThreads; }
+    StageStats getStats() const { return mMeter.getStats(); }
+
+  private:
+    Stage( const Stage& );  // Disable copying.
+    Stage& operator=( const Stage& );  // Disable assignment.
+
+    struct Thread
+    {
+        Stage*       stage;
+        unsigned int index;
+        pthread_t    thread;
+    };
+
+    static void* threadMain( void* arg );
+    void run( unsigned int index );
+
+    std::string      mName;
+    unsigned int     mNumThreads;
+    Handler&         mHandler;
+    LockFreeQueue<T> mQueue;
+    std::vector<Thread> mThreads;
+    bool             mRunning;
+    StageMeter       mMeter;
+};
+
+
+template <typename T>
+Stage<T>::Stage( const std::string& name, unsigned int numThreads, unsigned int queueSize,
+                 Handler& handler ):
+        mName(name),
+        mNumThreads(numThreads ? numThreads : 1),
+        mHandler(handler),
+        mQueue(queueSize ? queueSize : 1),
+        mThreads(),
+        mRunning(false),
+        mMeter(name)
+{
+}
+
+
+template <typename T>
+Stage<T>::~Stage()
+{
+    stop();
+}
+
+
+template <typename T>
+void Stage<T>::start()
+{
+    if( mRunning ) return;
+    mMeter.start(mNumThreads, mQueue.getCapacity());
+    mThreads.resize(mNumThreads);
+    for( unsigned int i=0; i<mNumThreads; i++ )
+    {
+        mThreads[i].stage = this;
+        mThreads[i].index = i;
+        pthread_create(&mThreads[i].thread, NULL, threadMain, &mThreads[i]);
+    }
+    mRunning = true;
+}
+
+
+template <typename T>
+void Stage<T>::submit( const T& task )
+{
+    size_t depth = mQueue.getSize();
+    if( mQueue.tryEnqueue(task) )
+    {
+        mMeter.addSubmit(depth, 0);
+        return;
+    }
+
+    // The queue is full - this stage is slower than the one submitting
+    double start = Tracer::now();
+    mQueue.enqueue(task);
+    mMeter.addSubmit(depth, Tracer::now() - start);
+}
+
+
+template <typename T>
+void Stage<T>::stop()
+{
+    if( !mRunning ) return;
+    for( unsigned int i=0; i<mNumThreads; i++ ) mQueue.enqueue(T());  // Exit after the queued tasks
+    for( unsigned int i=0; i<mNumThreads; i++ ) pthread_join(mThreads[i].thread, NULL);
+    mRunning = false;
+}
+
+
+template <typename T>
+void* Stage<T>::threadMain( void* arg )
+{
+    Thread* thread = static_cast<Thread*>(arg);
+    thread->stage->run(thread->index);
+    return NULL;
+}
+
+
+template <typename T>
+void Stage<T>::run( unsigned int index )
+{
+    if( Tracer::isEnabled() )
+    {
+        std::ostringstream name;
+        name << mName << " " << index + 1;
+        Tracer::setThreadName(name.str());
+    }
+    mHandler.initThread(index);
+
+    while( true )
+    {
+        T task;
+        {
+            TRACE_SCOPE("queue_wait");
+            task = mQueue.dequeue();
+        }
+        if( !task ) break;  // Stop requested
+
+        double start = Tracer::now();
+        mHandler.process(task, index);
+        task = T();  // Release the task before it is counted as done
+        mMeter.addTask(Tracer::now() - start);
+    }
+}
+
+
+} // namespace
+
+#endif // __STAGE_H__
@@ -0,0 +1,117 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+
+#ifndef __TRACER_H__
+#define __TRACER_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <ostream>
+
+namespace wav2mp3 {
+
+
+/**
+ * Optional timing instrumentation of the processing stages. Each thread
+ * records its spans (stage name, start, duration and optionally the file) in
+ * its own buffer, so there is no locking while tracing. When tracing is
+ * disabled (the default) a span costs one check of a flag.
+ * The spans can be written as a Chrome trace (JSON, for chrome://tracing or
+ * Perfetto) and summarized per stage and per thread.
+ *
+ * Usage: { TRACE_SCOPE("convert"); ...stage code... }
+ *        { TRACE_FILE_SCOPE("encode", uri); ...file processing... }
+ */
+class Tracer
+{
+  public:
+    /// Enables tracing. Call it before starting other threads.
+    static void enable();
+    static bool isEnabled() { return sEnabled; }
+
+    /// Names the calling thread in the trace
+    static void setThreadName( const std::string& name );
+
+    /// @return monotonic time in microseconds
+    static double now();
+
+    /// Records a span of the calling thread
+    static void record( const char* stage, double start, double end,
+                        const std::string& file = std::string() );
+
+    /**
+     * Writes all recorded spans in Chrome trace event format. Call it after
+     * the other threads are done.
+     *
+     * @return true on success
+     */
+    static bool writeChromeTrace( const std::string& uri );
+
+    /// Prints total time per stage and per thread and stage
+    static void printSummary( std::ostream& out );
+
+    /// Disables tracing and frees all recorded spans. Call it after the other threads are done.
+    static void reset();
+
+    /// Records the time from construction to destruction
+    class Scope
+    {
+      public:
+        explicit Scope( const char* stage ):
+            mStage(stage), mFile(NULL), mStart(sEnabled ? now() : 0) {}
+        /// @param[in] file - must outlive the scope
+        Scope( const char* stage, const std::string& file ):
+            mStage(stage), mFile(&file), mStart(sEnabled ? now() : 0) {}
+        ~Scope() { end(); }
+
+      private:
+        Scope( const Scope& );  // Disable copying.
+        Scope& operator=( const Scope& );  // Disable assignment.
+
+        void end()
+        {
+            if( sEnabled ) record(mStage, mStart, now(), mFile ? *mFile : std::string());
+        }
+
+        const char*        mStage;
+        const std::string* mFile;
+        double             mStart;
+    };
+
+  private:
+    Tracer();  // Static methods only
+
+    struct Span
+    {
+        const char* stage;
+        std::string file;
+        double      start;
+        double      duration;
+    };
+
+    struct ThreadSpans
+    {
+        int               tid;
+        std::string       name;
+        std::vector<Span> spans;
+    };
+
+    static ThreadSpans* getThreadSpans();
+
+    static bool sEnabled;
+};
+
+
+} // namespace
+
+#define TRACE_CONCAT2( a, b ) a ## b
+#define TRACE_CONCAT( a, b ) TRACE_CONCAT2(a, b)
+/// Traces the rest of the enclosing block as a stage
+#define TRACE_SCOPE( stage ) wav2mp3::Tracer::Scope TRACE_CONCAT(traceScope, __LINE__)(stage)
+/// Traces the rest of the enclosing block as a stage of processing a file
+#define TRACE_FILE_SCOPE( stage, file ) \
+    wav2mp3::Tracer::Scope TRACE_CONCAT(traceScope, __LINE__)(stage, file)
+
+#endif // __TRACER_H__
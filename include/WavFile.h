@@ -9,6 +9,7 @@
 #include <string>
 #include <fstream>
 #include <vector>
+#include "BufferPool.h"
 
 namespace wav2mp3 {
 
@@ -16,41 +17,138 @@ namespace wav2mp3 {
 struct RIFFHeader
 {
     char   riffid[4];    // "RIFF" in big endian (0x52494646). Strictly speaking must be int8_t
+                         // "RF64" or "BW64" for files with 64-bit sizes in a DS64Header
     uint32_t chunksz;    // The size of the rest of the chunk following this field.
                          // This is the size of the entire file in bytes minus 8 bytes */
     char   format[4];    // "WAVE" in big endian (0x57415645)
 } __attribute__((__packed__));
 
+/// 32-bit chunk size meaning that the real size is in the ds64 chunk (RF64/BW64)
+static const uint32_t RF64_SIZE_IN_DS64 = 0xFFFFFFFF;
+
+/// First chunk after the RIFF header of RF64/BW64 files
+struct DS64Header
+{
+    char   ds64id[4];    // "ds64" in big endian (0x64733634)
+    uint32_t chunksz;    // Size of the rest of the chunk, at least 28
+    uint64_t riffsz;     // 64-bit RIFF chunk size
+    uint64_t datasz;     // 64-bit data chunk size
+    uint64_t samplecnt;  // 64-bit sample count of the fact chunk
+    uint32_t tablelen;   // Number of 64-bit sizes of other chunks following this field
+} __attribute__((__packed__));
+
+/// Format tags
+enum
+{
+    WAVE_FORMAT_PCM        = 0x0001,
+    WAVE_FORMAT_IEEE_FLOAT = 0x0003,
+    WAVE_FORMAT_EXTENSIBLE = 0xFFFE  // The format tag is in the subformat GUID
+};
+
 struct FMTHeader
 {
     char   fmtid[4];     // "fmt " in big endian (0x666d7420)
-    uint32_t fmthsz;     // 16 for PCM - size of the rest of FMTHeader
-    uint16_t fmttag;     // 1 for PCM. Other values indicate compression
+    uint32_t fmthsz;     // 16 for PCM - size of the rest of FMTHeader (and the extension)
+    uint16_t fmttag;     // 1 for PCM, 3 for IEEE float. Other values indicate compression
     uint16_t numchan;    // Number of channels. Mono = 1, Stereo = 2, ...
     uint32_t samprate;   // Sampels per second: 8000, 44100, ...
     uint32_t byterate;   // Bytes per second == SampleRate * NumChannels * BitsPerSample/8
     uint16_t blkalign;   // Block align (frame size) == NumChannels * BitsPerSample/8
     uint16_t bitspersamp;// BitsPerSample (per channel) == 8 (unsigned), 16 (signed), 24, 32
+                         // or 32, 64 (float)
+} __attribute__((__packed__));
+
+/// Follows FMTHeader if fmttag is WAVE_FORMAT_EXTENSIBLE (fmthsz >= 40)
+struct FMTExtension
+{
+    uint16_t cbsize;     // Size of the rest of the extension, 22
+    uint16_t validbits;  // Valid bits in a sample, in the MSBs of bitspersamp
+    uint32_t chanmask;   // Speaker positions of the channels
+    uint8_t  subformat[16]; // GUID, the first 2 bytes are the format tag
 } __attribute__((__packed__));
 
 struct DataHeader
 {
     char   dataid[4];    // "data" in big endian (0x64617461)
     uint32_t datasz;     // Size of audio data below == NumSamples * NumChannels * BitsPerSample/8
+                         // RF64_SIZE_IN_DS64 if bigger than 4 GB
     // 44 bytes above this point (if headers are sequential)
     // Beginning of audio data - first frame, left sample, right sample, ...
 } __attribute__((__packed__));
 
 
+/// Format and size of the wav data in a file, learnt from its headers only
+struct WavInfo
+{
+    FMTHeader    fmt;        // Format of the first wav chunk (see WavFile::getFormat())
+    uint32_t     chanmask;   // Speaker positions of the first wav chunk
+    unsigned int numChunks;  // Number of wav chunks, 0 if there is no supported audio
+    uint64_t     dataSize;   // Audio data bytes in all chunks
+    uint64_t     numFrames;  // Frames in all chunks
+    double       duration;   // Seconds of audio in all chunks
+};
+
+
+/// Sequential source of wav file bytes, e.g. a pipe or a callback. Can't seek.
+class WavStream
+{
+  public:
+    virtual ~WavStream() {}
+
+    /**
+     * Reads up to size bytes. Blocks until some bytes are available.
+     *
+     * @return the number of bytes read, 0 at the end of the stream or on error
+     */
+    virtual size_t read( char* buf, size_t size ) = 0;
+};
+
+
 class WavFile
 {
   public:
+    /// Maximum number of channels. More than 2 are mixed down to stereo.
+    static const uint16_t MAX_CHANNELS = 8;
+
+    /**
+     * How the file contents are accessed.
+     * READ_ENTIRE - the whole file is read in memory (by the manager thread).
+     * READ_MMAP   - the whole file is memory mapped, audio data is not copied.
+     *               Falls back to READ_ENTIRE if mapping is not possible.
+     * READ_STREAM - only the headers are kept in memory, audio data is read block
+     *               by block while encoding, so memory usage doesn't depend on
+     *               the file size.
+     */
+    enum ReadMode { READ_ENTIRE, READ_MMAP, READ_STREAM };
+
     /**
      * Constructor. Opens the file. May throws on error.
      *
      * @param[in] URI of the file
+     * @param[in] read mode
      */
-    WavFile( const std::string& uri );
+    WavFile( const std::string& uri, ReadMode mode=READ_ENTIRE );
+
+    /**
+     * Constructor for a wav file image in memory (READ_ENTIRE mode). The data
+     * is not copied and must outlive the object. The file system is never
+     * touched - a NULL or empty image has no wav chunks.
+     *
+     * @param[in] name - used as the URI, in logs and for mp3 names
+     */
+    WavFile( const char* data, size_t size, const std::string& name );
+
+    /**
+     * Constructor for a wav file read from a stream (READ_STREAM mode). The
+     * stream is read once, front to back, so the file can't be rewound. A data
+     * chunk with unknown size (0xFFFFFFFF without a ds64 chunk, or 0 as written
+     * by recorders which can't seek back) extends to the end of the stream.
+     * Audio blocks are returned as soon as the stream has whole frames, they may
+     * be shorter than requested. The stream must outlive the object.
+     *
+     * @param[in] name - used as the URI, in logs and for mp3 names
+     */
+    WavFile( WavStream& stream, const std::string& name );
 
     /**
      * Destructor. Closes the file if open
@@ -58,43 +156,141 @@ class WavFile
     ~WavFile();
 
     std::string getURI() const { return mFileUri; }
+    ReadMode getReadMode() const { return mReadMode; }
 
     /**
-     * Read entire file in memory and close it. May throw.
+     * Read entire file in memory (or map it in READ_MMAP mode) and close it.
+     * May throw. Does nothing in READ_STREAM mode.
      *
      * @return the size of the file in memory, 0 on error
      */
-    int readEntireFile();
+    size_t readEntireFile();
+
+    /// Whole file after readEntireFile(), NULL if it isn't in memory (READ_STREAM mode)
+    const char* getFileData() const { return mFileBeg; }
 
     /**
-     * Parses the file in memory and sets header pointers.
-     * Assuming little endian host architecture.
+     * Finds the next wav chunk (in memory or from the stream) and sets header
+     * pointers. Hops from chunk to chunk by their sizes, so audio data is never
+     * searched. Assuming little endian host architecture.
      *
      * @return true on success, false on error or WAV data not found
      */
     bool findNextWavChunk();
 
+    /// Start parsing from the beginning of the file again. Not possible with a WavStream.
+    void rewind();
+
+    /**
+     * Walks the chunks of a file reading only their headers (a few KB), without
+     * reading the audio data. Cheap enough to plan and schedule work before
+     * committing memory to the file.
+     *
+     * @param[in] uri - the wav file
+     * @param[out] info - format and sizes, zeroed on error
+     * @return true if the file has supported wav chunks
+     */
+    static bool probe( const std::string& uri, WavInfo& info );
+
     // Methods below are for the current wav chunk
     uint16_t getNumChannels() const;
     uint32_t getSampleRate() const;
     uint32_t getByteRate() const;
     uint16_t getFrameSize() const;
     uint16_t getBitsPerSample() const;
+    /// @return true if the samples are IEEE floats (32 or 64 bits), false if PCM integers
+    bool isFloat() const;
+    /// @return speaker positions of the channels (WAVE_FORMAT_EXTENSIBLE), 0 if not given
+    uint32_t getChannelMask() const;
+    /**
+     * Copy of the current FMT header, zeroed if there is no current chunk.
+     * Extensible headers are reduced to the basic header: fmttag is the
+     * subformat (PCM or IEEE float) and fmthsz is 16.
+     */
+    FMTHeader getFormat() const;
 
+    /// NULL in READ_STREAM mode - use getNextAudioBlock()
     const char* getRawAudioDataPtr() const;
-    uint32_t getRawAudioDataSize() const;
+    /// 64-bit for RF64/BW64 files
+    uint64_t getRawAudioDataSize() const;
+    /// Offset of the audio data from the beginning of the file
+    uint64_t getRawAudioDataOffset() const;
+
+    /**
+     * Returns the next block of raw audio data from the current wav chunk.
+     * In READ_ENTIRE and READ_MMAP modes the block points in the file data (no copying). In
+     * READ_STREAM mode the block is read in an internal buffer, which is valid
+     * until the next call.
+     *
+     * @param[in] maxBytes - maximum block size, should be a multiple of frame size
+     * @param[out] size - the size of the returned block, 0 at the end of the chunk
+     * @return pointer to the block, NULL at the end of the chunk or on error
+     */
+    const char* getNextAudioBlock( uint32_t maxBytes, uint32_t& size );
+
+    /// @return true if getNextAudioBlock() ended the current chunk early on an error
+    bool hasReadError() const { return mReadError; }
 
   private:
     WavFile( const WavFile& );  // Disable copying.
     WavFile& operator=( const WavFile& );  // Disable assignment.
 
+    bool readAt( uint64_t pos, char* buf, size_t size );
+    /**
+     * Reads from mStream until size bytes or the end. With a unit, returns as
+     * soon as a multiple of unit bytes is read, so data arriving slowly (live
+     * input from a pipe) is passed on without waiting for the whole buffer.
+     *
+     * @return the bytes read
+     */
+    size_t readStream( char* buf, size_t size, size_t unit=0 );
+    /// Skips mStream forward to pos. @return false if pos is behind or after the end
+    bool skipStream( uint64_t pos );
+    bool walkToNextDataChunk();
+    /**
+     * Parses a fmt chunk with size bytes available (including the chunk header).
+     *
+     * @param[out] fmt - the reduced header (see getFormat())
+     * @param[out] chanmask - speaker positions of the channels, 0 if not given
+     * @return true if the format is supported
+     */
+    static bool parseFormat( const char* chunk, size_t size, FMTHeader& fmt, uint32_t& chanmask );
+    /// @return true for "RIFF", "RF64" and "BW64"
+    static bool isRiffId( const char* id );
+    /// Data size of the current chunk from its header, or from the ds64 chunk
+    uint64_t getDataSize() const;
+#ifndef _WIN32
+    bool mapEntireFile();
+#endif  // _WIN32
+
     std::string mFileUri;
+    ReadMode mReadMode;
     std::ifstream mFile;
-    std::vector<char> mFileData; // The entire file contents
+    WavStream* mStream;     // Instead of mFile, may be NULL
+    uint64_t mStreamPos;    // Bytes read from mStream
+    PooledBuffer<char> mFileData; // The entire file contents (READ_ENTIRE mode), from the shared pool
+    char*    mFileBeg;     // Points to mFileData or to the mapping (READ_MMAP mode)
+    size_t   mFileSize;
+    bool     mMapped;      // mFileBeg must be unmapped
+    bool     mImage;       // mFileBeg is an image given by the caller, mFileUri is only a name
 
-    RIFFHeader* mRiffHPtr; // Should be equal to beginning of mFileData
-    FMTHeader*  mFmtHPtr;  // Points to FMTHeader of the current chunk
+    // Header pointers point to the copies below, NULL until the headers are found
+    RIFFHeader* mRiffHPtr;
+    FMTHeader*  mFmtHPtr;  // Points to the reduced FMTHeader of the current chunk
     DataHeader* mDataHPtr; // Points to DataHeader of the current chunk
+    uint64_t    mBlockPos; // Offset of the next audio block in the current chunk
+    bool        mReadError; // The audio data of the current chunk couldn't be read
+    uint64_t    mDs64DataSize; // Data size from the ds64 chunk, 0 if there is none
+
+    RIFFHeader mRiffHeader;
+    FMTHeader  mFmtHeader;
+    DataHeader mDataHeader;
+    uint32_t   mChannelMask;
+
+    uint64_t   mTotalSize;     // Total file size
+    uint64_t   mDataPos;       // File offset of the current chunk's audio data
+    uint64_t   mNextChunkPos;  // File offset of the next chunk header
+    PooledBuffer<char> mBlockBuf;  // READ_STREAM mode block
 };
 
 
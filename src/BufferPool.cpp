@@ -0,0 +1,164 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+#include <cstdlib>
+#ifdef __linux__
+ #include <sys/mman.h>
+#endif  // __linux__
+#include "BufferPool.h"
+#include "Locker.h"
+
+using namespace wav2mp3;
+
+
+size_t BufferPool::sSharedMaxCachedBytes = 256 * 1024 * 1024;
+bool   BufferPool::sSharedHugePages = false;
+
+
+BufferPool::BufferPool( size_t maxCachedBytes, bool hugePages ):
+        mMaxCachedBytes(maxCachedBytes),
+        mHugePages(hugePages),
+        mCachedBytes(0),
+        mNumAllocations(0),
+        mNumReuses(0),
+        mFreeBlocks()
+{
+    pthread_mutex_init(&mMutex, NULL);
+}
+
+
+BufferPool::~BufferPool()
+{
+    for( size_t c=0; c<mFreeBlocks.size(); c++ )
+    {
+        size_t capacity = getClassCapacity(c);
+        for( size_t i=0; i<mFreeBlocks[c].size(); i++ ) freeBlock(mFreeBlocks[c][i], capacity);
+    }
+    pthread_mutex_destroy(&mMutex);
+}
+
+
+BufferPool& BufferPool::getShared()
+{
+    static BufferPool sharedPool(sSharedMaxCachedBytes, sSharedHugePages);
+    return sharedPool;
+}
+
+
+void BufferPool::configureShared( size_t maxCachedBytes, bool hugePages )
+{
+    sSharedMaxCachedBytes = maxCachedBytes;
+    sSharedHugePages = hugePages;
+}
+
+
+/// Size classes are MIN_BLOCK_SIZE * 1, 1.5, 2, 3, 4, 6, 8, ...
+size_t BufferPool::getClassCapacity( int sizeClass )
+{
+    size_t pow2 = (size_t) MIN_BLOCK_SIZE << (sizeClass / 2);
+    return (sizeClass & 1) ? pow2 + pow2 / 2 : pow2;
+}
+
+
+/// @return the smallest class with capacity >= size
+int BufferPool::getSizeClass( size_t size, size_t& capacity )
+{
+    int c = 0;
+    while( (capacity = getClassCapacity(c)) < size ) c++;
+    return c;
+}
+
+
+void* BufferPool::allocate( size_t size, size_t& capacity )
+{
+    if( size > ((size_t) -1 >> 2) ) return NULL;
+    int c = getSizeClass(size, capacity);
+    {
+        Locker lock(mMutex);
+        if( (size_t) c < mFreeBlocks.size() && !mFreeBlocks[c].empty() )
+        {
+            void* block = mFreeBlocks[c].back();
+            mFreeBlocks[c].pop_back();
+            mCachedBytes -= capacity;
+            mNumReuses++;
+            return block;
+        }
+        mNumAllocations++;
+    }
+    return allocateBlock(capacity);
+}
+
+
+void BufferPool::release( void* block, size_t capacity )
+{
+    if( NULL == block ) return;
+
+    size_t classCapacity;
+    int c = getSizeClass(capacity, classCapacity);
+    {
+        Locker lock(mMutex);
+        if( mCachedBytes + capacity <= mMaxCachedBytes )
+        {
+            try {
+                if( mFreeBlocks.size() <= (size_t) c ) mFreeBlocks.resize(c + 1);
+                mFreeBlocks[c].push_back(block);
+                mCachedBytes += capacity;
+                return;
+            } catch(...) {
+                // Free it below
+            }
+        }
+    }
+    freeBlock(block, capacity);
+}
+
+
+void* BufferPool::allocateBlock( size_t capacity )
+{
+#ifdef __linux__
+    if( mHugePages && (capacity >= HUGE_PAGE_SIZE) )
+    {
+        void* block = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if( MAP_FAILED == block ) return NULL;
+ #ifdef MADV_HUGEPAGE
+        madvise(block, capacity, MADV_HUGEPAGE);
+ #endif
+        return block;
+    }
+#endif  // __linux__
+    return malloc(capacity);
+}
+
+
+void BufferPool::freeBlock( void* block, size_t capacity )
+{
+#ifdef __linux__
+    if( mHugePages && (capacity >= HUGE_PAGE_SIZE) )
+    {
+        munmap(block, capacity);
+        return;
+    }
+#endif  // __linux__
+    free(block);
+}
+
+
+size_t BufferPool::getCachedBytes() const
+{
+    Locker lock(mMutex);
+    return mCachedBytes;
+}
+
+
+uint64_t BufferPool::getNumAllocations() const
+{
+    Locker lock(mMutex);
+    return mNumAllocations;
+}
+
+
+uint64_t BufferPool::getNumReuses() const
+{
+    Locker lock(mMutex);
+    return mNumReuses;
+}
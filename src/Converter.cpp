@@ -0,0 +1,255 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+#ifdef _WIN32
+ #include <windows.h>
+#else  // POSIX
+ #include <unistd.h>
+#endif  // _WIN32
+
+#include <exception>
+#include "Converter.h"
+#include "CpuAffinity.h"
+#include "Locker.h"
+#include "Log.h"
+
+using namespace wav2mp3;
+
+
+namespace {
+
+/// Buffers cached by the pool of each thread - enough for the blocks of one conversion
+const size_t WORKER_POOL_BYTES = 16 * 1024 * 1024;
+
+
+/// Collects the mp3 data in memory
+class VectorSink: public Mp3Sink
+{
+  public:
+    explicit VectorSink( std::vector<unsigned char>& mp3 ): mMp3(mp3) {}
+
+    virtual bool write( const unsigned char* data, size_t size )
+    {
+        mMp3.insert(mMp3.end(), data, data + size);
+        return true;
+    }
+
+  private:
+    std::vector<unsigned char>& mMp3;
+};
+
+} // anonymous namespace
+
+
+Converter::Result::Result():
+        mMp3(),
+        mReady(false),
+        mOk(false)
+{
+    pthread_mutex_init(&mMutex, NULL);
+    pthread_cond_init(&mReadyCond, NULL);
+}
+
+
+Converter::Result::~Result()
+{
+    pthread_cond_destroy(&mReadyCond);
+    pthread_mutex_destroy(&mMutex);
+}
+
+
+bool Converter::Result::isReady() const
+{
+    Locker lock(mMutex);
+    return mReady;
+}
+
+
+void Converter::Result::wait() const
+{
+    Locker lock(mMutex);
+    while( !mReady ) pthread_cond_wait(&mReadyCond, &mMutex);
+}
+
+
+bool Converter::Result::isOk() const
+{
+    wait();
+    return mOk;  // Not changed after it is ready
+}
+
+
+const std::vector<unsigned char>& Converter::Result::getMp3() const
+{
+    wait();
+    return mMp3;
+}
+
+
+void Converter::Result::finish( bool ok )
+{
+    Locker lock(mMutex);
+    mOk = ok;
+    mReady = true;
+    pthread_cond_broadcast(&mReadyCond);
+}
+
+
+Converter::Worker::Worker( Converter& converter, unsigned int numThreads ):
+        mConverter(converter),
+        mPools(numThreads, (BufferPool*) NULL)
+{
+}
+
+
+Converter::Worker::~Worker()
+{
+    for( size_t i=0; i<mPools.size(); i++ ) delete mPools[i];
+}
+
+
+void Converter::Worker::initThread( unsigned int thread )
+{
+    // Encoding buffers are reused by all conversions of this thread
+    mPools[thread] = new BufferPool(WORKER_POOL_BYTES);
+}
+
+
+void Converter::Worker::process( shared_ptr<Job>& job, unsigned int thread )
+{
+    bool ok = false;
+    try {
+        shared_ptr<WavFile> wavFile;
+        if( job->toFiles ) wavFile.reset(new WavFile(job->name, WavFile::READ_STREAM));
+        else if( job->stream ) wavFile.reset(new WavFile(*job->stream, job->name));
+        else wavFile.reset(new WavFile(job->data, job->size, job->name));
+        VectorSink mp3(job->result->mMp3);
+        Encoder encoder(wavFile, mConverter.mBlockFrames, NULL, mPools[thread]);
+        encoder.setProfile(mConverter.mProfile);
+        encoder.setAbortFlag(mConverter.mAbort);
+        if( !job->toFiles ) encoder.setSink(job->sink ? job->sink : &mp3);
+        int numChunks = encoder.encode();
+        ok = (numChunks > 0) && (0 == encoder.getNumErrors());
+    }
+    catch( std::exception& e )
+    {
+        LOG("ERROR converting '" << job->name << "': " << e.what() << std::endl);
+    }
+
+    // Release the job before waiters may destroy the stream or the sink
+    Future result = job->result;
+    job.reset();
+    result->finish(ok);
+}
+
+
+Converter::Converter( unsigned int numThreads, const EncodeProfile& profile, uint32_t blockFrames ):
+        mProfile(profile),
+        mBlockFrames(blockFrames ? blockFrames : Encoder::DEFAULT_BLOCK_FRAMES),
+        mNumThreads(numThreads ? numThreads : getNumCpus()),
+        mAbort(NULL),
+        mWorker(*this, mNumThreads),
+        mStage("convert", mNumThreads, 2 * mNumThreads, mWorker)
+{
+    mStage.start();
+}
+
+
+Converter::~Converter()
+{
+    mStage.stop();
+}
+
+
+Converter::Future Converter::submit( const void* wav, size_t size, const std::string& name )
+{
+    shared_ptr<Job> job(new Job());
+    job->data = static_cast<const char*>(wav);
+    job->size = size;
+    job->stream = NULL;
+    job->sink = NULL;
+    job->name = name;
+    job->toFiles = false;
+    return submit(job);
+}
+
+
+Converter::Future Converter::submit( WavStream& wav, Mp3Sink& mp3, const std::string& name )
+{
+    shared_ptr<Job> job(new Job());
+    job->data = NULL;
+    job->size = 0;
+    job->stream = &wav;
+    job->sink = &mp3;
+    job->name = name;
+    job->toFiles = false;
+    return submit(job);
+}
+
+
+Converter::Future Converter::submit( const std::string& wavUri )
+{
+    shared_ptr<Job> job(new Job());
+    job->data = NULL;
+    job->size = 0;
+    job->stream = NULL;
+    job->sink = NULL;
+    job->name = wavUri;
+    job->toFiles = true;
+    return submit(job);
+}
+
+
+Converter::Future Converter::submit( shared_ptr<Job> job )
+{
+    job->result.reset(new Result());
+    Future result = job->result;
+    mStage.submit(job);
+    return result;
+}
+
+
+bool Converter::encode( const void* wav, size_t size, std::vector<unsigned char>& mp3 )
+{
+    Future result = submit(wav, size);
+    bool ok = result->isOk();
+    mp3.swap(result->mMp3);
+    return ok;
+}
+
+
+bool Converter::encode( WavStream& wav, Mp3Sink& mp3 )
+{
+    return submit(wav, mp3)->isOk();
+}
+
+
+bool Converter::encode( const std::string& wavUri )
+{
+    return submit(wavUri)->isOk();
+}
+
+
+void Converter::setLogging( bool enable )
+{
+    __atomic_store_n(&gLogEnabled, enable ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+
+unsigned int Converter::getNumCpus()
+{
+    long numCores;
+#ifdef _WIN32
+    SYSTEM_INFO sysinfo;
+    GetSystemInfo(&sysinfo);
+    numCores = sysinfo.dwNumberOfProcessors;
+#else  // POSIX
+    numCores = sysconf(_SC_NPROCESSORS_ONLN);
+#endif  // _WIN32
+    if( numCores < 1 ) numCores = 1;
+
+    unsigned int numCpus = CpuAffinity::getAllowedCpus(numCores).size();
+    unsigned int cpuLimit = CpuAffinity::getCgroupCpuLimit();
+    if( cpuLimit && (cpuLimit < numCpus) ) numCpus = cpuLimit;
+    return numCpus ? numCpus : 1;
+}
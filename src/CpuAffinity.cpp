@@ -0,0 +1,261 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <map>
+#ifdef __linux__
+ #include <pthread.h>
+ #include <sched.h>
+ #include <dirent.h>
+#endif  // __linux__
+#include "CpuAffinity.h"
+
+using namespace wav2mp3;
+
+
+namespace {
+
+/// @return false if the first line of the file can't be read
+bool readLine( const std::string& uri, std::string& line )
+{
+    std::ifstream file(uri.c_str());
+    return file && std::getline(file, line);
+}
+
+
+/// @return the smaller of two limits, where 0 means unlimited
+unsigned int minLimit( unsigned int a, unsigned int b )
+{
+    if( 0 == a ) return b;
+    if( 0 == b ) return a;
+    return (a < b) ? a : b;
+}
+
+
+/// @return CPUs for a quota and a period in microseconds (rounded up), 0 if unlimited
+unsigned int quotaToCpus( long long quota, long long period )
+{
+    if( (quota <= 0) || (period <= 0) ) return 0;
+    return (unsigned int) ((quota + period - 1) / period);
+}
+
+
+/// Parses cgroup v2 cpu.max: "max 100000" or "400000 100000"
+unsigned int parseCpuMax( const std::string& line )
+{
+    std::istringstream in(line);
+    std::string quota;
+    long long period = 0;
+    if( !(in >> quota >> period) || ("max" == quota) ) return 0;
+    return quotaToCpus(atoll(quota.c_str()), period);
+}
+
+} // anonymous namespace
+
+
+bool CpuAffinity::parseMode( const std::string& name, Mode& mode )
+{
+    if( "none" == name )      mode = NONE;
+    else if( "core" == name ) mode = CORE;
+    else if( "numa" == name ) mode = NUMA;
+    else return false;
+    return true;
+}
+
+
+const char* CpuAffinity::getModeName( Mode mode )
+{
+    switch( mode )
+    {
+        case CORE: return "core";
+        case NUMA: return "numa";
+        default:   return "none";
+    }
+}
+
+
+std::vector<int> CpuAffinity::getAllowedCpus( long numCores )
+{
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if( 0 == sched_getaffinity(0, sizeof(set), &set) )
+    {
+        for( int cpu=0; cpu<CPU_SETSIZE; cpu++ )
+        {
+            if( CPU_ISSET(cpu, &set) ) cpus.push_back(cpu);
+        }
+    }
+#endif  // __linux__
+    if( cpus.empty() )
+    {
+        for( int cpu=0; cpu<numCores; cpu++ ) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+
+/**
+ * The cgroups of the process are listed in /proc/self/cgroup as
+ * "hierarchy-ID:controllers:path" - with empty controllers for cgroup v2.
+ * The quota of any ancestor cgroup applies too, so the smallest one is taken.
+ */
+unsigned int CpuAffinity::getCgroupCpuLimit()
+{
+    unsigned int limit = 0;
+#ifdef __linux__
+    std::ifstream cgroups("/proc/self/cgroup");
+    std::string line;
+    while( std::getline(cgroups, line) )
+    {
+        size_t c1 = line.find(':');
+        size_t c2 = (std::string::npos == c1) ? c1 : line.find(':', c1 + 1);
+        if( std::string::npos == c2 ) continue;
+        std::string controllers = line.substr(c1 + 1, c2 - c1 - 1);
+        std::string path = line.substr(c2 + 1);
+        if( "/" == path ) path.clear();
+
+        if( controllers.empty() )  // cgroup v2
+        {
+            std::string dir = path;
+            while( true )
+            {
+                std::string value;
+                if( readLine("/sys/fs/cgroup" + dir + "/cpu.max", value) )
+                    limit = minLimit(limit, parseCpuMax(value));
+                if( dir.empty() ) break;
+                dir.erase(dir.rfind('/'));
+            }
+        }
+        else if( std::string::npos != ("," + controllers + ",").find(",cpu,") )  // cgroup v1
+        {
+            // The path is relative to the mount point, which may be the container's cgroup
+            static const char* mounts[] = { "/sys/fs/cgroup/cpu,cpuacct", "/sys/fs/cgroup/cpu" };
+            std::string dirs[] = { path, "" };
+            bool found = false;
+            for( int m=0; (m<2) && !found; m++ )
+            {
+                for( int d=0; (d<2) && !found; d++ )
+                {
+                    std::string quota, period;
+                    std::string prefix = mounts[m] + dirs[d];
+                    if( readLine(prefix + "/cpu.cfs_quota_us", quota) &&
+                        readLine(prefix + "/cpu.cfs_period_us", period) )
+                    {
+                        limit = minLimit(limit, quotaToCpus(atoll(quota.c_str()),
+                                                            atoll(period.c_str())));
+                        found = true;
+                    }
+                }
+            }
+        }
+    }
+#endif  // __linux__
+    return limit;
+}
+
+
+int CpuAffinity::getNumaNode( int cpu )
+{
+    int node = 0;
+#ifdef __linux__
+    std::ostringstream uri;
+    uri << "/sys/devices/system/cpu/cpu" << cpu;
+    DIR* dir = opendir(uri.str().c_str());
+    if( NULL == dir ) return 0;
+    struct dirent* entry;
+    while( NULL != (entry = readdir(dir)) )
+    {
+        // The node is linked as "node<N>" in the CPU's directory
+        if( !strncmp(entry->d_name, "node", 4) && (entry->d_name[4] >= '0') &&
+            (entry->d_name[4] <= '9') )
+        {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+#else
+    (void) cpu;
+#endif  // __linux__
+    return node;
+}
+
+
+CpuAffinity::CpuAffinity( Mode mode, const std::vector<int>& cpus, unsigned int numWorkers ):
+        mMode(mode),
+        mWorkerCpus(),
+        mManagerCpus()
+{
+    if( (NONE == mode) || cpus.empty() || (0 == numWorkers) ) return;
+
+    // CPUs left over by the workers go to the manager
+    bool spare = (numWorkers < cpus.size());
+    if( CORE == mode )
+    {
+        for( unsigned int w=0; w<numWorkers; w++ )
+            mWorkerCpus.push_back(std::vector<int>(1, cpus[w % cpus.size()]));
+        if( spare ) mManagerCpus.assign(cpus.begin() + numWorkers, cpus.end());
+    }
+    else
+    {
+        std::vector<int> workerCpus(cpus);
+        if( spare )
+        {
+            mManagerCpus.push_back(workerCpus.back());
+            workerCpus.pop_back();
+        }
+
+        // Workers float on the CPUs of their node, nodes are assigned round robin
+        std::map< int, std::vector<int> > nodes;
+        for( size_t i=0; i<workerCpus.size(); i++ )
+            nodes[getNumaNode(workerCpus[i])].push_back(workerCpus[i]);
+        std::map< int, std::vector<int> >::const_iterator it = nodes.begin();
+        for( unsigned int w=0; w<numWorkers; w++ )
+        {
+            mWorkerCpus.push_back(it->second);
+            if( ++it == nodes.end() ) it = nodes.begin();
+        }
+    }
+}
+
+
+const std::vector<int>& CpuAffinity::getWorkerCpus( unsigned int worker ) const
+{
+    static const std::vector<int> none;
+    if( mWorkerCpus.empty() ) return none;
+    return mWorkerCpus[worker % mWorkerCpus.size()];
+}
+
+
+bool CpuAffinity::pinCurrentThread( const std::vector<int>& cpus )
+{
+    if( cpus.empty() ) return false;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for( size_t i=0; i<cpus.size(); i++ )
+    {
+        if( (cpus[i] >= 0) && (cpus[i] < CPU_SETSIZE) ) CPU_SET(cpus[i], &set);
+    }
+    return 0 == pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    return false;
+#endif  // __linux__
+}
+
+
+std::string CpuAffinity::toString( const std::vector<int>& cpus )
+{
+    std::ostringstream out;
+    for( size_t i=0; i<cpus.size(); i++ )
+    {
+        if( i ) out << ",";
+        out << cpus[i];
+    }
+    return out.str();
+}
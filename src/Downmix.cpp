@@ -0,0 +1,143 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include "Downmix.h"
+
+using namespace wav2mp3;
+
+
+namespace {
+
+const float M3DB = 0.70710678f;  // -3 dB
+
+/// Gains of the speaker positions (channel mask bits) in the left and right output
+const float kSpeakerGains[][2] = {
+    { 1, 0 },              // FRONT_LEFT
+    { 0, 1 },              // FRONT_RIGHT
+    { M3DB, M3DB },        // FRONT_CENTER
+    { 0, 0 },              // LOW_FREQUENCY
+    { M3DB, 0 },           // BACK_LEFT
+    { 0, M3DB },           // BACK_RIGHT
+    { 0.92387953f, 0.38268343f },  // FRONT_LEFT_OF_CENTER (panned between left and center)
+    { 0.38268343f, 0.92387953f },  // FRONT_RIGHT_OF_CENTER
+    { 0.5f, 0.5f },        // BACK_CENTER (-3 dB in both surrounds)
+    { M3DB, 0 },           // SIDE_LEFT
+    { 0, M3DB },           // SIDE_RIGHT
+    { 0.5f, 0.5f },        // TOP_CENTER
+    { M3DB, 0 },           // TOP_FRONT_LEFT
+    { 0.5f, 0.5f },        // TOP_FRONT_CENTER
+    { 0, M3DB },           // TOP_FRONT_RIGHT
+    { 0.5f, 0 },           // TOP_BACK_LEFT
+    { 0.35355339f, 0.35355339f },  // TOP_BACK_CENTER
+    { 0, 0.5f }            // TOP_BACK_RIGHT
+};
+const int kNumSpeakers = sizeof(kSpeakerGains) / sizeof(kSpeakerGains[0]);
+
+
+/// @return the usual channel layout for numchan channels
+uint32_t getDefaultMask( unsigned int numchan )
+{
+    switch( numchan )
+    {
+        case 3: return Downmix::FRONT_LEFT | Downmix::FRONT_RIGHT | Downmix::FRONT_CENTER;
+        case 4: return Downmix::FRONT_LEFT | Downmix::FRONT_RIGHT | Downmix::BACK_LEFT |
+                       Downmix::BACK_RIGHT;
+        case 5: return getDefaultMask(4) | Downmix::FRONT_CENTER;
+        case 6: return getDefaultMask(5) | Downmix::LOW_FREQUENCY;
+        case 7: return getDefaultMask(6) | Downmix::BACK_CENTER;
+        case 8: return getDefaultMask(6) | Downmix::SIDE_LEFT | Downmix::SIDE_RIGHT;
+        default: return 0;
+    }
+}
+
+
+unsigned int countBits( uint32_t mask )
+{
+    unsigned int n = 0;
+    for( ; mask; mask &= mask - 1 ) n++;
+    return n;
+}
+
+
+/// Parses comma separated numbers
+bool parseRow( const std::string& str, std::vector<float>& row )
+{
+    const char* p = str.c_str();
+    while( true )
+    {
+        char* end = NULL;
+        double val = strtod(p, &end);
+        if( (end == p) || !(std::fabs(val) < 1e6) ) return false;
+        row.push_back((float) val);
+        if( '\0' == *end ) return true;
+        if( ',' != *end ) return false;
+        p = end + 1;
+    }
+}
+
+} // anonymous namespace
+
+
+Downmix::Downmix():
+        mNumChannels(0)
+{
+    for( size_t c=0; c<MAX_CHANNELS; c++ ) mLeft[c] = mRight[c] = 0;
+}
+
+
+bool Downmix::setStandard( unsigned int numchan, uint32_t chanmask )
+{
+    if( (numchan < 3) || (numchan > MAX_CHANNELS) ) return false;
+    if( countBits(chanmask) != numchan ) chanmask = getDefaultMask(numchan);
+
+    // Channels are in the order of the mask bits
+    mNumChannels = numchan;
+    float sumL = 0, sumR = 0;
+    unsigned int c = 0;
+    for( int bit=0; (bit < 32) && (c < numchan); bit++ )
+    {
+        if( 0 == (chanmask & (1U << bit)) ) continue;
+        mLeft[c]  = (bit < kNumSpeakers) ? kSpeakerGains[bit][0] : 0;
+        mRight[c] = (bit < kNumSpeakers) ? kSpeakerGains[bit][1] : 0;
+        sumL += mLeft[c];
+        sumR += mRight[c];
+        c++;
+    }
+    for( ; c<MAX_CHANNELS; c++ ) mLeft[c] = mRight[c] = 0;
+
+    // Normalize, so the outputs don't clip
+    float sum = (sumL > sumR) ? sumL : sumR;
+    if( sum > 1 )
+    {
+        for( c=0; c<numchan; c++ )
+        {
+            mLeft[c] /= sum;
+            mRight[c] /= sum;
+        }
+    }
+    return true;
+}
+
+
+bool Downmix::parse( const std::string& spec )
+{
+    size_t slash = spec.find('/');
+    if( std::string::npos == slash ) return false;
+
+    std::vector<float> left, right;
+    if( !parseRow(spec.substr(0, slash), left) || !parseRow(spec.substr(slash + 1), right) )
+        return false;
+    if( (left.size() != right.size()) || (left.size() < 3) || (left.size() > MAX_CHANNELS) )
+        return false;
+
+    mNumChannels = left.size();
+    for( size_t c=0; c<MAX_CHANNELS; c++ )
+    {
+        mLeft[c]  = (c < mNumChannels) ? left[c] : 0;
+        mRight[c] = (c < mNumChannels) ? right[c] : 0;
+    }
+    return true;
+}
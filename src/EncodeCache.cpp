@@ -0,0 +1,281 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <vector>
+#include <sys/stat.h>
+#include "EncodeCache.h"
+#include "Encoder.h"
+#include "Locker.h"
+#include "Log.h"
+
+using namespace wav2mp3;
+
+
+namespace {
+
+const char* MANIFEST_HEADER = "# wav2mp3 manifest 1";
+
+const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ULL;
+
+
+/// @return FNV-1a 64-bit hash continued over the data
+uint64_t fnv1a( uint64_t hash, const char* data, size_t size )
+{
+    for( size_t i=0; i<size; i++ )
+    {
+        hash ^= (unsigned char) data[i];
+        hash *= 1099511628211ULL;  // FNV prime
+    }
+    return hash;
+}
+
+
+std::string toHex( uint64_t hash )
+{
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) hash);
+    return hex;
+}
+
+} // anonymous namespace
+
+
+EncodeCache::Ticket::Ticket( EncodeCache& cache, const std::string& uri, const Entry& entry ):
+        mCache(cache),
+        mUri(uri),
+        mEntry(entry),
+        mFailed(false)
+{
+    pthread_mutex_init(&mMutex, NULL);
+}
+
+
+EncodeCache::Ticket::~Ticket()
+{
+    if( !mFailed && (mEntry.numOutputs > 0) ) mCache.store(mUri, mEntry);
+    pthread_mutex_destroy(&mMutex);
+}
+
+
+void EncodeCache::Ticket::setNumOutputs( int numOutputs )
+{
+    Locker lock(mMutex);
+    mEntry.numOutputs = numOutputs;
+}
+
+
+void EncodeCache::Ticket::fail()
+{
+    Locker lock(mMutex);
+    mFailed = true;
+}
+
+
+bool EncodeCache::Ticket::needsHash()
+{
+    Locker lock(mMutex);
+    return mCache.mUseHash && ("-" == mEntry.hash);
+}
+
+
+void EncodeCache::Ticket::setHash( const std::string& hash )
+{
+    Locker lock(mMutex);
+    mEntry.hash = hash.empty() ? "-" : hash;  // "-" never matches, the file is encoded again
+}
+
+
+EncodeCache::EncodeCache( const std::string& manifestUri, const std::string& settings,
+                          bool useHash ):
+        mManifestUri(manifestUri),
+        mSettings(settings),
+        mUseHash(useHash),
+        mEntries(),
+        mManifest()
+{
+    pthread_mutex_init(&mMutex, NULL);
+    load();
+}
+
+
+EncodeCache::~EncodeCache()
+{
+    if( mManifest.is_open() ) mManifest.close();
+    pthread_mutex_destroy(&mMutex);
+}
+
+
+void EncodeCache::load()
+{
+    size_t numLines = 0;
+    std::ifstream in(mManifestUri.c_str());
+    std::string line;
+    while( std::getline(in, line) )
+    {
+        if( line.empty() || ('#' == line[0]) ) continue;
+
+        // size, mtime sec, mtime nsec, hash, settings, number of outputs, URI (may have tabs)
+        std::vector<std::string> fields;
+        size_t pos = 0;
+        for( int i=0; i<6; i++ )
+        {
+            size_t tab = line.find('\t', pos);
+            if( std::string::npos == tab ) break;
+            fields.push_back(line.substr(pos, tab - pos));
+            pos = tab + 1;
+        }
+        if( (fields.size() != 6) || (pos >= line.size()) ) continue;  // Truncated line
+
+        Entry entry;
+        entry.size       = strtoull(fields[0].c_str(), NULL, 10);
+        entry.mtimeSec   = strtoll(fields[1].c_str(), NULL, 10);
+        entry.mtimeNsec  = strtoll(fields[2].c_str(), NULL, 10);
+        entry.hash       = fields[3];
+        entry.settings   = fields[4];
+        entry.numOutputs = atoi(fields[5].c_str());
+        mEntries[line.substr(pos)] = entry;
+        numLines++;
+    }
+    in.close();
+
+    if( (numLines > 1024) && (numLines > 2 * mEntries.size()) ) compact();
+
+    mManifest.open(mManifestUri.c_str(), std::ios::out | std::ios::app);
+    if( !mManifest.is_open() )
+        LOG("ERROR opening manifest " << mManifestUri << " for writing" << std::endl);
+    else if( 0 == mManifest.tellp() )
+        mManifest << MANIFEST_HEADER << std::endl;
+}
+
+
+bool EncodeCache::compact()
+{
+    std::string tmpUri = mManifestUri + ".tmp";
+    std::ofstream out(tmpUri.c_str(), std::ios::out | std::ios::trunc);
+    out << MANIFEST_HEADER << "\n";
+    for( std::map<std::string, Entry>::const_iterator it = mEntries.begin();
+         it != mEntries.end(); ++it )
+    {
+        writeEntry(out, it->first, it->second);
+    }
+    out.close();
+    if( !out || (0 != rename(tmpUri.c_str(), mManifestUri.c_str())) )
+    {
+        LOG("ERROR compacting manifest " << mManifestUri << std::endl);
+        remove(tmpUri.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+void EncodeCache::writeEntry( std::ostream& out, const std::string& uri, const Entry& entry )
+{
+    out << entry.size << '\t' << entry.mtimeSec << '\t' << entry.mtimeNsec << '\t'
+        << entry.hash << '\t' << entry.settings << '\t' << entry.numOutputs << '\t'
+        << uri << '\n';
+}
+
+
+bool EncodeCache::statFile( const std::string& uri, Entry& entry )
+{
+    struct stat st;
+    if( 0 != stat(uri.c_str(), &st) ) return false;
+
+    entry.size = st.st_size;
+    entry.mtimeSec = st.st_mtime;
+#ifdef __linux__
+    entry.mtimeNsec = st.st_mtim.tv_nsec;
+#else
+    entry.mtimeNsec = 0;
+#endif  // __linux__
+    return true;
+}
+
+
+bool EncodeCache::check( const std::string& uri, shared_ptr<Ticket>& ticket )
+{
+    ticket.reset();
+
+    Entry current;
+    current.settings = mSettings;
+    if( !statFile(uri, current) ) return false;  // Let the encoder report the error
+
+    Entry cached;
+    bool found = false;
+    {
+        Locker lock(mMutex);
+        std::map<std::string, Entry>::const_iterator it = mEntries.find(uri);
+        if( it != mEntries.end() )
+        {
+            cached = it->second;
+            found = true;
+        }
+    }
+
+    bool upToDate = found && (cached.size == current.size) && (cached.settings == mSettings);
+    if( upToDate && !mUseHash )
+        upToDate = (cached.mtimeSec == current.mtimeSec) && (cached.mtimeNsec == current.mtimeNsec);
+    for( int i=0; upToDate && (i<cached.numOutputs); i++ )
+    {
+        struct stat st;
+        upToDate = (0 == stat(Encoder::getMp3Uri(uri, i).c_str(), &st));
+    }
+    if( upToDate && mUseHash )
+    {
+        // Hash only files which may be up to date
+        current.hash = hashFile(uri);
+        upToDate = !current.hash.empty() && (current.hash == cached.hash);
+    }
+    if( upToDate ) return true;
+
+    // New and changed files are hashed from their data by the read stage, not here
+    if( current.hash.empty() ) current.hash = "-";
+    ticket.reset(new Ticket(*this, uri, current));
+    return false;
+}
+
+
+void EncodeCache::store( const std::string& uri, const Entry& entry )
+{
+    Locker lock(mMutex);
+    mEntries[uri] = entry;
+    if( mManifest.is_open() )
+    {
+        writeEntry(mManifest, uri, entry);
+        mManifest.flush();  // Keep the work done if the process is interrupted
+    }
+}
+
+
+size_t EncodeCache::getNumEntries() const
+{
+    Locker lock(mMutex);
+    return mEntries.size();
+}
+
+
+std::string EncodeCache::hashFile( const std::string& uri )
+{
+    std::ifstream in(uri.c_str(), std::ios::in | std::ios::binary);
+    if( !in.is_open() ) return std::string();
+
+    uint64_t hash = FNV_OFFSET_BASIS;
+    std::vector<char> buf(1 << 20);
+    while( in )
+    {
+        in.read(&buf[0], buf.size());
+        hash = fnv1a(hash, &buf[0], in.gcount());
+    }
+    if( in.bad() ) return std::string();
+    return toHex(hash);
+}
+
+
+std::string EncodeCache::hashData( const void* data, size_t size )
+{
+    return toHex(fnv1a(FNV_OFFSET_BASIS, static_cast<const char*>(data), size));
+}
@@ -0,0 +1,75 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+#include <sstream>
+#include "EncodeProfile.h"
+#include "Downmix.h"
+
+using namespace wav2mp3;
+
+
+bool EncodeProfile::setName( const std::string& name )
+{
+    EncodeProfile profile;
+    profile.downmix = downmix;  // Not a part of the named profiles
+    if( "fast" == name )
+    {
+        profile.quality = 7;
+        profile.bitrate = 128;
+    }
+    else if( "archive" == name )
+    {
+        profile.mode = VBR;
+        profile.quality = 3;
+        profile.vbrQuality = 2;
+    }
+    else if( "standard" != name )
+    {
+        return false;
+    }
+    *this = profile;
+    return true;
+}
+
+
+bool EncodeProfile::setMode( const std::string& name )
+{
+    if( "cbr" == name )      mode = CBR;
+    else if( "abr" == name ) mode = ABR;
+    else if( "vbr" == name ) mode = VBR;
+    else return false;
+    return true;
+}
+
+
+bool EncodeProfile::isValid() const
+{
+    if( (quality < 0) || (quality > 9) || (vbrQuality < 0) || (vbrQuality > 9) ) return false;
+    if( (0 != bitrate) && ((bitrate < MIN_BITRATE) || (bitrate > MAX_BITRATE)) ) return false;
+    Downmix matrix;
+    if( !downmix.empty() && !matrix.parse(downmix) ) return false;
+    return true;
+}
+
+
+std::string EncodeProfile::getId() const
+{
+    std::ostringstream id;
+    id << "q" << quality;
+    switch( mode )
+    {
+        case CBR:
+            id << " cbr";
+            if( bitrate ) id << " " << bitrate;
+            break;
+        case ABR:
+            id << " abr";
+            if( bitrate ) id << " " << bitrate;
+            break;
+        case VBR:
+            id << " vbr V" << vbrQuality;
+            break;
+    }
+    if( !downmix.empty() ) id << " downmix " << downmix;
+    return id.str();
+}
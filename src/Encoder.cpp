@@ -3,27 +3,50 @@
  ******************************************************************************/
 #include <sstream>
 #include <cstdlib>
+#include <cstdio>
 #include <vector>
+#include <new>
 #include <pthread.h>
 #include "Encoder.h"
+#include "SampleConv.h"
+#include "Tracer.h"
 #include "Log.h"
 
 using namespace wav2mp3;
 
 
-Encoder::Encoder( shared_ptr<WavFile> wavFilePtr ):
+Encoder::Encoder( shared_ptr<WavFile> wavFilePtr, uint32_t blockFrames, Mp3Writer* writer,
+                  BufferPool* pool ):
         mWavFilePtr(wavFilePtr),
         mMp3Uri(),
         mLameContext(NULL),
-        mMp3File()
+        mWriter(writer ? writer : &Mp3Writer::getSyncWriter()),
+        mMp3File(),
+        mMp3Out(),
+        mTicket(),
+        mProgress(),
+        mSink(NULL),
+        mBlockFrames(blockFrames ? blockFrames : DEFAULT_BLOCK_FRAMES),
+        mProfile(),
+        mFmt(),
+        mChannelMask(0),
+        mDownmix(),
+        mNumErrors(0),
+        mAbort(NULL),
+        mAborted(false),
+        mPool(pool ? *pool : BufferPool::getShared()),
+        mMp3Buf(mPool),
+        mCopiedDataLBuf(mPool),
+        mCopiedDataRBuf(mPool),
+        mDownmixBuf(mPool)
 {
 }
 
 
 Encoder::~Encoder()
 {
-    // Close mp3 file if open
-    if( mMp3File.is_open() ) mMp3File.close();
+    // Discard the mp3 file if still open
+    if( mMp3File ) mWriter->close(mMp3File, false);
 
     // Free memory resources if still allocated
     if( mLameContext ) lame_close(mLameContext);
@@ -99,245 +122,525 @@ int Encoder::getStdBRate(int brate)
 }
 
 
+int Encoder::encodeBlock( const char* datap, uint32_t datasz )
+{
+    int numSamples = datasz / mFmt.blkalign;
+    unsigned char* mMp3Buffer = mMp3Buf.data();
+    int mp3bufsz = mMp3Buf.size();
+
+    // Temp conversion buffers are sized for the largest block and reused
+    size_t convsz = numSamples * sizeof(int) * ((mFmt.numchan > 2) ? mFmt.numchan : 1);
+    if( (mCopiedDataLBuf.size() < convsz) && !mCopiedDataLBuf.resize(convsz) ) throw std::bad_alloc();
+    if( (mCopiedDataRBuf.size() < convsz) && !mCopiedDataRBuf.resize(convsz) ) throw std::bad_alloc();
+    uint8_t* mCopiedDataL = mCopiedDataLBuf.data();
+    uint8_t* mCopiedDataR = mCopiedDataRBuf.data();
+
+    // Convert PCM data (if needed) in a format accepted by LAME lib
+    enum { NONE, S16, S16_INTERLEAVED, S32, F32, F32_INTERLEAVED } input = NONE;
+    const void* left = datap;
+    const void* right = NULL;
+    uint16_t bps = mFmt.bitspersamp;
+    const uint8_t* udatap = (const uint8_t*) datap;
+    {
+        TRACE_SCOPE("convert");
+        if( mFmt.numchan > 2 )
+        {
+            // Convert to interleaved floats (via mCopiedDataL), then mix in L and R
+            size_t numValues = (size_t) numSamples * mFmt.numchan;
+            if( (mDownmixBuf.size() < numValues) && !mDownmixBuf.resize(numValues) )
+                throw std::bad_alloc();
+            float* floats = mDownmixBuf.data();
+            if( WAVE_FORMAT_IEEE_FLOAT == mFmt.fmttag )
+            {
+                if( 64 == bps )
+                    SampleConv::f64ToF32((const double *) datap, floats, numValues);
+                else
+                    floats = (float *) datap;  // Already floats
+            }
+            else if( 8 == bps )
+            {
+                SampleConv::u8ToS16(udatap, (int16_t *) mCopiedDataL, numValues);
+                SampleConv::s16ToF32((const int16_t *) mCopiedDataL, floats, numValues);
+            }
+            else if( 16 == bps )
+            {
+                SampleConv::s16ToF32((const int16_t *) datap, floats, numValues);
+            }
+            else if( 24 == bps )
+            {
+                SampleConv::s24ToS32(udatap, (int32_t *) mCopiedDataL, numValues);
+                SampleConv::s32ToF32((const int32_t *) mCopiedDataL, floats, numValues);
+            }
+            else
+            {
+                SampleConv::s32ToF32((const int32_t *) datap, floats, numValues);
+            }
+            SampleConv::downmixF32(floats, mFmt.numchan, mDownmix.getLeft(), mDownmix.getRight(),
+                                   (float *) mCopiedDataL, (float *) mCopiedDataR, numSamples);
+            left = mCopiedDataL;
+            right = mCopiedDataR;
+            input = F32;
+        }
+        else if( WAVE_FORMAT_IEEE_FLOAT == mFmt.fmttag )
+        {
+            // LAME takes floats in [-1, 1] as they are, so there is no scaling.
+            // Doubles are narrowed to floats, not converted to integers.
+            input = F32;
+            if( 64 == bps )
+            {
+                if( mFmt.numchan == 1 )
+                {
+                    SampleConv::f64ToF32((const double *) datap, (float *) mCopiedDataL, numSamples);
+                }
+                else
+                {
+                    SampleConv::f64StereoToF32((const double *) datap, (float *) mCopiedDataL,
+                                               (float *) mCopiedDataR, numSamples);
+                    right = mCopiedDataR;
+                }
+                left = mCopiedDataL;
+            }
+            else if( mFmt.numchan == 2 )
+            {
+                input = F32_INTERLEAVED;  // Deinterleaved by LAME, no extra pass here
+            }
+        }
+        else if( mFmt.numchan == 1 )  // mono
+        {
+            if( (8 == bps) && (1 == mFmt.blkalign) )
+            {
+                // Copy data in 16-bit buffer mCopiedDataL, converting to signed
+                SampleConv::u8ToS16(udatap, (int16_t *) mCopiedDataL, numSamples);
+                left = mCopiedDataL;
+                input = S16;
+            }
+            else if( (16 == bps) || ((8 == bps) && (2 == mFmt.blkalign)) )
+            {
+                input = S16;
+            }
+            else if( (24 == bps) && (3 == mFmt.blkalign) )
+            {
+                // Copy data in 32-bit buffer mCopiedDataL
+                SampleConv::s24ToS32(udatap, (int32_t *) mCopiedDataL, numSamples);
+                left = mCopiedDataL;
+                input = S32;
+            }
+            else if( (32 == bps) || ((24 == bps) && (4 == mFmt.blkalign)) )
+            {
+                input = S32;
+            }
+        }
+        else  // 2-channel stereo
+        {
+            if( (8 == bps) && (2 == mFmt.blkalign) )
+            {
+                // Copy data in 16-bit buffers, converting to signed
+                SampleConv::u8StereoToS16(udatap, (int16_t *) mCopiedDataL,
+                                          (int16_t *) mCopiedDataR, numSamples);
+                left = mCopiedDataL;
+                right = mCopiedDataR;
+                input = S16;
+            }
+            else if( (16 == bps) || ((8 == bps) && (4 == mFmt.blkalign)) )
+            {
+                input = S16_INTERLEAVED;
+            }
+            else if( (24 == bps) && (6 == mFmt.blkalign) )
+            {
+                // Copy data in two 32-bit buffers mCopiedDataL and mCopiedDataR
+                SampleConv::s24StereoToS32(udatap, (int32_t *) mCopiedDataL,
+                                           (int32_t *) mCopiedDataR, numSamples);
+                left = mCopiedDataL;
+                right = mCopiedDataR;
+                input = S32;
+            }
+            else if( (32 == bps) || ((24 == bps) && (8 == mFmt.blkalign)) )
+            {
+                // Copy data in separate channel buffers (lame_encode_buffer_interleaved_int()
+                // is available only in LAME 3.100)
+                SampleConv::s32StereoSplit((const int32_t *) datap, (int32_t *) mCopiedDataL,
+                                           (int32_t *) mCopiedDataR, numSamples);
+                left = mCopiedDataL;
+                right = mCopiedDataR;
+                input = S32;
+            }
+        }
+    }
+
+    // Encode PCM data in mp3
+    TRACE_SCOPE("lame_encode");
+    int encoded=-5;
+    switch( input )
+    {
+        case S16:
+            encoded = lame_encode_buffer(mLameContext, (short int *) left,
+                    (short int *) right, numSamples, mMp3Buffer, mp3bufsz);
+            break;
+        case S16_INTERLEAVED:
+            encoded = lame_encode_buffer_interleaved(mLameContext, (short int *) left,
+                    numSamples, mMp3Buffer, mp3bufsz);
+            break;
+        case S32:
+            encoded = lame_encode_buffer_int(mLameContext, (int *) left,
+                    (int *) right, numSamples, mMp3Buffer, mp3bufsz);
+            break;
+        case F32:
+            encoded = lame_encode_buffer_ieee_float(mLameContext, (const float *) left,
+                    (const float *) right, numSamples, mMp3Buffer, mp3bufsz);
+            break;
+        case F32_INTERLEAVED:
+            encoded = lame_encode_buffer_interleaved_ieee_float(mLameContext, (const float *) left,
+                    numSamples, mMp3Buffer, mp3bufsz);
+            break;
+        default:
+            break;
+    }
+
+    return encoded;
+}
+
+
+std::string Encoder::getMp3Uri( const std::string& wavUri, int chunkNum )
+{
+    std::string wavUriNoExt = getBaseFileUri(wavUri);
+    if( chunkNum )
+        return wavUriNoExt + int2str(chunkNum) + ".mp3";
+    else
+        return wavUriNoExt + ".mp3";
+}
+
+
+std::string Encoder::getSettingsId( const EncodeProfile& profile )
+{
+    return std::string("lame ") + get_lame_version() + " " + profile.getId();
+}
+
+
+/**
+ * Initializes LAME lib and sets encoding parameters for mFmt.
+ *
+ * @param[in] segmented - encoding a segment of a chunk. Disables the bit reservoir
+ *            and resampling, so mp3 frames of different segments can be concatenated.
+ * @return 0 on success, -1 if lame_init() failed, -2 if lame_init_params() failed
+ */
+int Encoder::initLame( bool segmented )
+{
+    mLameContext = lame_init();
+    if( NULL == mLameContext )
+    {
+        LOG("ERROR in lame_init()" << std::endl);
+        return -1;
+    }
+
+    // More than 2 channels are mixed down to stereo. A custom matrix is used for
+    // its number of channels, the standard one for the others.
+    if( mFmt.numchan > 2 )
+    {
+        if( mProfile.downmix.empty() || !mDownmix.parse(mProfile.downmix) ||
+            (mDownmix.getNumChannels() != mFmt.numchan) )
+        {
+            mDownmix.setStandard(mFmt.numchan, mChannelMask);
+        }
+    }
+
+    // Set encoding parameters
+    lame_set_num_channels(mLameContext, (mFmt.numchan > 2) ? 2 : mFmt.numchan);
+    lame_set_in_samplerate(mLameContext, mFmt.samprate);
+    int brate = mProfile.bitrate ? mProfile.bitrate : getStdBRate(mFmt.byterate/1000);
+    switch( mProfile.mode )
+    {
+        case EncodeProfile::CBR:
+            lame_set_brate(mLameContext, brate);
+            break;
+        case EncodeProfile::ABR:
+            lame_set_VBR(mLameContext, vbr_abr);
+            lame_set_VBR_mean_bitrate_kbps(mLameContext, brate);
+            break;
+        case EncodeProfile::VBR:
+            lame_set_VBR(mLameContext, vbr_default);
+            lame_set_VBR_q(mLameContext, mProfile.vbrQuality);
+            break;
+    }
+    lame_set_quality(mLameContext, mProfile.quality);  // 5 - "good quality, fast"
+    if( mFmt.numchan == 1 )
+        lame_set_mode(mLameContext, MONO);
+    else
+        lame_set_mode(mLameContext, STEREO);
+    lame_set_bWriteVbrTag(mLameContext, 0);
+    if( segmented )
+    {
+        lame_set_out_samplerate(mLameContext, mFmt.samprate);
+        lame_set_disable_reservoir(mLameContext, 1);
+    }
+
+    if( lame_init_params(mLameContext) != 0 )
+    {
+        LOG("ERROR in lame_init_params()" << std::endl);
+        lame_close(mLameContext); mLameContext = NULL;
+        return -2;
+    }
+
+    return 0;
+}
+
+
 int Encoder::encode()
 {
     LOG("Thread " << pthread_self() << " is encoding '" << mWavFilePtr->getURI() <<
             "'" << std::endl);
 
     int chunkNum=0;
-    while( mWavFilePtr->findNextWavChunk() )
+    mNumErrors = 0;
+    mAborted = false;
+    while( !mAborted && mWavFilePtr->findNextWavChunk() )
     {
         // Set mMp3Uri
-        std::string wavUriNoExt = getBaseFileUri(mWavFilePtr->getURI());
-        if( chunkNum )
-            mMp3Uri = wavUriNoExt + int2str(chunkNum) + ".mp3";
-        else
-            mMp3Uri = wavUriNoExt + ".mp3";
+        mMp3Uri = getMp3Uri(mWavFilePtr->getURI(), chunkNum);
         //LOG("Encoding '" << mMp3Uri << "'" << std::endl);
 
+        mFmt = mWavFilePtr->getFormat();
+        mChannelMask = mWavFilePtr->getChannelMask();
+
         // Initialize LAME lib
-        mLameContext = lame_init();
-        if( NULL == mLameContext )
-        {
-            LOG("ERROR in lame_init()" << std::endl);
+        int res = initLame(false);
+        if( res ) mNumErrors++;
+        if( -1 == res )
             break;
-        }
-
-        // Set encoding parameters
-        lame_set_num_channels(mLameContext, mWavFilePtr->getNumChannels());
-        lame_set_in_samplerate(mLameContext, mWavFilePtr->getSampleRate());
-        lame_set_brate(mLameContext, getStdBRate(mWavFilePtr->getByteRate()/1000));
-        lame_set_quality(mLameContext, 5);  // "good quality, fast"
-        if( mWavFilePtr->getNumChannels() == 1 )
-            lame_set_mode(mLameContext, MONO);
-        else
-            lame_set_mode(mLameContext, STEREO);
-        lame_set_bWriteVbrTag(mLameContext, 0);
-
-        if( lame_init_params(mLameContext) != 0 )
-        {
-            LOG("ERROR in lame_init_params()" << std::endl);
-            lame_close(mLameContext); mLameContext = NULL;
+        else if( res )
             continue;
-        }
 
-        // Allocate mp3 buffer. Will be freed when the vector goes out of scope.
-        int numSamples = mWavFilePtr->getRawAudioDataSize() / mWavFilePtr->getFrameSize();
-        size_t mp3bufsz = numSamples*5/4 + 7200;  // According to LAME lib
-        std::vector<unsigned char> mp3BufVec;
-        try {
-            mp3BufVec.resize(mp3bufsz);
-        } catch(...) {
+        // Allocate mp3 buffer for a single block
+        size_t mp3bufsz = mBlockFrames*5/4 + 7200;  // According to LAME lib
+        if( !mMp3Buf.resize(mp3bufsz) )
+        {
             LOG("ERROR allocating mp3 buffer" << std::endl);
             lame_close(mLameContext); mLameContext = NULL;
+            mNumErrors++;
             continue;
         }
-        unsigned char* mMp3Buffer = &mp3BufVec[0];
 
-        // Encode PCM data in mp3
-        uint16_t bps = mWavFilePtr->getBitsPerSample();
-        int encoded=-5;
-        if( mWavFilePtr->getNumChannels() == 1 )  // mono
+        // Start the output mp3 file. It is written by the writer stage.
+        if( NULL == mSink ) mMp3File = mWriter->open(mMp3Uri, mTicket, mProgress);
+        mMp3Out.clear();
+
+        // Encode PCM data block by block and write mp3 frames as they are produced
+        bool ok = true;
+        uint32_t blocksz = 0;
+        const char* block;
+        while( ok && !checkAbort() )
         {
-            if( (8 == bps) && (1 == mWavFilePtr->getFrameSize()) )
             {
-                // Allocate temp conversion buffer
-                uint32_t datasz = mWavFilePtr->getRawAudioDataSize();
-                std::vector<uint8_t> copiedDataLVec;
-                try {
-                    copiedDataLVec.resize(datasz * sizeof(short int));
-                } catch(...) {
-                    LOG("ERROR allocating copiedDataLVec" << std::endl);
-                    lame_close(mLameContext); mLameContext = NULL;
-                    continue;
-                }
-                uint8_t* mCopiedDataL = &copiedDataLVec[0];
-
-                // Copy data in 16-bit buffer mCopiedDataL, converting to signed
-                short int* sip = (short int *) mCopiedDataL;
-                const char* datap = mWavFilePtr->getRawAudioDataPtr();
-                for( uint32_t i=0; i<datasz; i++ ) sip[i] = ((short)(datap[i] - 0x80)) << 8;
-
-                encoded = lame_encode_buffer(mLameContext, (short int *) mCopiedDataL,
-                        NULL, numSamples, mMp3Buffer, mp3bufsz);
+                TRACE_SCOPE("read_block");
+                block = mWavFilePtr->getNextAudioBlock(mBlockFrames * mFmt.blkalign, blocksz);
             }
-            else if( (16 == bps) || ((8 == bps) && (2 == mWavFilePtr->getFrameSize())) )
+            if( NULL == block )
             {
-                encoded = lame_encode_buffer(mLameContext,
-                        (short int *) mWavFilePtr->getRawAudioDataPtr(),
-                        NULL, numSamples, mMp3Buffer, mp3bufsz);
+                if( mWavFilePtr->hasReadError() ) ok = false;  // Not the end of the data
+                break;
             }
-            else if( (24 == bps) && (3 == mWavFilePtr->getFrameSize()) )
-            {
-                // Allocate temp conversion buffer
-                uint32_t datasz = mWavFilePtr->getRawAudioDataSize();
-                std::vector<uint8_t> copiedDataLVec;
-                try {
-                    copiedDataLVec.resize((datasz/3) * sizeof(int));
-                } catch(...) {
-                    LOG("ERROR allocating copiedDataLVec" << std::endl);
-                    lame_close(mLameContext); mLameContext = NULL;
-                    continue;
-                }
-                uint8_t* mCopiedDataL = &copiedDataLVec[0];
 
-                // Copy data in 32-bit buffer mCopiedDataL
-                const char* datap = mWavFilePtr->getRawAudioDataPtr();
-                for( uint32_t i=0, j=0; i<datasz; i += 3, j += 4 )
-                {
-                    mCopiedDataL[j]   = 0;
-                    mCopiedDataL[j+1] = datap[i];
-                    mCopiedDataL[j+2] = datap[i+1];
-                    mCopiedDataL[j+3] = datap[i+2];
-                }
+            int encoded;
+            try {
+                encoded = encodeBlock(block, blocksz);
+            } catch(...) {
+                LOG("ERROR allocating conversion buffers" << std::endl);
+                encoded = -5;
+            }
 
-                encoded = lame_encode_buffer_int(mLameContext, (int *) mCopiedDataL,
-                        NULL, numSamples, mMp3Buffer, mp3bufsz);
+            if( encoded < 0 )
+            {
+                LOG("ERROR in lame_encode_buffer : " << encoded << std::endl);
+                ok = false;
             }
-            else if( (32 == bps) || ((24 == bps) && (4 == mWavFilePtr->getFrameSize())) )
+            else if( encoded > 0 )
             {
-                encoded = lame_encode_buffer_int(mLameContext,
-                        (int *) mWavFilePtr->getRawAudioDataPtr(),
-                        NULL, numSamples, mMp3Buffer, mp3bufsz);
+                ok = writeMp3(mMp3Buf.data(), encoded);
             }
         }
-        else  // 2-channel stereo
-        {
-            if( (8 == bps) && (2 == mWavFilePtr->getFrameSize()) )
-            {
-                // Allocate temp conversion buffers
-                uint32_t datasz = mWavFilePtr->getRawAudioDataSize();
-                std::vector<uint8_t> copiedDataLVec;
-                std::vector<uint8_t> copiedDataRVec;
-                try {
-                    copiedDataLVec.resize((datasz/2) * sizeof(short int));
-                    copiedDataRVec.resize((datasz/2) * sizeof(short int));
-                } catch(...) {
-                    LOG("ERROR allocating copiedDataLVec or copiedDataRVec" << std::endl);
-                    lame_close(mLameContext); mLameContext = NULL;
-                    continue;
-                }
-                uint8_t* mCopiedDataL = &copiedDataLVec[0];
-                uint8_t* mCopiedDataR = &copiedDataRVec[0];
-
-                // Copy data in 16-bit buffers, converting to signed
-                short int* sipl = (short int *) mCopiedDataL;
-                short int* sipr = (short int *) mCopiedDataR;
-                const char* datap = mWavFilePtr->getRawAudioDataPtr();
-                for( uint32_t i=0, l=0, r=0; i<datasz; i++ )
-                {
-                    sipl[l++] = (short)(datap[i] - 0x80) << 8;
-                    sipr[r++] = (short)(datap[++i] - 0x80) << 8;
-                }
 
-                encoded = lame_encode_buffer(mLameContext, (short int *) mCopiedDataL,
-                        (short int *)mCopiedDataR, numSamples, mMp3Buffer, mp3bufsz);
-            }
-            else if( (16 == bps) || ((8 == bps) && (4 == mWavFilePtr->getFrameSize())) )
+        if( mAborted ) ok = false;
+        if( ok )
+        {
+            // Flush the buffer in the file
+            int flushed;
             {
-                encoded = lame_encode_buffer_interleaved(mLameContext,
-                        (short int *) mWavFilePtr->getRawAudioDataPtr(),
-                        numSamples, mMp3Buffer, mp3bufsz);
+                TRACE_SCOPE("lame_flush");
+                flushed = lame_encode_flush(mLameContext, mMp3Buf.data(), mMp3Buf.size());
             }
-            else if( (24 == bps) && (6 == mWavFilePtr->getFrameSize()) )
+            if( flushed > 0 )
+                ok = writeMp3(mMp3Buf.data(), flushed);
+            else if( flushed < 0 )
             {
-                // TODO Copy data in two 32-bit buffers mCopiedDataL and mCopiedDataR
-                LOG("24-bps stereo is not implemented yet" << std::endl);
-                lame_close(mLameContext); mLameContext = NULL;
-                continue;
+                LOG("ERROR in lame_encode_flush : " << flushed << std::endl);
+                ok = false;
             }
-            else if( (32 == bps) || ((24 == bps) && (8 == mWavFilePtr->getFrameSize())) )
-            {
-#if 0  // This is available only in LAME 3.100
-                encoded = lame_encode_buffer_interleaved_int(mLameContext,
-                        (int *) mWavFilePtr->getRawAudioDataPtr(), numSamples,
-                        mMp3Buffer, mp3bufsz);
-#else
-                // Allocate temp channel buffers
-                uint32_t datasz = mWavFilePtr->getRawAudioDataSize();
-                std::vector<uint8_t> copiedDataLVec;
-                std::vector<uint8_t> copiedDataRVec;
-                try {
-                    copiedDataLVec.resize(datasz/2);
-                    copiedDataRVec.resize(datasz/2);
-                } catch(...) {
-                    LOG("ERROR allocating copiedDataLVec or copiedDataRVec" << std::endl);
-                    lame_close(mLameContext); mLameContext = NULL;
-                    continue;
-                }
-                uint8_t* mCopiedDataL = &copiedDataLVec[0];
-                uint8_t* mCopiedDataR = &copiedDataRVec[0];
-
-                // Copy data in separate channel buffers
-                int* lchan = (int *) mCopiedDataL;
-                int* rchan = (int *) mCopiedDataR;
-                int* ichan = (int *) mWavFilePtr->getRawAudioDataPtr();
-                for( uint32_t i=0, l=0, r=0; i<datasz/sizeof(int); i++ )
-                {
-                    lchan[l++] = ichan[i];
-                    rchan[r++] = ichan[++i];
-                }
+        }
 
-                encoded = lame_encode_buffer_int(mLameContext, (int *) mCopiedDataL,
-                        (int *)mCopiedDataR, numSamples, mMp3Buffer, mp3bufsz);
-#endif // LAME ver
-            }
+        // Write the rest and close. Partial mp3 files are removed by the writer.
+        if( NULL == mSink )
+        {
+            mWriter->write(mMp3File, mMp3Out);
+            mWriter->close(mMp3File, ok);
+            mMp3File.reset();
         }
+        if( !ok ) mNumErrors++;
+        lame_close(mLameContext); mLameContext = NULL;
+        chunkNum++;
+    }
+    LOG("Thread " << pthread_self() << " encoded " << chunkNum <<
+            " wav chunk(s) from '" << mWavFilePtr->getURI() << "'" << std::endl);
+    return chunkNum;
+}
+
+
+bool Encoder::writeMp3( const unsigned char* data, size_t size )
+{
+    if( NULL != mSink )
+    {
+        if( mSink->write(data, size) ) return true;
+        LOG("ERROR writing mp3 data of '" << mMp3Uri << "'" << std::endl);
+        return false;
+    }
 
-        if( encoded <= 0 )
+    try {
+        mMp3Out.insert(mMp3Out.end(), data, data + size);
+        if( mMp3Out.size() >= Mp3Writer::COALESCE_BYTES )
         {
-            LOG("ERROR in lame_encode_buffer : " << encoded << std::endl);
+            mWriter->write(mMp3File, mMp3Out);  // Swaps the buffer
+            mMp3Out.reserve(Mp3Writer::COALESCE_BYTES + mMp3Buf.size());
         }
-        else
+    } catch(...) {
+        LOG("ERROR allocating mp3 output buffer" << std::endl);
+        return false;
+    }
+    return true;
+}
+
+
+bool Encoder::checkAbort()
+{
+    if( mAborted ) return true;
+    if( (NULL == mAbort) || !__atomic_load_n(mAbort, __ATOMIC_RELAXED) ) return false;
+    LOG("Encoding of '" << mMp3Uri << "' aborted" << std::endl);
+    mAborted = true;
+    return true;
+}
+
+
+bool Encoder::encodeSegment( SegmentedChunk& chunk, int segment )
+{
+    mAborted = false;
+    mMp3Uri = chunk.getMp3Uri();
+    mFmt = chunk.getFormat();
+    mChannelMask = chunk.getChannelMask();
+    int numSegments = chunk.getNumSegments();
+    LOG("Thread " << pthread_self() << " is encoding segment " << segment+1 << "/" <<
+            numSegments << " of '" << mMp3Uri << "'" << std::endl);
+
+    // Encode from OVERLAP_FRAMES before the segment (if possible) to TAIL_FRAMES after it.
+    // Keep only the mp3 frames of the segment. The last segment keeps everything.
+    uint32_t mp3FrameSize = chunk.getMp3FrameSize();
+    uint64_t segBeg = chunk.getSegmentBegin(segment);
+    uint64_t segEnd = chunk.getSegmentEnd(segment);
+    bool last = (segment == numSegments-1);
+    uint64_t from = segBeg - std::min<uint64_t>(segBeg,
+                                                SegmentedChunk::OVERLAP_FRAMES * mp3FrameSize);
+    uint64_t to = last ? segEnd : std::min<uint64_t>(chunk.getNumFrames(),
+                                                     segEnd + SegmentedChunk::TAIL_FRAMES * mp3FrameSize);
+    uint32_t skipFrames = (segBeg - from) / mp3FrameSize;
+    uint32_t keepFrames = (segEnd - segBeg + mp3FrameSize - 1) / mp3FrameSize;
+
+    std::vector<unsigned char> segMp3;
+    bool ok = (0 == initLame(numSegments > 1));
+    if( ok && (lame_get_framesize(mLameContext) != (int) mp3FrameSize) )
+    {
+        LOG("ERROR unexpected mp3 frame size " << lame_get_framesize(mLameContext) << std::endl);
+        ok = false;
+    }
+
+    try {
+        if( ok && !mMp3Buf.resize(mBlockFrames*5/4 + 7200) )  // According to LAME lib
+            throw std::bad_alloc();
+
+        PooledBuffer<char> readBuf(mPool);
+        std::ifstream wavFile;
+        for( uint64_t pos = from; ok && (pos < to); )
         {
-            // Create/open output mp3 file
-            mMp3File.open(mMp3Uri.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
-            if( ! mMp3File.is_open() )
+            if( checkAbort() )
+            {
+                ok = false;
+                break;
+            }
+            uint32_t count = (uint32_t) std::min<uint64_t>(mBlockFrames, to - pos);
+            const char* block;
+            {
+                TRACE_SCOPE("read_block");
+                block = chunk.readFrames(pos, count, readBuf, wavFile);
+            }
+            if( NULL == block )
+            {
+                LOG("ERROR reading wav file " << chunk.getWavUri() << std::endl);
+                ok = false;
+                break;
+            }
+
+            int encoded = encodeBlock(block, count * mFmt.blkalign);
+            if( encoded < 0 )
             {
-                LOG("ERROR opening mp3 file " << mMp3Uri << " for writing" << std::endl);
+                LOG("ERROR in lame_encode_buffer : " << encoded << std::endl);
+                ok = false;
             }
             else
             {
-                // Write mp3 buffer in the file
-                mMp3File.write(reinterpret_cast<char*>(mMp3Buffer), encoded);
-                // Flush the buffer in the file
-                int flushed = lame_encode_flush(mLameContext, mMp3Buffer, mp3bufsz);
-                if( flushed > 0 )
-                    mMp3File.write(reinterpret_cast<char*>(mMp3Buffer), flushed);
-                else
-                    LOG("ERROR in lame_encode_flush : " << flushed << std::endl);
+                segMp3.insert(segMp3.end(), mMp3Buf.data(), mMp3Buf.data() + encoded);
             }
+            pos += count;
         }
 
-        if( mMp3File.is_open() )
+        // Flush the last segment. If LAME didn't produce all mp3 frames of an inner
+        // segment (shouldn't happen with TAIL_FRAMES look-ahead) flush it too.
+        if( ok && (last || segMp3.empty() ||
+                   (SegmentedChunk::findMp3FrameOffset(&segMp3[0], segMp3.size(),
+                                                       skipFrames + keepFrames) == segMp3.size())) )
         {
-            mMp3File.close();
-            mMp3File.clear();
+            int flushed;
+            {
+                TRACE_SCOPE("lame_flush");
+                flushed = lame_encode_flush(mLameContext, mMp3Buf.data(), mMp3Buf.size());
+            }
+            if( flushed > 0 )
+                segMp3.insert(segMp3.end(), mMp3Buf.data(), mMp3Buf.data() + flushed);
+            else if( flushed < 0 )
+            {
+                LOG("ERROR in lame_encode_flush : " << flushed << std::endl);
+                ok = false;  // The segment is truncated
+            }
         }
+    } catch(...) {
+        LOG("ERROR allocating segment buffers" << std::endl);
+        ok = false;
+    }
+
+    if( mLameContext )
+    {
         lame_close(mLameContext); mLameContext = NULL;
-        chunkNum++;
     }
-    LOG("Thread " << pthread_self() << " encoded " << chunkNum <<
-            " wav chunk(s) from '" << mWavFilePtr->getURI() << "'" << std::endl);
-    return chunkNum;
+
+    // Cut the overlapping mp3 frames
+    std::vector<unsigned char> keptMp3;
+    if( ok && !segMp3.empty() )
+    {
+        size_t begOff = SegmentedChunk::findMp3FrameOffset(&segMp3[0], segMp3.size(), skipFrames);
+        size_t endOff = last ? segMp3.size() :
+                SegmentedChunk::findMp3FrameOffset(&segMp3[0], segMp3.size(), skipFrames + keepFrames);
+        keptMp3.assign(segMp3.begin() + begOff, segMp3.begin() + endOff);
+    }
+    std::vector<unsigned char>().swap(segMp3);
+
+    if( chunk.addSegmentOutput(segment, keptMp3, ok) )
+    {
+        LOG("Thread " << pthread_self() << " completed " << numSegments <<
+                " segment(s) of '" << mMp3Uri << "'" << std::endl);
+    }
+    return ok;
 }
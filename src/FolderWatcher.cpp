@@ -0,0 +1,218 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+#include <cstring>
+#include <cerrno>
+#include <dirent.h>
+#include <strings.h>
+#include <sys/stat.h>
+#ifdef __linux__
+ #include <unistd.h>
+ #include <poll.h>
+ #include <sys/inotify.h>
+#endif  // __linux__
+#include "FolderWatcher.h"
+#include "Log.h"
+
+using namespace wav2mp3;
+
+
+namespace {
+
+/// @return true if uri is a folder, but not a symbolic link to one
+bool isFolder( const std::string& uri )
+{
+    struct stat st;
+#ifdef _WIN32
+    return (0 == stat(uri.c_str(), &st)) && S_ISDIR(st.st_mode);
+#else
+    return (0 == lstat(uri.c_str(), &st)) && S_ISDIR(st.st_mode);
+#endif  // _WIN32
+}
+
+} // anonymous namespace
+
+
+FolderWatcher::FolderWatcher( const std::string& folder, bool recursive ):
+        mFd(-1),
+        mRecursive(recursive),
+        mFolders()
+{
+    mStopFds[0] = mStopFds[1] = -1;
+#ifdef __linux__
+    if( pipe(mStopFds) < 0 )
+    {
+        LOG("ERROR creating pipe: " << strerror(errno) << std::endl);
+        mStopFds[0] = mStopFds[1] = -1;
+        return;
+    }
+    mFd = inotify_init();
+    if( mFd < 0 )
+    {
+        LOG("ERROR initializing inotify: " << strerror(errno) << std::endl);
+        return;
+    }
+    if( !addWatch(folder) )
+    {
+        close(mFd);
+        mFd = -1;
+    }
+#else
+    LOG("ERROR watching folders is supported only on Linux" << std::endl);
+#endif  // __linux__
+}
+
+
+FolderWatcher::~FolderWatcher()
+{
+#ifdef __linux__
+    if( mFd >= 0 ) close(mFd);  // Removes all watches
+    if( mStopFds[0] >= 0 ) close(mStopFds[0]);
+    if( mStopFds[1] >= 0 ) close(mStopFds[1]);
+#endif  // __linux__
+}
+
+
+bool FolderWatcher::addWatch( const std::string& folder )
+{
+#ifdef __linux__
+    int wd = inotify_add_watch(mFd, folder.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE |
+                                                    IN_ONLYDIR | IN_DONT_FOLLOW);
+    if( wd < 0 )
+    {
+        LOG("ERROR watching folder '" << folder << "': " << strerror(errno) << std::endl);
+        return false;
+    }
+    mFolders[wd] = folder;
+    if( !mRecursive ) return true;
+
+    // Watch the subfolders
+    DIR* dir = opendir(folder.c_str());
+    if( NULL == dir ) return true;  // Deleted meanwhile?
+    struct dirent* dent;
+    while( (dent = readdir(dir)) != NULL )
+    {
+        const char* fname = dent->d_name;
+        if( !strcmp(".", fname) || !strcmp("..", fname) ) continue;
+        std::string uri = folder + fname;
+        if( isFolder(uri) ) addWatch(uri + "/");
+    }
+    closedir(dir);
+    return true;
+#else
+    (void) folder;
+    return false;
+#endif  // __linux__
+}
+
+
+bool FolderWatcher::waitForFiles( std::vector<std::string>& uris )
+{
+#ifdef __linux__
+    if( mFd < 0 ) return false;
+
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    size_t numUris = uris.size();
+    while( uris.size() == numUris )
+    {
+        struct pollfd fds[2] = { { mFd, POLLIN, 0 }, { mStopFds[0], POLLIN, 0 } };
+        if( poll(fds, 2, -1) < 0 )
+        {
+            if( EINTR == errno ) continue;
+            LOG("ERROR waiting for inotify events: " << strerror(errno) << std::endl);
+            return false;
+        }
+        if( fds[1].revents ) return false;  // Stopped - the byte is left in the pipe
+
+        ssize_t len = read(mFd, buf, sizeof(buf));
+        if( len < 0 )
+        {
+            if( EINTR == errno ) continue;
+            LOG("ERROR reading inotify events: " << strerror(errno) << std::endl);
+            return false;
+        }
+
+        for( char* p = buf; p < buf + len; )
+        {
+            const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(p);
+            p += sizeof(struct inotify_event) + event->len;
+
+            if( event->mask & IN_Q_OVERFLOW )
+            {
+                LOG("WARNING inotify queue overflow, some files may be missed" << std::endl);
+                continue;
+            }
+            std::map<int, std::string>::iterator it = mFolders.find(event->wd);
+            if( it == mFolders.end() ) continue;
+            if( event->mask & IN_IGNORED )  // Folder deleted or moved away
+            {
+                mFolders.erase(it);
+                continue;
+            }
+            if( 0 == event->len ) continue;
+
+            std::string uri = it->second + event->name;
+            if( event->mask & IN_ISDIR )
+            {
+                // New subfolder - watch it and take the files already in it. Files
+                // still being written there may be reported twice.
+                if( mRecursive && (event->mask & (IN_CREATE | IN_MOVED_TO)) &&
+                    addWatch(uri + "/") )
+                {
+                    findWavFiles(uri + "/", true, uris);
+                }
+            }
+            else if( (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) && isWavFileName(event->name) )
+            {
+                uris.push_back(uri);
+            }
+        }
+    }
+    return true;
+#else
+    (void) uris;
+    return false;
+#endif  // __linux__
+}
+
+
+void FolderWatcher::stop()
+{
+#ifdef __linux__
+    if( mStopFds[1] < 0 ) return;
+    char byte = 0;
+    while( (write(mStopFds[1], &byte, 1) < 0) && (EINTR == errno) ) {}
+#endif  // __linux__
+}
+
+
+bool FolderWatcher::findWavFiles( const std::string& folder, bool recursive,
+                                  std::vector<std::string>& uris )
+{
+    DIR* dir = opendir(folder.c_str());
+    if( NULL == dir ) return false;
+
+    std::vector<std::string> subfolders;
+    struct dirent* dent;
+    while( (dent = readdir(dir)) != NULL )
+    {
+        const char* fname = dent->d_name;
+        if( !strcmp(".", fname) || !strcmp("..", fname) ) continue;
+        if( recursive && isFolder(folder + fname) )
+            subfolders.push_back(folder + fname + "/");
+        else if( isWavFileName(fname) )
+            uris.push_back(folder + fname);
+    }
+    closedir(dir);
+
+    for( size_t i=0; i<subfolders.size(); i++ )
+        findWavFiles(subfolders[i], true, uris);
+    return true;
+}
+
+
+bool FolderWatcher::isWavFileName( const char* name )
+{
+    size_t len = strlen(name);
+    return (len > 4) && !strcasecmp(".wav", name + len - 4);
+}
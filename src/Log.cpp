@@ -0,0 +1,13 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+#include "Log.h"
+
+
+namespace wav2mp3 {
+
+// Statically initialized, so logging works before main() and in the library
+pthread_mutex_t gLogMutex = PTHREAD_MUTEX_INITIALIZER;
+int gLogEnabled = 1;
+
+} // namespace
@@ -0,0 +1,73 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+#include "MemoryBudget.h"
+#include "Locker.h"
+
+using namespace wav2mp3;
+
+
+MemoryBudget::MemoryBudget( uint64_t budget ):
+        mBudget(budget),
+        mInFlight(0),
+        mPeak(0)
+{
+    pthread_mutex_init(&mMutex, NULL);
+    pthread_cond_init(&mReleased, NULL);
+}
+
+
+MemoryBudget::~MemoryBudget()
+{
+    pthread_cond_destroy(&mReleased);
+    pthread_mutex_destroy(&mMutex);
+}
+
+
+bool MemoryBudget::fits( uint64_t bytes ) const
+{
+    return (0 == mBudget) || (0 == mInFlight) || (mInFlight + bytes <= mBudget);
+}
+
+
+void MemoryBudget::acquire( uint64_t bytes )
+{
+    Locker lock(mMutex);
+    while( !fits(bytes) ) pthread_cond_wait(&mReleased, &mMutex);
+    mInFlight += bytes;
+    if( mInFlight > mPeak ) mPeak = mInFlight;
+}
+
+
+bool MemoryBudget::tryAcquire( uint64_t bytes )
+{
+    Locker lock(mMutex);
+    if( !fits(bytes) ) return false;
+    mInFlight += bytes;
+    if( mInFlight > mPeak ) mPeak = mInFlight;
+    return true;
+}
+
+
+void MemoryBudget::release( uint64_t bytes )
+{
+    if( 0 == bytes ) return;
+
+    Locker lock(mMutex);
+    mInFlight = (bytes < mInFlight) ? mInFlight - bytes : 0;
+    pthread_cond_broadcast(&mReleased);
+}
+
+
+uint64_t MemoryBudget::getInFlight() const
+{
+    Locker lock(mMutex);
+    return mInFlight;
+}
+
+
+uint64_t MemoryBudget::getPeak() const
+{
+    Locker lock(mMutex);
+    return mPeak;
+}
@@ -0,0 +1,204 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+#include <cstdio>
+#include <sstream>
+#include "Mp3Writer.h"
+#include "Locker.h"
+#include "Tracer.h"
+#include "Log.h"
+
+using namespace wav2mp3;
+
+
+const char* const Mp3Writer::TEMP_SUFFIX = ".tmp";
+
+
+Mp3Writer::Mp3Writer( unsigned int numThreads, bool atomic, unsigned int queueSize ):
+        mAtomic(atomic),
+        mThreads(numThreads),
+        mNextThread(0),
+        mMeter("write")
+{
+    pthread_mutex_init(&mMutex, NULL);
+    mMeter.start(numThreads, numThreads * queueSize);
+    for( unsigned int i=0; i<numThreads; i++ )
+    {
+        mThreads[i].writer = this;
+        mThreads[i].queue = new RequestQueue(queueSize);
+        pthread_create(&mThreads[i].thread, NULL, writerThread, &mThreads[i]);
+    }
+}
+
+
+Mp3Writer::~Mp3Writer()
+{
+    stop();
+    pthread_mutex_destroy(&mMutex);
+}
+
+
+Mp3Writer& Mp3Writer::getSyncWriter()
+{
+    static Mp3Writer syncWriter(0, false);
+    return syncWriter;
+}
+
+
+void Mp3Writer::stop()
+{
+    // An empty request stops a thread after the queued ones
+    for( size_t i=0; i<mThreads.size(); i++ ) mThreads[i].queue->enqueue(shared_ptr<Request>());
+    for( size_t i=0; i<mThreads.size(); i++ )
+    {
+        pthread_join(mThreads[i].thread, NULL);
+        delete mThreads[i].queue;
+    }
+    mThreads.clear();
+}
+
+
+shared_ptr<Mp3Writer::File> Mp3Writer::open( const std::string& uri,
+                                             shared_ptr<EncodeCache::Ticket> ticket,
+                                             shared_ptr<Progress::Ticket> progress )
+{
+    unsigned int thread = 0;
+    if( !mThreads.empty() )
+    {
+        Locker lock(mMutex);
+        thread = mNextThread++ % mThreads.size();
+    }
+    return shared_ptr<File>(new File(uri, mAtomic ? uri + TEMP_SUFFIX : uri, thread, ticket,
+                                     progress));
+}
+
+
+void Mp3Writer::write( const shared_ptr<File>& file, std::vector<unsigned char>& data )
+{
+    if( data.empty() ) return;
+
+    shared_ptr<Request> request(new Request());
+    request->file = file;
+    request->data.swap(data);
+    submit(request);
+}
+
+
+void Mp3Writer::close( const shared_ptr<File>& file, bool ok )
+{
+    shared_ptr<Request> request(new Request());
+    request->file = file;
+    request->close = true;
+    request->ok = ok;
+    submit(request);
+}
+
+
+void Mp3Writer::submit( const shared_ptr<Request>& request )
+{
+    if( mThreads.empty() )
+    {
+        double start = Tracer::now();
+        execute(*request);
+        mMeter.addTask(Tracer::now() - start);
+    }
+    else
+    {
+        TRACE_SCOPE("writer_queue_wait");
+        RequestQueue* queue = mThreads[request->file->mThread].queue;
+        size_t depth = queue->getSize();
+        if( queue->tryEnqueue(request) )
+        {
+            mMeter.addSubmit(depth, 0);
+            return;
+        }
+        double start = Tracer::now();
+        queue->enqueue(request);
+        mMeter.addSubmit(depth, Tracer::now() - start);
+    }
+}
+
+
+void Mp3Writer::execute( Request& request )
+{
+    File& file = *request.file;
+    TRACE_FILE_SCOPE(request.close ? "close" : "write", file.mUri);
+
+    // Open the file with the first write. Empty mp3 files are created on close.
+    if( !file.mOpened && !file.mFailed && (!request.close || request.ok) )
+    {
+        file.mOut.open(file.mPath.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+        file.mOpened = true;
+        file.mCreated = file.mOut.is_open();
+        if( !file.mCreated )
+        {
+            LOG("ERROR opening mp3 file " << file.mPath << " for writing" << std::endl);
+            file.mFailed = true;
+        }
+    }
+
+    if( !request.close )
+    {
+        if( !file.mFailed )
+        {
+            file.mOut.write(reinterpret_cast<char*>(&request.data[0]), request.data.size());
+            if( !file.mOut )
+            {
+                LOG("ERROR writing mp3 file " << file.mPath << std::endl);
+                file.mFailed = true;
+            }
+        }
+        return;
+    }
+
+    // Close
+    if( file.mOut.is_open() )
+    {
+        file.mOut.close();
+        if( !file.mOut && !file.mFailed )
+        {
+            LOG("ERROR writing mp3 file " << file.mPath << std::endl);
+            file.mFailed = true;
+        }
+    }
+    bool ok = request.ok && !file.mFailed;
+    if( ok && (file.mPath != file.mUri) )
+    {
+#ifdef _WIN32
+        remove(file.mUri.c_str());  // rename() doesn't replace files on Windows
+#endif  // _WIN32
+        if( 0 != rename(file.mPath.c_str(), file.mUri.c_str()) )
+        {
+            LOG("ERROR renaming " << file.mPath << " to " << file.mUri << std::endl);
+            ok = false;
+        }
+    }
+    if( !ok )
+    {
+        // Don't leave partial mp3 files. Files not written by us (e.g. of an earlier run) stay.
+        if( file.mCreated ) remove(file.mPath.c_str());
+        if( file.mTicket ) file.mTicket->fail();
+        if( file.mProgress ) file.mProgress->fail();
+    }
+    file.mTicket.reset();  // The cache entry may be stored here
+    file.mProgress.reset();  // The wav file may finish here
+}
+
+
+void* Mp3Writer::writerThread( void* arg )
+{
+    Thread* thread = static_cast<Thread*>(arg);
+    std::ostringstream name;
+    name << "writer " << (thread - &thread->writer->mThreads[0]) + 1;
+    Tracer::setThreadName(name.str());
+
+    while( true )
+    {
+        shared_ptr<Request> request = thread->queue->dequeue();
+        if( !request ) break;
+        double start = Tracer::now();
+        thread->writer->execute(*request);
+        thread->writer->mMeter.addTask(Tracer::now() - start);
+    }
+    return NULL;
+}
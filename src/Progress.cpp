@@ -0,0 +1,91 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+#include "Progress.h"
+#include "Locker.h"
+
+using namespace wav2mp3;
+
+
+Progress::Ticket::Ticket( Progress& progress, const std::string& uri ):
+        mProgress(progress),
+        mUri(uri),
+        mFailed(false),
+        mInterrupted(false)
+{
+    pthread_mutex_init(&mMutex, NULL);
+}
+
+
+Progress::Ticket::~Ticket()
+{
+    if( !mInterrupted ) mProgress.finish(mUri, !mFailed);
+    pthread_mutex_destroy(&mMutex);
+}
+
+
+void Progress::Ticket::fail()
+{
+    Locker lock(mMutex);
+    mFailed = true;
+}
+
+
+void Progress::Ticket::interrupt()
+{
+    Locker lock(mMutex);
+    mInterrupted = true;
+}
+
+
+Progress::Progress():
+        mPending(),
+        mNumDone(0),
+        mNumFailed(0)
+{
+    pthread_mutex_init(&mMutex, NULL);
+}
+
+
+Progress::~Progress()
+{
+    pthread_mutex_destroy(&mMutex);
+}
+
+
+void Progress::add( const std::string& uri )
+{
+    Locker lock(mMutex);
+    mPending.insert(uri);
+}
+
+
+void Progress::finish( const std::string& uri, bool ok )
+{
+    Locker lock(mMutex);
+    std::multiset<std::string>::iterator it = mPending.find(uri);
+    if( it != mPending.end() ) mPending.erase(it);
+    if( ok ) mNumDone++;
+    else mNumFailed++;
+}
+
+
+size_t Progress::getNumDone() const
+{
+    Locker lock(mMutex);
+    return mNumDone;
+}
+
+
+size_t Progress::getNumFailed() const
+{
+    Locker lock(mMutex);
+    return mNumFailed;
+}
+
+
+std::vector<std::string> Progress::getPending() const
+{
+    Locker lock(mMutex);
+    return std::vector<std::string>(mPending.begin(), mPending.end());
+}
@@ -0,0 +1,104 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+
+#ifndef _WIN32
+ #include <fcntl.h>
+ #include <unistd.h>
+#endif  // _WIN32
+#include "ReadAhead.h"
+#include "Locker.h"
+
+using namespace wav2mp3;
+
+
+ReadAhead::ReadAhead( unsigned int window ):
+        mWindow(window),
+        mQueued(),
+        mNumHinted(0),
+        mNumHints(0)
+{
+    pthread_mutex_init(&mMutex, NULL);
+}
+
+
+ReadAhead::~ReadAhead()
+{
+    pthread_mutex_destroy(&mMutex);
+}
+
+
+void ReadAhead::queued( const std::string& uri )
+{
+    if( 0 == mWindow ) return;
+
+    std::deque<std::string> uris;
+    {
+        Locker lock(mMutex);
+        mQueued.push_back(uri);
+        takeHints(uris);
+    }
+    giveHints(uris);
+}
+
+
+void ReadAhead::started( const std::string& uri )
+{
+    if( 0 == mWindow ) return;
+
+    std::deque<std::string> uris;
+    {
+        Locker lock(mMutex);
+        // Usually the first one, unless several read threads race
+        for( size_t i=0; i<mQueued.size(); i++ )
+        {
+            if( mQueued[i] != uri ) continue;
+            mQueued.erase(mQueued.begin() + i);
+            if( i < mNumHinted ) mNumHinted--;
+            break;
+        }
+        takeHints(uris);
+    }
+    giveHints(uris);
+}
+
+
+uint64_t ReadAhead::getNumHints() const
+{
+    Locker lock(mMutex);
+    return mNumHints;
+}
+
+
+void ReadAhead::takeHints( std::deque<std::string>& uris )
+{
+    while( (mNumHinted < mWindow) && (mNumHinted < mQueued.size()) )
+    {
+        uris.push_back(mQueued[mNumHinted++]);
+        mNumHints++;
+    }
+}
+
+
+void ReadAhead::giveHints( const std::deque<std::string>& uris )
+{
+    // Outside of the lock - opening a file may take a while on network file systems
+    for( size_t i=0; i<uris.size(); i++ ) adviseWillNeed(uris[i]);
+}
+
+
+bool ReadAhead::adviseWillNeed( const std::string& uri )
+{
+#if !defined(_WIN32) && defined(POSIX_FADV_WILLNEED)
+    int fd = open(uri.c_str(), O_RDONLY);
+    if( fd < 0 ) return false;
+    // Starts asynchronous reads of the whole file. The pages stay in the page
+    // cache after the file is closed.
+    bool ok = (0 == posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED));
+    close(fd);
+    return ok;
+#else
+    (void) uri;
+    return false;
+#endif
+}
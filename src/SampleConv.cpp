@@ -0,0 +1,888 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+#include <cstring>
+#include <pthread.h>
+#include "SampleConv.h"
+
+#if (defined(__i386__) || defined(__x86_64__)) && \
+    (defined(__clang__) || (__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9)))
+ // Function target attributes allow AVX2 code without compiling everything with -mavx2
+ #define SAMPLECONV_X86
+ #include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(__aarch64__)
+ #define SAMPLECONV_NEON
+ #include <arm_neon.h>
+#endif
+
+using namespace wav2mp3;
+
+
+namespace {
+
+// Scalar kernels - the reference for all others
+
+void u8ToS16Scalar( const uint8_t* in, int16_t* out, size_t n )
+{
+    for( size_t i=0; i<n; i++ ) out[i] = (int16_t)((uint16_t)(in[i] ^ 0x80) << 8);
+}
+
+
+void u8StereoToS16Scalar( const uint8_t* in, int16_t* outL, int16_t* outR, size_t n )
+{
+    for( size_t i=0; i<n; i++ )
+    {
+        outL[i] = (int16_t)((uint16_t)(in[2*i]   ^ 0x80) << 8);
+        outR[i] = (int16_t)((uint16_t)(in[2*i+1] ^ 0x80) << 8);
+    }
+}
+
+
+inline int32_t s24ToS32One( const uint8_t* p )
+{
+    return (int32_t)(((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 24));
+}
+
+
+void s24ToS32Scalar( const uint8_t* in, int32_t* out, size_t n )
+{
+    for( size_t i=0; i<n; i++ ) out[i] = s24ToS32One(in + 3*i);
+}
+
+
+void s24StereoToS32Scalar( const uint8_t* in, int32_t* outL, int32_t* outR, size_t n )
+{
+    for( size_t i=0; i<n; i++ )
+    {
+        outL[i] = s24ToS32One(in + 6*i);
+        outR[i] = s24ToS32One(in + 6*i + 3);
+    }
+}
+
+
+void s32StereoSplitScalar( const int32_t* in, int32_t* outL, int32_t* outR, size_t n )
+{
+    for( size_t i=0; i<n; i++ )
+    {
+        outL[i] = in[2*i];
+        outR[i] = in[2*i+1];
+    }
+}
+
+
+void f64ToF32Scalar( const double* in, float* out, size_t n )
+{
+    for( size_t i=0; i<n; i++ ) out[i] = (float) in[i];
+}
+
+
+void f64StereoToF32Scalar( const double* in, float* outL, float* outR, size_t n )
+{
+    for( size_t i=0; i<n; i++ )
+    {
+        outL[i] = (float) in[2*i];
+        outR[i] = (float) in[2*i+1];
+    }
+}
+
+
+// Scaling by powers of 2 is exact, int to float conversion rounds to nearest
+
+void s16ToF32Scalar( const int16_t* in, float* out, size_t n )
+{
+    for( size_t i=0; i<n; i++ ) out[i] = (float) in[i] * (1.0f / 32768.0f);
+}
+
+
+void s32ToF32Scalar( const int32_t* in, float* out, size_t n )
+{
+    for( size_t i=0; i<n; i++ ) out[i] = (float) in[i] * (1.0f / 2147483648.0f);
+}
+
+
+/*
+ * The sums are done in the order of the vector kernels: the channels are
+ * padded to 8 with zeros, channel c and c+4 are added first, then pairs of
+ * those. Floating point contraction (FMA) must be off for identical results.
+ */
+void downmixF32Scalar( const float* in, size_t numchan, const float* coefL, const float* coefR,
+                       float* outL, float* outR, size_t n )
+{
+    for( size_t i=0; i<n; i++, in+=numchan )
+    {
+        float x[SampleConv::DOWNMIX_LANES] = { 0 };
+        for( size_t c=0; c<numchan; c++ ) x[c] = in[c];
+
+        float l[4], r[4];
+        for( int c=0; c<4; c++ )
+        {
+            float pl0 = x[c] * coefL[c];
+            float pl1 = x[c+4] * coefL[c+4];
+            float pr0 = x[c] * coefR[c];
+            float pr1 = x[c+4] * coefR[c+4];
+            l[c] = pl0 + pl1;
+            r[c] = pr0 + pr1;
+        }
+        outL[i] = (l[0] + l[1]) + (l[2] + l[3]);
+        outR[i] = (r[0] + r[1]) + (r[2] + r[3]);
+    }
+}
+
+
+#ifdef SAMPLECONV_X86
+
+__attribute__((target("sse2")))
+void u8ToS16SSE2( const uint8_t* in, int16_t* out, size_t n )
+{
+    const __m128i sign = _mm_set1_epi8((char)0x80);
+    const __m128i zero = _mm_setzero_si128();
+    size_t i=0;
+    for( ; i+16<=n; i+=16 )
+    {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in + i)), sign);
+        // Byte in the high half of each 16-bit lane == sample << 8
+        _mm_storeu_si128((__m128i*)(out + i),     _mm_unpacklo_epi8(zero, v));
+        _mm_storeu_si128((__m128i*)(out + i + 8), _mm_unpackhi_epi8(zero, v));
+    }
+    u8ToS16Scalar(in + i, out + i, n - i);
+}
+
+
+__attribute__((target("sse2")))
+void u8StereoToS16SSE2( const uint8_t* in, int16_t* outL, int16_t* outR, size_t n )
+{
+    const __m128i sign = _mm_set1_epi8((char)0x80);
+    const __m128i hmask = _mm_set1_epi16((short)0xFF00);
+    size_t i=0;
+    for( ; i+8<=n; i+=8 )
+    {
+        // Each 16-bit lane is one frame: L in the low byte, R in the high byte
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in + 2*i)), sign);
+        _mm_storeu_si128((__m128i*)(outL + i), _mm_slli_epi16(v, 8));
+        _mm_storeu_si128((__m128i*)(outR + i), _mm_and_si128(v, hmask));
+    }
+    u8StereoToS16Scalar(in + 2*i, outL + i, outR + i, n - i);
+}
+
+
+__attribute__((target("sse2")))
+void s32StereoSplitSSE2( const int32_t* in, int32_t* outL, int32_t* outR, size_t n )
+{
+    size_t i=0;
+    for( ; i+4<=n; i+=4 )
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(in + 2*i));      // L0 R0 L1 R1
+        __m128i b = _mm_loadu_si128((const __m128i*)(in + 2*i + 4));  // L2 R2 L3 R3
+        a = _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 2, 0));             // L0 L1 R0 R1
+        b = _mm_shuffle_epi32(b, _MM_SHUFFLE(3, 1, 2, 0));             // L2 L3 R2 R3
+        _mm_storeu_si128((__m128i*)(outL + i), _mm_unpacklo_epi64(a, b));
+        _mm_storeu_si128((__m128i*)(outR + i), _mm_unpackhi_epi64(a, b));
+    }
+    s32StereoSplitScalar(in + 2*i, outL + i, outR + i, n - i);
+}
+
+
+// Narrowing conversions round to nearest, like the scalar casts
+
+__attribute__((target("sse2")))
+void f64ToF32SSE2( const double* in, float* out, size_t n )
+{
+    size_t i=0;
+    for( ; i+4<=n; i+=4 )
+    {
+        __m128 lo = _mm_cvtpd_ps(_mm_loadu_pd(in + i));      // x0 x1 0 0
+        __m128 hi = _mm_cvtpd_ps(_mm_loadu_pd(in + i + 2));  // x2 x3 0 0
+        _mm_storeu_ps(out + i, _mm_movelh_ps(lo, hi));
+    }
+    f64ToF32Scalar(in + i, out + i, n - i);
+}
+
+
+__attribute__((target("sse2")))
+void f64StereoToF32SSE2( const double* in, float* outL, float* outR, size_t n )
+{
+    size_t i=0;
+    for( ; i+4<=n; i+=4 )
+    {
+        __m128 a = _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(in + 2*i)),       // L0 R0 L1 R1
+                                 _mm_cvtpd_ps(_mm_loadu_pd(in + 2*i + 2)));
+        __m128 b = _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(in + 2*i + 4)),   // L2 R2 L3 R3
+                                 _mm_cvtpd_ps(_mm_loadu_pd(in + 2*i + 6)));
+        _mm_storeu_ps(outL + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_ps(outR + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+    f64StereoToF32Scalar(in + 2*i, outL + i, outR + i, n - i);
+}
+
+
+__attribute__((target("sse2")))
+void s16ToF32SSE2( const int16_t* in, float* out, size_t n )
+{
+    const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+    size_t i=0;
+    for( ; i+8<=n; i+=8 )
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+        // Sample in the high half of each 32-bit lane, shifted down with sign
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        _mm_storeu_ps(out + i,     _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+        _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+    }
+    s16ToF32Scalar(in + i, out + i, n - i);
+}
+
+
+__attribute__((target("sse2")))
+void s32ToF32SSE2( const int32_t* in, float* out, size_t n )
+{
+    const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+    size_t i=0;
+    for( ; i+4<=n; i+=4 )
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(v), scale));
+    }
+    s32ToF32Scalar(in + i, out + i, n - i);
+}
+
+
+/*
+ * 24-bit kernels need byte shuffles, which are not available in SSE2.
+ * Loads are 16 bytes wide, so stop while there are enough bytes left for the last load.
+ */
+
+__attribute__((target("ssse3")))
+void s24ToS32SSSE3( const uint8_t* in, int32_t* out, size_t n )
+{
+    // 4 samples from 12 bytes, each in the 3 high bytes of a 32-bit lane
+    const __m128i shuf = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+    size_t i=0;
+    for( ; i+6<=n; i+=4 )
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + 3*i));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_shuffle_epi8(v, shuf));
+    }
+    s24ToS32Scalar(in + 3*i, out + i, n - i);
+}
+
+
+__attribute__((target("ssse3")))
+void s24StereoToS32SSSE3( const uint8_t* in, int32_t* outL, int32_t* outR, size_t n )
+{
+    // 2 frames from 12 bytes: L0 L1 R0 R1
+    const __m128i shuf = _mm_setr_epi8(-1, 0, 1, 2, -1, 6, 7, 8, -1, 3, 4, 5, -1, 9, 10, 11);
+    size_t i=0;
+    for( ; i+5<=n; i+=4 )
+    {
+        __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + 6*i)), shuf);
+        __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + 6*i + 12)), shuf);
+        _mm_storeu_si128((__m128i*)(outL + i), _mm_unpacklo_epi64(a, b));
+        _mm_storeu_si128((__m128i*)(outR + i), _mm_unpackhi_epi64(a, b));
+    }
+    s24StereoToS32Scalar(in + 6*i, outL + i, outR + i, n - i);
+}
+
+
+/*
+ * Downmix: each frame is loaded in two 4-lane vectors (channels past numchan
+ * masked to zero) and multiplied by the coefficients, the halves are added,
+ * then horizontal adds of 4 frames give L0 R0 L1 R1 and L2 R2 L3 R3. A frame
+ * load reads 8 floats, so the vector loop stops when they pass the end.
+ */
+__attribute__((target("sse3")))
+inline __m128 downmixFrameSSE3( const float* in, __m128 maskLo, __m128 maskHi,
+                                const float* coefL, const float* coefR )
+{
+    __m128 lo = _mm_and_ps(_mm_loadu_ps(in), maskLo);
+    __m128 hi = _mm_and_ps(_mm_loadu_ps(in + 4), maskHi);
+    __m128 l = _mm_add_ps(_mm_mul_ps(lo, _mm_loadu_ps(coefL)), _mm_mul_ps(hi, _mm_loadu_ps(coefL + 4)));
+    __m128 r = _mm_add_ps(_mm_mul_ps(lo, _mm_loadu_ps(coefR)), _mm_mul_ps(hi, _mm_loadu_ps(coefR + 4)));
+    return _mm_hadd_ps(l, r);  // l0+l1 l2+l3 r0+r1 r2+r3
+}
+
+
+/// @return mask of the lanes first..first+3 which are below numchan
+__attribute__((target("sse2")))
+inline __m128 downmixMaskSSE( size_t numchan, size_t first )
+{
+    int32_t m[4];
+    for( size_t c=0; c<4; c++ ) m[c] = (first + c < numchan) ? -1 : 0;
+    return _mm_castsi128_ps(_mm_setr_epi32(m[0], m[1], m[2], m[3]));
+}
+
+
+__attribute__((target("sse3")))
+void downmixF32SSE3( const float* in, size_t numchan, const float* coefL, const float* coefR,
+                     float* outL, float* outR, size_t n )
+{
+    const __m128 maskLo = downmixMaskSSE(numchan, 0);
+    const __m128 maskHi = downmixMaskSSE(numchan, 4);
+    size_t i=0;
+    for( ; (i+3)*numchan + 8 <= n*numchan; i+=4 )
+    {
+        const float* p = in + i*numchan;
+        __m128 f0 = downmixFrameSSE3(p,             maskLo, maskHi, coefL, coefR);
+        __m128 f1 = downmixFrameSSE3(p + numchan,   maskLo, maskHi, coefL, coefR);
+        __m128 f2 = downmixFrameSSE3(p + 2*numchan, maskLo, maskHi, coefL, coefR);
+        __m128 f3 = downmixFrameSSE3(p + 3*numchan, maskLo, maskHi, coefL, coefR);
+        __m128 a = _mm_hadd_ps(f0, f1);  // L0 R0 L1 R1
+        __m128 b = _mm_hadd_ps(f2, f3);  // L2 R2 L3 R3
+        _mm_storeu_ps(outL + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_ps(outR + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+    downmixF32Scalar(in + i*numchan, numchan, coefL, coefR, outL + i, outR + i, n - i);
+}
+
+
+__attribute__((target("avx2")))
+void u8ToS16AVX2( const uint8_t* in, int16_t* out, size_t n )
+{
+    const __m128i sign = _mm_set1_epi8((char)0x80);
+    size_t i=0;
+    for( ; i+16<=n; i+=16 )
+    {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in + i)), sign);
+        __m256i w = _mm256_slli_epi16(_mm256_cvtepu8_epi16(v), 8);
+        _mm256_storeu_si256((__m256i*)(out + i), w);
+    }
+    u8ToS16Scalar(in + i, out + i, n - i);
+}
+
+
+__attribute__((target("avx2")))
+void u8StereoToS16AVX2( const uint8_t* in, int16_t* outL, int16_t* outR, size_t n )
+{
+    const __m256i sign = _mm256_set1_epi8((char)0x80);
+    const __m256i hmask = _mm256_set1_epi16((short)0xFF00);
+    size_t i=0;
+    for( ; i+16<=n; i+=16 )
+    {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(in + 2*i)), sign);
+        _mm256_storeu_si256((__m256i*)(outL + i), _mm256_slli_epi16(v, 8));
+        _mm256_storeu_si256((__m256i*)(outR + i), _mm256_and_si256(v, hmask));
+    }
+    u8StereoToS16Scalar(in + 2*i, outL + i, outR + i, n - i);
+}
+
+
+__attribute__((target("avx2")))
+inline __m256i load2x128( const uint8_t* lo, const uint8_t* hi )
+{
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)lo)),
+                                   _mm_loadu_si128((const __m128i*)hi), 1);
+}
+
+
+__attribute__((target("avx2")))
+void s24ToS32AVX2( const uint8_t* in, int32_t* out, size_t n )
+{
+    // 4 samples from 12 bytes in each 128-bit lane
+    const __m256i shuf = _mm256_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+                                          -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+    size_t i=0;
+    for( ; i+10<=n; i+=8 )
+    {
+        __m256i v = load2x128(in + 3*i, in + 3*i + 12);
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_shuffle_epi8(v, shuf));
+    }
+    s24ToS32SSSE3(in + 3*i, out + i, n - i);
+}
+
+
+__attribute__((target("avx2")))
+void s24StereoToS32AVX2( const uint8_t* in, int32_t* outL, int32_t* outR, size_t n )
+{
+    // 2 frames from 12 bytes in each 128-bit lane: L0 L1 R0 R1
+    const __m256i shuf = _mm256_setr_epi8(-1, 0, 1, 2, -1, 6, 7, 8, -1, 3, 4, 5, -1, 9, 10, 11,
+                                          -1, 0, 1, 2, -1, 6, 7, 8, -1, 3, 4, 5, -1, 9, 10, 11);
+    size_t i=0;
+    for( ; i+9<=n; i+=8 )
+    {
+        const uint8_t* p = in + 6*i;
+        __m256i a = _mm256_shuffle_epi8(load2x128(p, p + 24), shuf);       // frames 0-1 | 4-5
+        __m256i b = _mm256_shuffle_epi8(load2x128(p + 12, p + 36), shuf);  // frames 2-3 | 6-7
+        _mm256_storeu_si256((__m256i*)(outL + i), _mm256_unpacklo_epi64(a, b));
+        _mm256_storeu_si256((__m256i*)(outR + i), _mm256_unpackhi_epi64(a, b));
+    }
+    s24StereoToS32SSSE3(in + 6*i, outL + i, outR + i, n - i);
+}
+
+
+__attribute__((target("avx2")))
+void s32StereoSplitAVX2( const int32_t* in, int32_t* outL, int32_t* outR, size_t n )
+{
+    size_t i=0;
+    for( ; i+8<=n; i+=8 )
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(in + 2*i));      // frames 0-1 | 2-3
+        __m256i b = _mm256_loadu_si256((const __m256i*)(in + 2*i + 8));  // frames 4-5 | 6-7
+        a = _mm256_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 2, 0));  // L0 L1 R0 R1 | L2 L3 R2 R3
+        b = _mm256_shuffle_epi32(b, _MM_SHUFFLE(3, 1, 2, 0));  // L4 L5 R4 R5 | L6 L7 R6 R7
+        __m256i l = _mm256_unpacklo_epi64(a, b);               // L0 L1 L4 L5 | L2 L3 L6 L7
+        __m256i r = _mm256_unpackhi_epi64(a, b);
+        _mm256_storeu_si256((__m256i*)(outL + i), _mm256_permute4x64_epi64(l, _MM_SHUFFLE(3, 1, 2, 0)));
+        _mm256_storeu_si256((__m256i*)(outR + i), _mm256_permute4x64_epi64(r, _MM_SHUFFLE(3, 1, 2, 0)));
+    }
+    s32StereoSplitSSE2(in + 2*i, outL + i, outR + i, n - i);
+}
+
+
+__attribute__((target("avx2")))
+void s16ToF32AVX2( const int16_t* in, float* out, size_t n )
+{
+    const __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+    size_t i=0;
+    for( ; i+8<=n; i+=8 )
+    {
+        __m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(in + i)));
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+    }
+    s16ToF32SSE2(in + i, out + i, n - i);
+}
+
+
+__attribute__((target("avx2")))
+void s32ToF32AVX2( const int32_t* in, float* out, size_t n )
+{
+    const __m256 scale = _mm256_set1_ps(1.0f / 2147483648.0f);
+    size_t i=0;
+    for( ; i+8<=n; i+=8 )
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+    }
+    s32ToF32SSE2(in + i, out + i, n - i);
+}
+
+
+/// Like downmixFrameSSE3(), with one 8-lane load and multiplication
+__attribute__((target("avx2")))
+inline __m128 downmixFrameAVX2( const float* in, __m256 mask, __m256 coefL, __m256 coefR )
+{
+    __m256 x = _mm256_and_ps(_mm256_loadu_ps(in), mask);
+    __m256 l = _mm256_mul_ps(x, coefL);
+    __m256 r = _mm256_mul_ps(x, coefR);
+    return _mm_hadd_ps(_mm_add_ps(_mm256_castps256_ps128(l), _mm256_extractf128_ps(l, 1)),
+                       _mm_add_ps(_mm256_castps256_ps128(r), _mm256_extractf128_ps(r, 1)));
+}
+
+
+__attribute__((target("avx2")))
+void downmixF32AVX2( const float* in, size_t numchan, const float* coefL, const float* coefR,
+                     float* outL, float* outR, size_t n )
+{
+    const __m256 mask = _mm256_insertf128_ps(_mm256_castps128_ps256(downmixMaskSSE(numchan, 0)),
+                                             downmixMaskSSE(numchan, 4), 1);
+    const __m256 cl = _mm256_loadu_ps(coefL);
+    const __m256 cr = _mm256_loadu_ps(coefR);
+    size_t i=0;
+    for( ; (i+3)*numchan + 8 <= n*numchan; i+=4 )
+    {
+        const float* p = in + i*numchan;
+        __m128 a = _mm_hadd_ps(downmixFrameAVX2(p, mask, cl, cr),
+                               downmixFrameAVX2(p + numchan, mask, cl, cr));      // L0 R0 L1 R1
+        __m128 b = _mm_hadd_ps(downmixFrameAVX2(p + 2*numchan, mask, cl, cr),
+                               downmixFrameAVX2(p + 3*numchan, mask, cl, cr));    // L2 R2 L3 R3
+        _mm_storeu_ps(outL + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_ps(outR + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+    downmixF32Scalar(in + i*numchan, numchan, coefL, coefR, outL + i, outR + i, n - i);
+}
+
+
+__attribute__((target("avx2")))
+void f64ToF32AVX2( const double* in, float* out, size_t n )
+{
+    size_t i=0;
+    for( ; i+8<=n; i+=8 )
+    {
+        _mm_storeu_ps(out + i,     _mm256_cvtpd_ps(_mm256_loadu_pd(in + i)));
+        _mm_storeu_ps(out + i + 4, _mm256_cvtpd_ps(_mm256_loadu_pd(in + i + 4)));
+    }
+    f64ToF32SSE2(in + i, out + i, n - i);
+}
+
+
+__attribute__((target("avx2")))
+void f64StereoToF32AVX2( const double* in, float* outL, float* outR, size_t n )
+{
+    size_t i=0;
+    for( ; i+4<=n; i+=4 )
+    {
+        __m128 a = _mm256_cvtpd_ps(_mm256_loadu_pd(in + 2*i));      // L0 R0 L1 R1
+        __m128 b = _mm256_cvtpd_ps(_mm256_loadu_pd(in + 2*i + 4));  // L2 R2 L3 R3
+        _mm_storeu_ps(outL + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_ps(outR + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+    f64StereoToF32SSE2(in + 2*i, outL + i, outR + i, n - i);
+}
+
+#endif  // SAMPLECONV_X86
+
+
+#ifdef SAMPLECONV_NEON
+
+void u8ToS16NEON( const uint8_t* in, int16_t* out, size_t n )
+{
+    const uint8x8_t sign = vdup_n_u8(0x80);
+    size_t i=0;
+    for( ; i+8<=n; i+=8 )
+    {
+        uint16x8_t w = vshll_n_u8(veor_u8(vld1_u8(in + i), sign), 8);
+        vst1q_s16(out + i, vreinterpretq_s16_u16(w));
+    }
+    u8ToS16Scalar(in + i, out + i, n - i);
+}
+
+
+void u8StereoToS16NEON( const uint8_t* in, int16_t* outL, int16_t* outR, size_t n )
+{
+    const uint8x8_t sign = vdup_n_u8(0x80);
+    size_t i=0;
+    for( ; i+8<=n; i+=8 )
+    {
+        uint8x8x2_t v = vld2_u8(in + 2*i);  // Deinterleaves L and R
+        vst1q_s16(outL + i, vreinterpretq_s16_u16(vshll_n_u8(veor_u8(v.val[0], sign), 8)));
+        vst1q_s16(outR + i, vreinterpretq_s16_u16(vshll_n_u8(veor_u8(v.val[1], sign), 8)));
+    }
+    u8StereoToS16Scalar(in + 2*i, outL + i, outR + i, n - i);
+}
+
+
+/// Converts 8 packed 24-bit samples to two vectors of 4 32-bit samples
+inline void s24x8ToS32NEON( const uint8_t* in, uint32x4_t& lo, uint32x4_t& hi )
+{
+    uint8x8x3_t v = vld3_u8(in);  // Low, middle and high bytes of 8 samples
+    uint8x8x2_t b0 = vzip_u8(vdup_n_u8(0), v.val[0]);  // 16-bit lanes: low byte << 8
+    uint8x8x2_t b12 = vzip_u8(v.val[1], v.val[2]);     // 16-bit lanes: middle | high << 8
+    uint16x4x2_t s03 = vzip_u16(vreinterpret_u16_u8(b0.val[0]), vreinterpret_u16_u8(b12.val[0]));
+    uint16x4x2_t s47 = vzip_u16(vreinterpret_u16_u8(b0.val[1]), vreinterpret_u16_u8(b12.val[1]));
+    lo = vreinterpretq_u32_u16(vcombine_u16(s03.val[0], s03.val[1]));
+    hi = vreinterpretq_u32_u16(vcombine_u16(s47.val[0], s47.val[1]));
+}
+
+
+void s24ToS32NEON( const uint8_t* in, int32_t* out, size_t n )
+{
+    size_t i=0;
+    for( ; i+8<=n; i+=8 )
+    {
+        uint32x4_t lo, hi;
+        s24x8ToS32NEON(in + 3*i, lo, hi);
+        vst1q_s32(out + i,     vreinterpretq_s32_u32(lo));
+        vst1q_s32(out + i + 4, vreinterpretq_s32_u32(hi));
+    }
+    s24ToS32Scalar(in + 3*i, out + i, n - i);
+}
+
+
+void s24StereoToS32NEON( const uint8_t* in, int32_t* outL, int32_t* outR, size_t n )
+{
+    size_t i=0;
+    for( ; i+4<=n; i+=4 )
+    {
+        uint32x4_t lo, hi;  // L0 R0 L1 R1, L2 R2 L3 R3
+        s24x8ToS32NEON(in + 6*i, lo, hi);
+        uint32x4x2_t lr = vuzpq_u32(lo, hi);
+        vst1q_s32(outL + i, vreinterpretq_s32_u32(lr.val[0]));
+        vst1q_s32(outR + i, vreinterpretq_s32_u32(lr.val[1]));
+    }
+    s24StereoToS32Scalar(in + 6*i, outL + i, outR + i, n - i);
+}
+
+
+void s32StereoSplitNEON( const int32_t* in, int32_t* outL, int32_t* outR, size_t n )
+{
+    size_t i=0;
+    for( ; i+4<=n; i+=4 )
+    {
+        int32x4x2_t v = vld2q_s32(in + 2*i);
+        vst1q_s32(outL + i, v.val[0]);
+        vst1q_s32(outR + i, v.val[1]);
+    }
+    s32StereoSplitScalar(in + 2*i, outL + i, outR + i, n - i);
+}
+
+
+void s16ToF32NEON( const int16_t* in, float* out, size_t n )
+{
+    size_t i=0;
+    for( ; i+8<=n; i+=8 )
+    {
+        int16x8_t v = vld1q_s16(in + i);
+        vst1q_f32(out + i,     vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), 1.0f / 32768.0f));
+        vst1q_f32(out + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), 1.0f / 32768.0f));
+    }
+    s16ToF32Scalar(in + i, out + i, n - i);
+}
+
+
+void s32ToF32NEON( const int32_t* in, float* out, size_t n )
+{
+    size_t i=0;
+    for( ; i+4<=n; i+=4 )
+        vst1q_f32(out + i, vmulq_n_f32(vcvtq_f32_s32(vld1q_s32(in + i)), 1.0f / 2147483648.0f));
+    s32ToF32Scalar(in + i, out + i, n - i);
+}
+
+
+/// Pairwise add: a0+a1 a2+a3 b0+b1 b2+b3 (like SSE3 hadd)
+inline float32x4_t paddNEON( float32x4_t a, float32x4_t b )
+{
+#ifdef __aarch64__
+    return vpaddq_f32(a, b);
+#else
+    return vcombine_f32(vpadd_f32(vget_low_f32(a), vget_high_f32(a)),
+                        vpadd_f32(vget_low_f32(b), vget_high_f32(b)));
+#endif
+}
+
+
+/// See downmixFrameSSE3()
+inline float32x4_t downmixFrameNEON( const float* in, uint32x4_t maskLo, uint32x4_t maskHi,
+                                     const float* coefL, const float* coefR )
+{
+    float32x4_t lo = vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(vld1q_f32(in)), maskLo));
+    float32x4_t hi = vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(vld1q_f32(in + 4)), maskHi));
+    float32x4_t l = vaddq_f32(vmulq_f32(lo, vld1q_f32(coefL)), vmulq_f32(hi, vld1q_f32(coefL + 4)));
+    float32x4_t r = vaddq_f32(vmulq_f32(lo, vld1q_f32(coefR)), vmulq_f32(hi, vld1q_f32(coefR + 4)));
+    return paddNEON(l, r);
+}
+
+
+void downmixF32NEON( const float* in, size_t numchan, const float* coefL, const float* coefR,
+                     float* outL, float* outR, size_t n )
+{
+    uint32_t m[8];
+    for( size_t c=0; c<8; c++ ) m[c] = (c < numchan) ? 0xFFFFFFFF : 0;
+    const uint32x4_t maskLo = vld1q_u32(m);
+    const uint32x4_t maskHi = vld1q_u32(m + 4);
+    size_t i=0;
+    for( ; (i+3)*numchan + 8 <= n*numchan; i+=4 )
+    {
+        const float* p = in + i*numchan;
+        float32x4_t a = paddNEON(downmixFrameNEON(p, maskLo, maskHi, coefL, coefR),
+                                 downmixFrameNEON(p + numchan, maskLo, maskHi, coefL, coefR));
+        float32x4_t b = paddNEON(downmixFrameNEON(p + 2*numchan, maskLo, maskHi, coefL, coefR),
+                                 downmixFrameNEON(p + 3*numchan, maskLo, maskHi, coefL, coefR));
+        float32x4x2_t lr = vuzpq_f32(a, b);  // L0 L1 L2 L3, R0 R1 R2 R3
+        vst1q_f32(outL + i, lr.val[0]);
+        vst1q_f32(outR + i, lr.val[1]);
+    }
+    downmixF32Scalar(in + i*numchan, numchan, coefL, coefR, outL + i, outR + i, n - i);
+}
+
+
+#ifdef __aarch64__  // 64-bit float vectors are not available in ARMv7 NEON
+
+void f64ToF32NEON( const double* in, float* out, size_t n )
+{
+    size_t i=0;
+    for( ; i+4<=n; i+=4 )
+    {
+        vst1q_f32(out + i, vcombine_f32(vcvt_f32_f64(vld1q_f64(in + i)),
+                                        vcvt_f32_f64(vld1q_f64(in + i + 2))));
+    }
+    f64ToF32Scalar(in + i, out + i, n - i);
+}
+
+
+void f64StereoToF32NEON( const double* in, float* outL, float* outR, size_t n )
+{
+    size_t i=0;
+    for( ; i+4<=n; i+=4 )
+    {
+        float64x2x2_t a = vld2q_f64(in + 2*i);      // L0 L1, R0 R1
+        float64x2x2_t b = vld2q_f64(in + 2*i + 4);  // L2 L3, R2 R3
+        vst1q_f32(outL + i, vcombine_f32(vcvt_f32_f64(a.val[0]), vcvt_f32_f64(b.val[0])));
+        vst1q_f32(outR + i, vcombine_f32(vcvt_f32_f64(a.val[1]), vcvt_f32_f64(b.val[1])));
+    }
+    f64StereoToF32Scalar(in + 2*i, outL + i, outR + i, n - i);
+}
+
+#else
+ #define f64ToF32NEON f64ToF32Scalar
+ #define f64StereoToF32NEON f64StereoToF32Scalar
+#endif  // __aarch64__
+
+#endif  // SAMPLECONV_NEON
+
+
+const SampleConv::Kernels kScalarKernels = {
+    "scalar", u8ToS16Scalar, u8StereoToS16Scalar, s24ToS32Scalar, s24StereoToS32Scalar,
+    s32StereoSplitScalar, f64ToF32Scalar, f64StereoToF32Scalar, s16ToF32Scalar, s32ToF32Scalar,
+    downmixF32Scalar
+};
+
+
+/**
+ * Fills kernels with the implementation called name, falling back to lower
+ * levels for kernels which don't have it.
+ *
+ * @return false if name is unknown or not supported by the CPU
+ */
+bool buildKernels( const char* name, SampleConv::Kernels& kernels )
+{
+    kernels = kScalarKernels;
+    if( !strcmp(name, "scalar") ) return true;
+
+#ifdef SAMPLECONV_X86
+    int level;
+    if( !strcmp(name, "sse2") )       level = 1;
+    else if( !strcmp(name, "ssse3") ) level = 2;
+    else if( !strcmp(name, "avx2") )  level = 3;
+    else return false;
+
+    __builtin_cpu_init();
+    if( (level >= 1) && !__builtin_cpu_supports("sse2") )  return false;
+    if( (level >= 2) && !__builtin_cpu_supports("ssse3") ) return false;
+    if( (level >= 3) && !__builtin_cpu_supports("avx2") )  return false;
+
+    kernels.name = name;
+    kernels.u8ToS16 = u8ToS16SSE2;
+    kernels.u8StereoToS16 = u8StereoToS16SSE2;
+    kernels.s32StereoSplit = s32StereoSplitSSE2;
+    kernels.f64ToF32 = f64ToF32SSE2;
+    kernels.f64StereoToF32 = f64StereoToF32SSE2;
+    kernels.s16ToF32 = s16ToF32SSE2;
+    kernels.s32ToF32 = s32ToF32SSE2;
+    if( level >= 2 )
+    {
+        kernels.s24ToS32 = s24ToS32SSSE3;
+        kernels.s24StereoToS32 = s24StereoToS32SSSE3;
+        kernels.downmixF32 = downmixF32SSE3;
+    }
+    if( level >= 3 )
+    {
+        kernels.u8ToS16 = u8ToS16AVX2;
+        kernels.u8StereoToS16 = u8StereoToS16AVX2;
+        kernels.s24ToS32 = s24ToS32AVX2;
+        kernels.s24StereoToS32 = s24StereoToS32AVX2;
+        kernels.s32StereoSplit = s32StereoSplitAVX2;
+        kernels.f64ToF32 = f64ToF32AVX2;
+        kernels.f64StereoToF32 = f64StereoToF32AVX2;
+        kernels.s16ToF32 = s16ToF32AVX2;
+        kernels.s32ToF32 = s32ToF32AVX2;
+        kernels.downmixF32 = downmixF32AVX2;
+    }
+    return true;
+#elif defined(SAMPLECONV_NEON)
+    if( strcmp(name, "neon") ) return false;
+
+    SampleConv::Kernels neon = {
+        "neon", u8ToS16NEON, u8StereoToS16NEON, s24ToS32NEON, s24StereoToS32NEON,
+        s32StereoSplitNEON, f64ToF32NEON, f64StereoToF32NEON, s16ToF32NEON, s32ToF32NEON,
+        downmixF32NEON
+    };
+    kernels = neon;
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+pthread_once_t gKernelsOnce = PTHREAD_ONCE_INIT;
+
+} // anonymous namespace
+
+
+SampleConv::Kernels SampleConv::sKernels = kScalarKernels;
+
+
+void SampleConv::init()
+{
+    static const char* const impls[] = { "avx2", "ssse3", "sse2", "neon" };
+    for( size_t i=0; i<sizeof(impls)/sizeof(impls[0]); i++ )
+    {
+        if( buildKernels(impls[i], sKernels) ) return;
+    }
+    sKernels = kScalarKernels;
+}
+
+
+const SampleConv::Kernels& SampleConv::kernels()
+{
+    pthread_once(&gKernelsOnce, SampleConv::init);
+    return sKernels;
+}
+
+
+const char* SampleConv::getImplName()
+{
+    return kernels().name;
+}
+
+
+bool SampleConv::selectImpl( const char* name )
+{
+    kernels();  // Make sure init() will not override the selection
+    Kernels selected;
+    if( !buildKernels(name, selected) ) return false;
+    sKernels = selected;
+    return true;
+}
+
+
+void SampleConv::u8ToS16( const uint8_t* in, int16_t* out, size_t n )
+{
+    kernels().u8ToS16(in, out, n);
+}
+
+
+void SampleConv::u8StereoToS16( const uint8_t* in, int16_t* outL, int16_t* outR, size_t n )
+{
+    kernels().u8StereoToS16(in, outL, outR, n);
+}
+
+
+void SampleConv::s24ToS32( const uint8_t* in, int32_t* out, size_t n )
+{
+    kernels().s24ToS32(in, out, n);
+}
+
+
+void SampleConv::s24StereoToS32( const uint8_t* in, int32_t* outL, int32_t* outR, size_t n )
+{
+    kernels().s24StereoToS32(in, outL, outR, n);
+}
+
+
+void SampleConv::s32StereoSplit( const int32_t* in, int32_t* outL, int32_t* outR, size_t n )
+{
+    kernels().s32StereoSplit(in, outL, outR, n);
+}
+
+
+void SampleConv::f64ToF32( const double* in, float* out, size_t n )
+{
+    kernels().f64ToF32(in, out, n);
+}
+
+
+void SampleConv::f64StereoToF32( const double* in, float* outL, float* outR, size_t n )
+{
+    kernels().f64StereoToF32(in, outL, outR, n);
+}
+
+
+void SampleConv::s16ToF32( const int16_t* in, float* out, size_t n )
+{
+    kernels().s16ToF32(in, out, n);
+}
+
+
+void SampleConv::s32ToF32( const int32_t* in, float* out, size_t n )
+{
+    kernels().s32ToF32(in, out, n);
+}
+
+
+void SampleConv::downmixF32( const float* in, size_t numchan, const float* coefL,
+                             const float* coefR, float* outL, float* outR, size_t n )
+{
+    kernels().downmixF32(in, numchan, coefL, coefR, outL, outR, n);
+}
@@ -0,0 +1,71 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+#include <algorithm>
+#include <sys/stat.h>
+#include "SchedulePolicy.h"
+#include "WavFile.h"
+
+using namespace wav2mp3;
+
+
+namespace {
+
+class FifoPolicy : public SchedulePolicy
+{
+  public:
+    virtual const char* getName() const { return "fifo"; }
+    virtual bool usesCost() const { return false; }
+    virtual void order( std::vector<ScheduledFile>& ) const {}
+};
+
+
+bool costGreater( const ScheduledFile& a, const ScheduledFile& b ) { return a.cost > b.cost; }
+bool costLess( const ScheduledFile& a, const ScheduledFile& b ) { return a.cost < b.cost; }
+
+
+class LptPolicy : public SchedulePolicy
+{
+  public:
+    virtual const char* getName() const { return "lpt"; }
+    virtual bool usesCost() const { return true; }
+    virtual void order( std::vector<ScheduledFile>& files ) const
+    {
+        std::stable_sort(files.begin(), files.end(), costGreater);
+    }
+};
+
+
+class SjfPolicy : public SchedulePolicy
+{
+  public:
+    virtual const char* getName() const { return "sjf"; }
+    virtual bool usesCost() const { return true; }
+    virtual void order( std::vector<ScheduledFile>& files ) const
+    {
+        std::stable_sort(files.begin(), files.end(), costLess);
+    }
+};
+
+} // anonymous namespace
+
+
+SchedulePolicy* SchedulePolicy::create( const std::string& name )
+{
+    if( "fifo" == name ) return new FifoPolicy();
+    if( "lpt" == name )  return new LptPolicy();
+    if( "sjf" == name )  return new SjfPolicy();
+    return NULL;
+}
+
+
+uint64_t SchedulePolicy::estimateCost( const std::string& uri )
+{
+    WavInfo info;
+    uint64_t samples = 0;
+    if( WavFile::probe(uri, info) ) samples = info.numFrames * info.fmt.numchan;
+    if( samples > 0 ) return samples;
+
+    struct stat st;
+    return (0 == stat(uri.c_str(), &st)) ? st.st_size : 0;
+}
@@ -0,0 +1,186 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+#include <cstring>
+#include <algorithm>
+#include "SegmentedChunk.h"
+#include "Locker.h"
+#include "Log.h"
+
+using namespace wav2mp3;
+
+
+SegmentedChunk::SegmentedChunk( shared_ptr<WavFile> wavFilePtr, const std::string& mp3Uri,
+                                unsigned int maxSegments, Mp3Writer* writer ):
+        mWavFilePtr(wavFilePtr),
+        mWavUri(wavFilePtr->getURI()),
+        mMp3Uri(mp3Uri),
+        mFmt(wavFilePtr->getFormat()),
+        mChannelMask(wavFilePtr->getChannelMask()),
+        mData(NULL),
+        mDataOffset(wavFilePtr->getRawAudioDataOffset()),
+        mNumFrames(0),
+        mMp3FrameSize(mFmt.samprate >= 32000 ? 1152 : 576),  // MPEG-1 or MPEG-2(.5) layer III
+        mBounds(),
+        mOutputs(),
+        mDone(),
+        mNextToWrite(0),
+        mNumDone(0),
+        mFailed(false),
+        mWriter(writer ? writer : &Mp3Writer::getSyncWriter()),
+        mMp3File(),
+        mTicket(),
+        mProgress()
+{
+    if( WavFile::READ_STREAM != wavFilePtr->getReadMode() )
+        mData = wavFilePtr->getRawAudioDataPtr();
+    if( mFmt.blkalign )
+        mNumFrames = wavFilePtr->getRawAudioDataSize() / mFmt.blkalign;
+
+    // Split only if LAME will not resample, otherwise mp3 frames are not aligned
+    // to a whole number of input frames.
+    static const uint32_t rates[] = {8000, 11025, 12000, 16000, 22050, 24000,
+                                     32000, 44100, 48000};
+    bool stdRate = (std::find(rates, rates + sizeof(rates)/sizeof(rates[0]), mFmt.samprate) !=
+                    rates + sizeof(rates)/sizeof(rates[0]));
+
+    mBounds.push_back(0);
+    if( stdRate && (maxSegments > 1) )
+    {
+        uint64_t mp3Frames = (mNumFrames + mMp3FrameSize - 1) / mMp3FrameSize;
+        uint64_t segMp3Frames = std::max<uint64_t>(MIN_SEGMENT_FRAMES,
+                                                   (mp3Frames + maxSegments - 1) / maxSegments);
+        for( uint64_t b = segMp3Frames * mMp3FrameSize; b < mNumFrames;
+             b += segMp3Frames * mMp3FrameSize )
+        {
+            mBounds.push_back(b);
+        }
+    }
+    mBounds.push_back(mNumFrames);
+
+    mOutputs.resize(getNumSegments());
+    mDone.resize(getNumSegments(), false);
+    pthread_mutex_init(&mMutex, NULL);
+}
+
+
+SegmentedChunk::~SegmentedChunk()
+{
+    if( mMp3File ) mWriter->close(mMp3File, false);  // Not all segments were done
+    pthread_mutex_destroy(&mMutex);
+}
+
+
+const char* SegmentedChunk::readFrames( uint64_t first, uint32_t count, PooledBuffer<char>& buf,
+                                        std::ifstream& file ) const
+{
+    if( (first + count) > mNumFrames ) return NULL;
+
+    uint64_t offset = first * mFmt.blkalign;
+    if( NULL != mData ) return mData + offset;
+
+    // Streamed file - each worker reads its segment with its own file handle
+    if( !file.is_open() )
+    {
+        file.clear();
+        file.open(mWavUri.c_str(), std::ios::in | std::ios::binary);
+        if( !file.is_open() ) return NULL;
+    }
+
+    size_t size = (size_t) count * mFmt.blkalign;
+    if( (buf.size() < size) && !buf.resize(size) ) return NULL;
+    file.clear();
+    file.seekg(mDataOffset + offset, std::ios::beg);
+    file.read(buf.data(), size);
+    if( (size_t) file.gcount() != size ) return NULL;
+
+    return buf.data();
+}
+
+
+bool SegmentedChunk::addSegmentOutput( int segment, std::vector<unsigned char>& mp3Data, bool ok )
+{
+    Locker lock(mMutex);
+
+    if( !ok ) mFailed = true;
+    mOutputs[segment].swap(mp3Data);
+    mDone[segment] = true;
+    mNumDone++;
+
+    // Pass all completed segments in order to the writer, which frees their buffers
+    while( (mNextToWrite < getNumSegments()) && mDone[mNextToWrite] )
+    {
+        std::vector<unsigned char>& out = mOutputs[mNextToWrite];
+        if( !mFailed )
+        {
+            if( !mMp3File ) mMp3File = mWriter->open(mMp3Uri, mTicket, mProgress);
+            mWriter->write(mMp3File, out);
+        }
+        std::vector<unsigned char>().swap(out);
+        mNextToWrite++;
+    }
+
+    bool last = (mNumDone == getNumSegments());
+    if( last )
+    {
+        if( mFailed ) LOG("ERROR encoding segmented chunk " << mMp3Uri << std::endl);
+
+        // Partial mp3 files are removed by the writer. If no segment was written
+        // (e.g. the run was cancelled) the file is not touched.
+        if( !mMp3File && !mFailed ) mMp3File = mWriter->open(mMp3Uri, mTicket, mProgress);
+        if( mMp3File ) mWriter->close(mMp3File, !mFailed);
+        mMp3File.reset();
+        mTicket.reset();
+        mProgress.reset();
+    }
+    return last;
+}
+
+
+bool SegmentedChunk::hasFailed() const
+{
+    Locker lock(mMutex);
+    return mFailed;
+}
+
+
+/**
+ * Parses MPEG audio layer III frame headers to find frame lengths.
+ * Free format bitstreams are not supported (LAME doesn't produce them by default).
+ */
+size_t SegmentedChunk::findMp3FrameOffset( const unsigned char* buf, size_t size,
+                                           uint32_t frameIdx )
+{
+    static const int brates[2][16] = {
+        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},      // MPEG-2(.5)
+        {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0}  // MPEG-1
+    };
+    static const int srates[4][3] = {
+        {11025, 12000, 8000},   // MPEG-2.5
+        {0, 0, 0},              // reserved
+        {22050, 24000, 16000},  // MPEG-2
+        {44100, 48000, 32000}   // MPEG-1
+    };
+
+    size_t pos = 0;
+    uint32_t idx = 0;
+    while( (idx < frameIdx) && (pos + 4 <= size) )
+    {
+        const unsigned char* h = buf + pos;
+        if( (h[0] != 0xFF) || ((h[1] & 0xE0) != 0xE0) ) break;  // Lost sync
+
+        int ver   = (h[1] >> 3) & 3;
+        int layer = (h[1] >> 1) & 3;
+        int bri   = h[2] >> 4;
+        int sri   = (h[2] >> 2) & 3;
+        int pad   = (h[2] >> 1) & 1;
+        if( (1 == ver) || (1 != layer) || (0 == bri) || (15 == bri) || (3 == sri) ) break;
+
+        int brate = brates[ver == 3 ? 1 : 0][bri] * 1000;
+        int srate = srates[ver][sri];
+        pos += (ver == 3 ? 144 : 72) * brate / srate + pad;
+        idx++;
+    }
+
+    return (idx == frameIdx) ? std::min(pos, size) : size;
+}
@@ -0,0 +1,297 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+#include <cstring>
+#include <cerrno>
+#ifndef _WIN32
+ #include <unistd.h>
+ #include <poll.h>
+ #include <sys/socket.h>
+ #include <sys/stat.h>
+ #include <sys/un.h>
+ #include "ServerProtocol.h"
+#endif  // _WIN32
+#include "Server.h"
+#include "Locker.h"
+#include "Log.h"
+
+using namespace wav2mp3;
+
+
+#ifndef _WIN32
+namespace {
+
+/**
+ * @return true if a socket file is left by a server which is gone: nobody
+ * accepts connections on it
+ */
+bool isStaleSocket( const struct sockaddr_un& addr )
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if( fd < 0 ) return false;
+    bool stale = (connect(fd, (const struct sockaddr*) &addr, sizeof(addr)) < 0) &&
+                 (ECONNREFUSED == errno);
+    close(fd);
+    return stale;
+}
+
+} // anonymous namespace
+#endif  // _WIN32
+
+
+Server::Server( Converter& converter, const std::string& socketUri,
+                unsigned int maxConnections, uint32_t maxPayload ):
+        mConverter(converter),
+        mSocketUri(socketUri),
+        mFd(-1),
+        mStopping(false),
+        mConnections(),
+        mMaxConnections(maxConnections ? maxConnections : DEFAULT_MAX_CONNECTIONS),
+        mMaxPayload(maxPayload),
+        mNumRequests(0)
+{
+    mStopFds[0] = mStopFds[1] = -1;
+    pthread_mutex_init(&mMutex, NULL);
+    pthread_cond_init(&mClosedCVar, NULL);
+#ifndef _WIN32
+    if( 0 == mMaxPayload ) mMaxPayload = protocol::MAX_PAYLOAD;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if( socketUri.size() >= sizeof(addr.sun_path) )
+    {
+        LOG("ERROR socket path is too long: '" << socketUri << "'" << std::endl);
+        return;
+    }
+    strncpy(addr.sun_path, socketUri.c_str(), sizeof(addr.sun_path) - 1);
+
+    if( pipe(mStopFds) < 0 )
+    {
+        LOG("ERROR creating pipe: " << strerror(errno) << std::endl);
+        mStopFds[0] = mStopFds[1] = -1;
+        return;
+    }
+    mFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if( mFd < 0 )
+    {
+        LOG("ERROR creating socket: " << strerror(errno) << std::endl);
+        return;
+    }
+
+    // Replace only the socket of a previous server which is gone - never another
+    // kind of file or the socket of a running server
+    struct stat st;
+    if( 0 == lstat(socketUri.c_str(), &st) )
+    {
+        if( !S_ISSOCK(st.st_mode) || !isStaleSocket(addr) )
+        {
+            LOG("ERROR '" << socketUri << "' exists and is not a stale socket" << std::endl);
+            close(mFd);
+            mFd = -1;
+            return;
+        }
+        unlink(socketUri.c_str());
+    }
+    if( (bind(mFd, (struct sockaddr*) &addr, sizeof(addr)) < 0) || (listen(mFd, SOMAXCONN) < 0) )
+    {
+        LOG("ERROR listening on '" << socketUri << "': " << strerror(errno) << std::endl);
+        close(mFd);
+        mFd = -1;
+    }
+#else
+    LOG("ERROR the server is supported only on POSIX systems" << std::endl);
+#endif  // _WIN32
+}
+
+
+Server::~Server()
+{
+    stop();
+#ifndef _WIN32
+    if( mFd >= 0 )
+    {
+        close(mFd);
+        unlink(mSocketUri.c_str());
+    }
+    if( mStopFds[0] >= 0 ) close(mStopFds[0]);
+    if( mStopFds[1] >= 0 ) close(mStopFds[1]);
+#endif  // _WIN32
+    pthread_cond_destroy(&mClosedCVar);
+    pthread_mutex_destroy(&mMutex);
+}
+
+
+bool Server::run()
+{
+#ifndef _WIN32
+    if( mFd < 0 ) return false;
+    LOG("Listening on '" << mSocketUri << "'" << std::endl);
+
+    bool ok = true;
+    while( !isStopping() )
+    {
+        {
+            // At the limit new connections wait in the listen backlog
+            Locker lock(mMutex);
+            while( (mConnections.size() >= mMaxConnections) && !mStopping )
+                pthread_cond_wait(&mClosedCVar, &mMutex);
+            if( mStopping ) break;
+        }
+
+        struct pollfd fds[2] = { { mFd, POLLIN, 0 }, { mStopFds[0], POLLIN, 0 } };
+        if( poll(fds, 2, -1) < 0 )
+        {
+            if( EINTR == errno ) continue;
+            LOG("ERROR waiting for connections: " << strerror(errno) << std::endl);
+            ok = false;
+            break;
+        }
+        if( fds[1].revents ) break;  // Stopped - the byte is left in the pipe
+
+        int fd = accept(mFd, NULL, NULL);
+        if( fd < 0 )
+        {
+            if( (EINTR == errno) || (ECONNABORTED == errno) ) continue;
+            LOG("ERROR accepting connection: " << strerror(errno) << std::endl);
+            ok = false;
+            break;
+        }
+
+        {
+            Locker lock(mMutex);
+            mConnections.insert(fd);
+        }
+        Connection* connection = new Connection();
+        connection->server = this;
+        connection->fd = fd;
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if( pthread_create(&thread, &attr, connectionMain, connection) )
+        {
+            LOG("ERROR creating connection thread" << std::endl);
+            delete connection;
+            Locker lock(mMutex);
+            mConnections.erase(fd);
+            close(fd);
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    // Let the connections finish
+    stop();
+    Locker lock(mMutex);
+    while( !mConnections.empty() ) pthread_cond_wait(&mClosedCVar, &mMutex);
+    LOG("Stopped listening on '" << mSocketUri << "'" << std::endl);
+    return ok;
+#else
+    return false;
+#endif  // _WIN32
+}
+
+
+void Server::stop()
+{
+    Locker lock(mMutex);
+    if( mStopping ) return;
+    mStopping = true;
+    pthread_cond_signal(&mClosedCVar);  // run() may wait for a free connection
+#ifndef _WIN32
+    if( mStopFds[1] >= 0 )
+    {
+        char c = 0;
+        ssize_t res = write(mStopFds[1], &c, 1);
+        (void) res;
+    }
+    // Idle connections wake up from reading, busy ones see mStopping after their response
+    for( std::set<int>::const_iterator it = mConnections.begin(); it != mConnections.end(); ++it )
+        shutdown(*it, SHUT_RD);
+#endif  // _WIN32
+}
+
+
+unsigned long Server::getNumRequests() const
+{
+    Locker lock(mMutex);
+    return mNumRequests;
+}
+
+
+bool Server::isStopping()
+{
+    Locker lock(mMutex);
+    return mStopping;
+}
+
+
+void* Server::connectionMain( void* arg )
+{
+    Connection* connection = static_cast<Connection*>(arg);
+    Server* server = connection->server;
+    int fd = connection->fd;
+    delete connection;
+
+    server->serve(fd);
+
+    // Closed under the lock, so stop() never shuts down a reused descriptor
+    Locker lock(server->mMutex);
+    server->mConnections.erase(fd);
+#ifndef _WIN32
+    close(fd);
+#endif  // _WIN32
+    pthread_cond_signal(&server->mClosedCVar);
+    return NULL;
+}
+
+
+void Server::serve( int fd )
+{
+#ifndef _WIN32
+    {
+        // A connection accepted while stopping would miss the shutdown
+        Locker lock(mMutex);
+        if( mStopping ) shutdown(fd, SHUT_RD);
+    }
+
+    char type[4];
+    std::vector<unsigned char> payload;
+    while( protocol::readFrame(fd, type, payload, mMaxPayload) )
+    {
+        if( !handle(fd, type, payload) ) break;
+        Locker lock(mMutex);
+        mNumRequests++;
+        if( mStopping ) break;
+    }
+#else
+    (void) fd;
+#endif  // _WIN32
+}
+
+
+bool Server::handle( int fd, const char* type, const std::vector<unsigned char>& payload )
+{
+#ifndef _WIN32
+    if( protocol::isType(type, protocol::WAV) )
+    {
+        if( payload.empty() ) return protocol::writeFrame(fd, protocol::FAIL, "Empty wav data");
+        std::vector<unsigned char> mp3;
+        if( !mConverter.encode(payload.empty() ? NULL : &payload[0], payload.size(), mp3) )
+            return protocol::writeFrame(fd, protocol::FAIL, "Can't convert the wav data");
+        return protocol::writeFrame(fd, protocol::MP3, mp3.empty() ? NULL : &mp3[0],
+                                    (uint32_t) mp3.size());
+    }
+    if( protocol::isType(type, protocol::PATH) )
+    {
+        std::string wavUri(payload.begin(), payload.end());
+        if( !mConverter.encode(wavUri) )
+            return protocol::writeFrame(fd, protocol::FAIL, "Can't convert '" + wavUri + "'");
+        return protocol::writeFrame(fd, protocol::DONE, NULL, 0);
+    }
+    protocol::writeFrame(fd, protocol::FAIL, "Unknown request type '" + std::string(type, 4) + "'");
+    return false;  // Out of sync, probably not our protocol
+#else
+    (void) fd; (void) type; (void) payload;
+    return false;
+#endif  // _WIN32
+}
@@ -0,0 +1,190 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/time.h>
+#include "Shutdown.h"
+#include "Tracer.h"
+#include "Locker.h"
+#include "Log.h"
+
+using namespace wav2mp3;
+
+
+namespace {
+
+const long POLL_MS = 50;  // Max time between checks of the grace period and of stop()
+
+int gCancelled = 0;
+int gAborted   = 0;
+int gSignal    = 0;
+
+const char* getSignalName( int sig )
+{
+    switch( sig )
+    {
+        case SIGINT:  return "SIGINT";
+        case SIGTERM: return "SIGTERM";
+        default:      return "a stop request";
+    }
+}
+
+#ifdef _WIN32
+void handleSignal( int sig )
+{
+    signal(sig, handleSignal);  // The handler is reset to the default one
+    Shutdown::onSignal(sig);
+}
+#endif  // _WIN32
+
+} // anonymous namespace
+
+
+void Shutdown::blockSignals()
+{
+#ifndef _WIN32
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+#else
+    signal(SIGINT, handleSignal);
+    signal(SIGTERM, handleSignal);
+#endif  // _WIN32
+}
+
+
+Shutdown::Shutdown( unsigned int graceSeconds, Callback onCancel, void* arg ):
+        mGraceSeconds(graceSeconds),
+        mOnCancel(onCancel),
+        mArg(arg),
+        mStopping(false),
+        mJoined(false)
+{
+    pthread_mutex_init(&mMutex, NULL);
+    pthread_cond_init(&mStopCVar, NULL);
+    pthread_create(&mThread, NULL, threadMain, this);
+}
+
+
+Shutdown::~Shutdown()
+{
+    stop();
+    pthread_cond_destroy(&mStopCVar);
+    pthread_mutex_destroy(&mMutex);
+}
+
+
+void Shutdown::stop()
+{
+    if( mJoined ) return;
+    {
+        Locker lock(mMutex);
+        mStopping = true;
+        pthread_cond_signal(&mStopCVar);
+    }
+    // Not woken up by a signal to itself, which could merge with a real one - the thread
+    // sees mStopping within POLL_MS
+    pthread_join(mThread, NULL);
+    mJoined = true;
+}
+
+
+bool Shutdown::isCancelled()
+{
+    return 0 != __atomic_load_n(&gCancelled, __ATOMIC_ACQUIRE);
+}
+
+
+bool Shutdown::isAborted()
+{
+    return 0 != __atomic_load_n(&gAborted, __ATOMIC_ACQUIRE);
+}
+
+
+const int* Shutdown::getAbortFlag()
+{
+    return &gAborted;
+}
+
+
+int Shutdown::getSignal()
+{
+    return __atomic_load_n(&gSignal, __ATOMIC_ACQUIRE);
+}
+
+
+void Shutdown::onSignal( int sig )
+{
+    int none = 0;
+    __atomic_compare_exchange_n(&gSignal, &none, sig, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    if( __atomic_exchange_n(&gCancelled, 1, __ATOMIC_SEQ_CST) )
+        __atomic_store_n(&gAborted, 1, __ATOMIC_SEQ_CST);  // Second signal
+}
+
+
+void* Shutdown::threadMain( void* arg )
+{
+    static_cast<Shutdown*>(arg)->run();
+    return NULL;
+}
+
+
+bool Shutdown::isStopping()
+{
+    Locker lock(mMutex);
+    return mStopping;
+}
+
+
+void Shutdown::run()
+{
+    Tracer::setThreadName("signals");
+#ifndef _WIN32
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+#endif  // _WIN32
+
+    bool notified = false;
+    double deadline = 0;
+    while( true )
+    {
+#ifndef _WIN32
+        struct timespec timeout = { 0, POLL_MS * 1000000L };
+        int sig = sigtimedwait(&set, NULL, &timeout);
+        if( sig > 0 ) onSignal(sig);
+        if( isStopping() ) break;
+#else
+        {
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            long usec = now.tv_usec + POLL_MS * 1000;
+            struct timespec until = { now.tv_sec + usec / 1000000, (usec % 1000000) * 1000 };
+            Locker lock(mMutex);
+            if( !mStopping ) pthread_cond_timedwait(&mStopCVar, &mMutex, &until);
+            if( mStopping ) break;
+        }
+#endif  // _WIN32
+
+        if( !isCancelled() ) continue;
+        if( !notified )
+        {
+            notified = true;
+            deadline = Tracer::now() + mGraceSeconds * 1e6;
+            LOG("Received " << getSignalName(getSignal()) << ": no new files are started, files in "
+                << "progress have " << mGraceSeconds << " s to finish" << std::endl);
+            if( mOnCancel ) mOnCancel(mArg);
+        }
+        if( !isAborted() && (Tracer::now() >= deadline) ) onSignal(0);
+        if( isAborted() && (deadline > 0) )
+        {
+            LOG("Aborting the files in progress" << std::endl);
+            deadline = 0;  // Logged once
+        }
+    }
+}
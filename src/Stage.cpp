@@ -0,0 +1,83 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+#include <iomanip>
+#include "Stage.h"
+
+using namespace wav2mp3;
+
+
+double StageStats::getUtilization() const
+{
+    if( (0 == threads) || (elapsedSeconds <= 0) ) return 0;
+    double util = busySeconds / (elapsedSeconds * threads);
+    return (util > 1) ? 1 : util;
+}
+
+
+void StageStats::print( std::ostream& out ) const
+{
+    std::ios::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision();
+    out << std::fixed << std::setprecision(1)
+        << name << ": " << threads << " thread(s), " << tasks << " task(s), busy "
+        << getUtilization() * 100 << "%, queue " << avgQueueDepth << "/" << queueCapacity
+        << " avg (peak " << peakQueueDepth << "), submitters blocked "
+        << std::setprecision(3) << blockedSeconds << " s" << std::endl;
+    out.flags(flags);
+    out.precision(precision);
+}
+
+
+StageMeter::StageMeter( const std::string& name ):
+        mStats(),
+        mStartTime(0),
+        mDepthSum(0),
+        mNumSubmits(0)
+{
+    mStats.name = name;
+    pthread_mutex_init(&mMutex, NULL);
+}
+
+
+StageMeter::~StageMeter()
+{
+    pthread_mutex_destroy(&mMutex);
+}
+
+
+void StageMeter::start( unsigned int threads, size_t queueCapacity )
+{
+    Locker lock(mMutex);
+    mStats.threads = threads;
+    mStats.queueCapacity = queueCapacity;
+    mStartTime = Tracer::now();
+}
+
+
+void StageMeter::addSubmit( size_t depth, double blockedUs )
+{
+    Locker lock(mMutex);
+    mDepthSum += depth;
+    mNumSubmits++;
+    if( depth > mStats.peakQueueDepth ) mStats.peakQueueDepth = depth;
+    mStats.blockedSeconds += blockedUs * 1e-6;
+}
+
+
+void StageMeter::addTask( double busyUs )
+{
+    Locker lock(mMutex);
+    mStats.tasks++;
+    mStats.busySeconds += busyUs * 1e-6;
+}
+
+
+StageStats StageMeter::getStats() const
+{
+    Locker lock(mMutex);
+    StageStats stats = mStats;
+    stats.elapsedSeconds = mStartTime ? (Tracer::now() - mStartTime) * 1e-6 : 0;
+    stats.avgQueueDepth = mNumSubmits ? mDepthSum / mNumSubmits : 0;
+    return stats;
+}
@@ -0,0 +1,238 @@
+/******************************************************************************
+ * @author Assen Kirov                                                        *
+ ******************************************************************************/
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include "Tracer.h"
+#include "Locker.h"
+
+using namespace wav2mp3;
+
+
+bool Tracer::sEnabled = false;
+
+
+namespace {
+
+pthread_key_t   gSpansKey;
+pthread_once_t  gSpansKeyOnce = PTHREAD_ONCE_INIT;
+pthread_mutex_t gThreadsMutex = PTHREAD_MUTEX_INITIALIZER;
+std::vector<void*> gThreads;  // ThreadSpans of all threads, never freed
+double gStartTime = 0;
+
+
+void createSpansKey()
+{
+    pthread_key_create(&gSpansKey, NULL);
+}
+
+
+/// Writes a JSON string literal
+void writeJsonString( std::ostream& out, const std::string& str )
+{
+    out << '"';
+    for( size_t i=0; i<str.size(); i++ )
+    {
+        unsigned char c = str[i];
+        if( ('"' == c) || ('\\' == c) )
+        {
+            out << '\\' << c;
+        }
+        else if( c < 0x20 )
+        {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out << buf;
+        }
+        else
+        {
+            out << c;
+        }
+    }
+    out << '"';
+}
+
+
+struct StageStats
+{
+    uint64_t count;
+    double   total;
+    double   max;
+
+    StageStats(): count(0), total(0), max(0) {}
+
+    void add( double duration )
+    {
+        count++;
+        total += duration;
+        if( duration > max ) max = duration;
+    }
+};
+
+} // anonymous namespace
+
+
+void Tracer::enable()
+{
+    gStartTime = now();
+    sEnabled = true;
+}
+
+
+double Tracer::now()
+{
+#if defined(CLOCK_MONOTONIC) && !defined(_WIN32)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec * 1e-3;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1e6 + tv.tv_usec;
+#endif
+}
+
+
+Tracer::ThreadSpans* Tracer::getThreadSpans()
+{
+    pthread_once(&gSpansKeyOnce, createSpansKey);
+    ThreadSpans* spans = static_cast<ThreadSpans*>(pthread_getspecific(gSpansKey));
+    if( NULL == spans )
+    {
+        spans = new ThreadSpans();
+        Locker lock(gThreadsMutex);
+        spans->tid = gThreads.size() + 1;
+        gThreads.push_back(spans);
+        pthread_setspecific(gSpansKey, spans);
+    }
+    return spans;
+}
+
+
+void Tracer::setThreadName( const std::string& name )
+{
+    if( sEnabled ) getThreadSpans()->name = name;
+}
+
+
+void Tracer::record( const char* stage, double start, double end, const std::string& file )
+{
+    try {
+        ThreadSpans* spans = getThreadSpans();
+        spans->spans.push_back(Span());
+        Span& span = spans->spans.back();
+        span.stage = stage;
+        span.file = file;
+        span.start = start;
+        span.duration = end - start;
+    } catch(...) {
+        // Out of memory - lose the span
+    }
+}
+
+
+bool Tracer::writeChromeTrace( const std::string& uri )
+{
+    std::ofstream out(uri.c_str(), std::ios::out | std::ios::trunc);
+    if( !out.is_open() ) return false;
+
+    Locker lock(gThreadsMutex);
+    out << std::fixed << std::setprecision(3);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool first = true;
+    for( size_t t=0; t<gThreads.size(); t++ )
+    {
+        const ThreadSpans* thread = static_cast<const ThreadSpans*>(gThreads[t]);
+        if( !first ) out << ",\n";
+        first = false;
+        out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread->tid
+            << ",\"args\":{\"name\":";
+        writeJsonString(out, thread->name.empty() ? "thread" : thread->name);
+        out << "}}";
+
+        for( size_t i=0; i<thread->spans.size(); i++ )
+        {
+            const Span& span = thread->spans[i];
+            out << ",\n{\"name\":\"" << span.stage << "\",\"cat\":\"wav2mp3\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+                << thread->tid << ",\"ts\":" << span.start - gStartTime << ",\"dur\":" << span.duration;
+            if( !span.file.empty() )
+            {
+                out << ",\"args\":{\"file\":";
+                writeJsonString(out, span.file);
+                out << "}";
+            }
+            out << "}";
+        }
+    }
+    out << "\n]}\n";
+    out.close();
+    return !out.fail();
+}
+
+
+void Tracer::reset()
+{
+    sEnabled = false;
+    Locker lock(gThreadsMutex);
+    for( size_t t=0; t<gThreads.size(); t++ ) delete static_cast<ThreadSpans*>(gThreads[t]);
+    gThreads.clear();
+    pthread_once(&gSpansKeyOnce, createSpansKey);
+    pthread_setspecific(gSpansKey, NULL);
+}
+
+
+void Tracer::printSummary( std::ostream& out )
+{
+    std::map<std::string, StageStats> stages;
+    std::map<std::string, std::map<std::string, StageStats> > threads;  // Thread -> stage -> stats
+    {
+        Locker lock(gThreadsMutex);
+        for( size_t t=0; t<gThreads.size(); t++ )
+        {
+            const ThreadSpans* thread = static_cast<const ThreadSpans*>(gThreads[t]);
+            std::string name = thread->name.empty() ? "thread" : thread->name;
+            for( size_t i=0; i<thread->spans.size(); i++ )
+            {
+                const Span& span = thread->spans[i];
+                stages[span.stage].add(span.duration);
+                threads[name][span.stage].add(span.duration);
+            }
+        }
+    }
+
+    std::ios::fmtflags flags = out.flags();
+    out << std::fixed << std::setprecision(3);
+    out << "Time per stage:" << std::endl
+        << std::left << std::setw(20) << "stage" << std::right << std::setw(10) << "count"
+        << std::setw(14) << "total ms" << std::setw(14) << "mean ms" << std::setw(14) << "max ms"
+        << std::endl;
+    for( std::map<std::string, StageStats>::const_iterator it = stages.begin();
+         it != stages.end(); ++it )
+    {
+        const StageStats& st = it->second;
+        out << std::left << std::setw(20) << it->first << std::right << std::setw(10) << st.count
+            << std::setw(14) << st.total / 1000 << std::setw(14) << st.total / st.count / 1000
+            << std::setw(14) << st.max / 1000 << std::endl;
+    }
+
+    out << "Time per thread:" << std::endl
+        << std::left << std::setw(16) << "thread" << std::setw(20) << "stage" << std::right
+        << std::setw(10) << "count" << std::setw(14) << "total ms" << std::endl;
+    for( std::map<std::string, std::map<std::string, StageStats> >::const_iterator t = threads.begin();
+         t != threads.end(); ++t )
+    {
+        for( std::map<std::string, StageStats>::const_iterator it = t->second.begin();
+             it != t->second.end(); ++it )
+        {
+            out << std::left << std::setw(16) << t->first << std::setw(20) << it->first << std::right
+                << std::setw(10) << it->second.count << std::setw(14) << it->second.total / 1000
+                << std::endl;
+        }
+    }
+    out.flags(flags);
+}
@@ -4,19 +4,102 @@
 
 #include <algorithm>
 #include <cstring>
+#include <new>
+#ifndef _WIN32
+ #include <fcntl.h>
+ #include <unistd.h>
+ #include <sys/mman.h>
+ #include <sys/stat.h>
+#endif  // _WIN32
 #include "WavFile.h"
 #include "Log.h"
 
 using namespace wav2mp3;
 
 
-WavFile::WavFile( const std::string& uri ):
+WavFile::WavFile( const std::string& uri, ReadMode mode ):
         mFileUri(uri),
+        mReadMode(mode),
         mFile(uri.c_str(), std::ios::in | std::ios::binary),  // Opens the file
-        mFileData(),
+        mStream(NULL),
+        mStreamPos(0),
+        mFileData(BufferPool::getShared()),
+        mFileBeg(NULL),
+        mFileSize(0),
+        mMapped(false),
+        mImage(false),
         mRiffHPtr(NULL),
         mFmtHPtr(NULL),
-        mDataHPtr(NULL)
+        mDataHPtr(NULL),
+        mBlockPos(0),
+        mReadError(false),
+        mDs64DataSize(0),
+        mRiffHeader(),
+        mFmtHeader(),
+        mDataHeader(),
+        mChannelMask(0),
+        mTotalSize(0),
+        mDataPos(0),
+        mNextChunkPos(0),
+        mBlockBuf(BufferPool::getShared())
+{
+}
+
+
+WavFile::WavFile( const char* data, size_t size, const std::string& name ):
+        mFileUri(name),
+        mReadMode(READ_ENTIRE),
+        mFile(),
+        mStream(NULL),
+        mStreamPos(0),
+        mFileData(BufferPool::getShared()),
+        mFileBeg(const_cast<char*>(data)),  // Never written, like a read-only mapping
+        mFileSize(data ? size : 0),
+        mMapped(false),
+        mImage(true),
+        mRiffHPtr(NULL),
+        mFmtHPtr(NULL),
+        mDataHPtr(NULL),
+        mBlockPos(0),
+        mReadError(false),
+        mDs64DataSize(0),
+        mRiffHeader(),
+        mFmtHeader(),
+        mDataHeader(),
+        mChannelMask(0),
+        mTotalSize(0),
+        mDataPos(0),
+        mNextChunkPos(0),
+        mBlockBuf(BufferPool::getShared())
+{
+}
+
+
+WavFile::WavFile( WavStream& stream, const std::string& name ):
+        mFileUri(name),
+        mReadMode(READ_STREAM),
+        mFile(),
+        mStream(&stream),
+        mStreamPos(0),
+        mFileData(BufferPool::getShared()),
+        mFileBeg(NULL),
+        mFileSize(0),
+        mMapped(false),
+        mImage(false),
+        mRiffHPtr(NULL),
+        mFmtHPtr(NULL),
+        mDataHPtr(NULL),
+        mBlockPos(0),
+        mReadError(false),
+        mDs64DataSize(0),
+        mRiffHeader(),
+        mFmtHeader(),
+        mDataHeader(),
+        mChannelMask(0),
+        mTotalSize(0),
+        mDataPos(0),
+        mNextChunkPos(0),
+        mBlockBuf(BufferPool::getShared())
 {
 }
 
@@ -28,12 +111,26 @@ WavFile::~WavFile()
         LOG("Closing wav file " << mFileUri << std::endl);
         mFile.close();
     }
+
+#ifndef _WIN32
+    if( mMapped ) munmap(mFileBeg, mFileSize);
+#endif  // _WIN32
 }
 
 
-int WavFile::readEntireFile()
+size_t WavFile::readEntireFile()
 {
-    if( !mFileData.empty() ) return mFileData.size();  // Already read
+    if( READ_STREAM == mReadMode ) return 0;  // Data is read block by block
+    if( mImage ) return mFileSize;  // Never a file named after the image
+    if( NULL != mFileBeg ) return mFileSize;  // Already read or mapped
+
+#ifndef _WIN32
+    if( READ_MMAP == mReadMode )
+    {
+        if( this->mapEntireFile() ) return mFileSize;
+        LOG("Can't map file " << mFileUri << ", reading it" << std::endl);
+    }
+#endif  // _WIN32
 
     if( !mFile.is_open() )
     {
@@ -44,132 +141,359 @@ int WavFile::readEntireFile()
     if( mFile.is_open() )
     {
         mFile.seekg(0, std::ios::end);
-        mFileData.resize(mFile.tellg());  // TODO try-catch?
+        std::streamoff size = mFile.tellg();
+        if( size < 0 )
+        {
+            LOG("Can't get the size of file " << mFileUri << std::endl);
+            mFile.close();
+            return 0;
+        }
+        if( !mFileData.resize(size) ) throw std::bad_alloc();
         mFile.seekg(0, std::ios::beg);
-        mFile.read(&mFileData[0], mFileData.size());
+        mFile.read(mFileData.data(), mFileData.size());
+        if( mFile.gcount() != size )
+        {
+            // Pool buffers aren't zero-filled - the rest would be data of another file
+            LOG("Can't read file " << mFileUri << " (truncated or I/O error)" << std::endl);
+            mFileData.clear();
+        }
         mFile.close();
     }
 
+    if( !mFileData.empty() )
+    {
+        mFileBeg  = mFileData.data();
+        mFileSize = mFileData.size();
+    }
     return mFileData.size();
 }
 
 
+#ifndef _WIN32
+/**
+ * Maps the whole file read-only. Pages are read by the OS on first access (and
+ * read ahead because of the madvise() hints), so there is no copying here.
+ *
+ * @return true on success
+ */
+bool WavFile::mapEntireFile()
+{
+    int fd = open(mFileUri.c_str(), O_RDONLY);
+    if( fd < 0 ) return false;
+
+    struct stat st;
+    if( (fstat(fd, &st) != 0) || (st.st_size <= 0) )
+    {
+        close(fd);
+        return false;
+    }
+
+    void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);  // The mapping keeps its own reference to the file
+    if( MAP_FAILED == addr ) return false;
+
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+    madvise(addr, st.st_size, MADV_WILLNEED);
+
+    mFileBeg  = static_cast<char*>(addr);
+    mFileSize = st.st_size;
+    mMapped   = true;
+    if( mFile.is_open() ) mFile.close();  // Not needed any more
+    return true;
+}
+#endif  // _WIN32
+
+
+
+
+void WavFile::rewind()
+{
+    mRiffHPtr = NULL;
+    mFmtHPtr  = NULL;
+    mDataHPtr = NULL;
+    mBlockPos = 0;
+    mReadError = false;
+    mDs64DataSize = 0;
+    mNextChunkPos = 0;
+}
+
+
+bool WavFile::isRiffId( const char* id )
+{
+    return !strncmp(id, "RIFF", 4) || !strncmp(id, "RF64", 4) || !strncmp(id, "BW64", 4);
+}
+
+
+/**
+ * The 32-bit size of a data chunk bigger than 4 GB is RF64_SIZE_IN_DS64. Without
+ * a ds64 chunk the data is assumed to extend to the end of the file.
+ */
+uint64_t WavFile::getDataSize() const
+{
+    if( NULL == mDataHPtr ) return 0;
+    if( RF64_SIZE_IN_DS64 != mDataHPtr->datasz ) return mDataHPtr->datasz;
+    return mDs64DataSize ? mDs64DataSize : ~(uint64_t)0;
+}
+
+
+bool WavFile::parseFormat( const char* chunk, size_t size, FMTHeader& fmt, uint32_t& chanmask )
+{
+    chanmask = 0;
+    if( size < sizeof(FMTHeader) ) return false;
+    memcpy(&fmt, chunk, sizeof(FMTHeader));
+    if( fmt.fmthsz < 16 ) return false;
+
+    // The real format tag of extensible headers is in the subformat GUID
+    uint16_t tag = fmt.fmttag;
+    if( WAVE_FORMAT_EXTENSIBLE == tag )
+    {
+        static const uint8_t guidTail[14] = { 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00,
+                                              0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71 };
+        FMTExtension ext;
+        if( (fmt.fmthsz < 16 + sizeof(ext)) || (size < sizeof(FMTHeader) + sizeof(ext)) )
+            return false;
+        memcpy(&ext, chunk + sizeof(FMTHeader), sizeof(ext));
+        if( memcmp(ext.subformat + 2, guidTail, sizeof(guidTail)) ) return false;
+        tag = ext.subformat[0] | (ext.subformat[1] << 8);
+        chanmask = ext.chanmask;
+        // Samples with fewer valid bits are in the MSBs of the container, so they
+        // are encoded as full size samples.
+    }
+    fmt.fmthsz = 16;
+    fmt.fmttag = tag;
+
+    // PCM or float with 1 to MAX_CHANNELS channels, 8, 16, 24, 32 bps integers or 32, 64 bps floats
+    uint16_t bps = fmt.bitspersamp;
+    if( (fmt.numchan < 1) || (fmt.numchan > MAX_CHANNELS) ) return false;
+    // Frames are stepped by blkalign - it must be the packed frame size (never 0)
+    if( fmt.blkalign != fmt.numchan * bps / 8 ) return false;
+    if( WAVE_FORMAT_PCM == tag )
+        return (8 == bps) || (16 == bps) || (24 == bps) || (32 == bps);
+    if( WAVE_FORMAT_IEEE_FLOAT == tag )
+        return (32 == bps) || (64 == bps);
+    return false;
+}
+
+
 bool WavFile::findNextWavChunk()
 {
-    if( mFileData.empty() )
+    mBlockPos = 0;
+    mReadError = false;
+
+    if( NULL != mStream )
+    {
+        if( NULL == mRiffHPtr ) mTotalSize = ~(uint64_t)0;  // Unknown until the end
+    }
+    else if( READ_STREAM == mReadMode )
     {
-        this->readEntireFile();  // Try to fill mFileData
-        if( mFileData.empty() )
+        if( !mFile.is_open() )
+        {
+            if( NULL != mRiffHPtr ) return false;  // Already done with this file
+            mFile.clear();
+            mFile.open(mFileUri.c_str(), std::ios::in | std::ios::binary);
+            if( !mFile.is_open() )
+            {
+                LOG("Can't read file " << mFileUri << std::endl);
+                return false;
+            }
+        }
+        if( NULL == mRiffHPtr )
+        {
+            mFile.seekg(0, std::ios::end);
+            mTotalSize = mFile.tellg();
+        }
+    }
+    else
+    {
+        if( NULL == mFileBeg ) this->readEntireFile();  // Try to read or map the file
+        if( NULL == mFileBeg )
         {
             LOG("Can't read file " << mFileUri << std::endl);
             return false;  // If still empty - give up
         }
+        mTotalSize = mFileSize;
     }
 
-    // Start looking after the last data chunk
-    std::vector<char>::iterator beg;
-    if( NULL == mDataHPtr )
+    bool found = this->walkToNextDataChunk();
+    if( !found && (READ_STREAM == mReadMode) && mFile.is_open() ) mFile.close();
+    return found;
+}
+
+
+/**
+ * Reads size bytes at file offset pos, from memory or from the stream.
+ *
+ * @return true if all bytes were read
+ */
+bool WavFile::readAt( uint64_t pos, char* buf, size_t size )
+{
+    if( (pos > mTotalSize) || (size > mTotalSize - pos) ) return false;
+    if( READ_STREAM != mReadMode )
     {
-        beg = mFileData.begin();
+        memcpy(buf, mFileBeg + pos, size);
+        return true;
     }
-    else
+    if( NULL != mStream ) return skipStream(pos) && (readStream(buf, size) == size);
+    mFile.clear();
+    mFile.seekg(pos, std::ios::beg);
+    mFile.read(buf, size);
+    return (bool) mFile;
+}
+
+
+size_t WavFile::readStream( char* buf, size_t size, size_t unit )
+{
+    size_t done = 0;
+    while( (done < size) && ((0 == unit) || (0 == done) || (done % unit)) )
     {
-        char* pos = reinterpret_cast<char*>(mDataHPtr) + 8 + mDataHPtr->datasz;
-        beg = mFileData.begin() + (pos - &mFileData[0]);
+        size_t n = mStream->read(buf + done, size - done);
+        if( 0 == n ) break;
+        done += n;
     }
+    mStreamPos += done;
+    return done;
+}
 
-    // Check if we have reached the end of the file
-    if( beg >= mFileData.end() ) return false;
 
+bool WavFile::skipStream( uint64_t pos )
+{
+    if( pos < mStreamPos )
+    {
+        LOG("Can't seek back in stream " << mFileUri << std::endl);
+        return false;
+    }
+    char buf[4096];
+    while( mStreamPos < pos )
+    {
+        size_t size = (size_t) std::min<uint64_t>(sizeof(buf), pos - mStreamPos);
+        if( readStream(buf, size) != size ) return false;
+    }
+    return true;
+}
+
+
+/**
+ * Hops from chunk to chunk by their size fields until the next data chunk,
+ * reading only the chunk headers (and the fmt and ds64 chunks). Keeps the last
+ * supported fmt header, which applies to the data chunks after it.
+ */
+bool WavFile::walkToNextDataChunk()
+{
     // Parse RIFF header (once)
     if( NULL == mRiffHPtr )
     {
-        std::vector<char>::iterator it;
-        const char* riffid = "RIFF";
-
-        if( ((mFileData.end() - beg) < (int)sizeof(RIFFHeader)) ||
-            ((it = std::search(beg, mFileData.end(), riffid, riffid + 4)) == mFileData.end()) )
+        if( !readAt(0, reinterpret_cast<char*>(&mRiffHeader), sizeof(RIFFHeader)) ||
+            !isRiffId(mRiffHeader.riffid) )
         {
             LOG("Can't find RIFF header in file " << mFileUri << std::endl);
             mFmtHPtr  = NULL;
             mDataHPtr = NULL;
             return false;
         }
-        else
+        if( strncmp(mRiffHeader.format, "WAVE", 4) )
         {
-            RIFFHeader* riffhp = reinterpret_cast<RIFFHeader*>(&mFileData[0] + (it - mFileData.begin()));
-
-            // Check if format is WAVE
-            if( strncmp(riffhp->format, "WAVE", 4) )
-            {
-                LOG("Format is not WAVE in file " << mFileUri << std::endl);
-                mFmtHPtr  = NULL;
-                mDataHPtr = NULL;
-                return false;
-            }
-            else
-            {
-                mRiffHPtr = riffhp;
-                beg = it + sizeof(RIFFHeader);  // Continue after RIFF heder
-            }
+            LOG("Format is not WAVE in file " << mFileUri << std::endl);
+            mFmtHPtr  = NULL;
+            mDataHPtr = NULL;
+            return false;
         }
+        mRiffHPtr = &mRiffHeader;
+        mNextChunkPos = sizeof(RIFFHeader);
     }
 
-    // Parse FMT header (must have one before next data header - new or previous)
-    std::vector<char>::iterator fmtit = beg;
-    while( (mFileData.end() - fmtit) > (int)sizeof(FMTHeader) )
+    while( mNextChunkPos + 8 <= mTotalSize )
     {
-        std::vector<char>::iterator it;
+        char hdr[8];
+        if( !readAt(mNextChunkPos, hdr, sizeof(hdr)) ) break;
 
-        // Find FMT header
-        const char* fmtid = "fmt ";
-        it = std::search(fmtit, mFileData.end(), fmtid, fmtid + 4);
-        if( it == mFileData.end() ) break;
-
-        FMTHeader* fmthp = reinterpret_cast<FMTHeader*>(&mFileData[0] + (it - mFileData.begin()));
+        uint32_t chunksz;
+        memcpy(&chunksz, hdr + 4, sizeof(chunksz));
+        uint64_t bodyPos = mNextChunkPos + 8;
+        if( (NULL != mStream) && (0 == chunksz) && !strncmp(hdr, "data", 4) )
+        {
+            // Written to a pipe before the size was known, it can't be patched later
+            chunksz = RF64_SIZE_IN_DS64;
+            memcpy(hdr + 4, &chunksz, sizeof(chunksz));
+        }
+        uint64_t size = chunksz;
+        if( (RF64_SIZE_IN_DS64 == chunksz) && !strncmp(hdr, "data", 4) )
+        {
+            // To the end of the file if there is no ds64 chunk
+            size = mDs64DataSize ? mDs64DataSize : mTotalSize - bodyPos;
+        }
+        // Chunks are word aligned. A chunk may extend to the end of the file.
+        mNextChunkPos = (size < mTotalSize - bodyPos) ? bodyPos + size + (size & 1) : mTotalSize;
 
-        // Check if format is PCM with 1 or 2 channels, 8, 16, 24, 32 bps
-        uint16_t bps = fmthp->bitspersamp;
-        if( (fmthp->fmthsz == 16) && (fmthp->fmttag == 1) &&
-            ((fmthp->numchan == 1) || (fmthp->numchan == 2)) &&
-            ((8 == bps) || (16 == bps) || (24 == bps) || (32 == bps)) )
+        if( !strncmp(hdr, "ds64", 4) && (chunksz >= sizeof(DS64Header) - 8) )
         {
-            mFmtHPtr = fmthp;
-            beg = it + sizeof(FMTHeader);  // Continue after FMT heder
-            break;
+            DS64Header ds64;
+            if( readAt(bodyPos, reinterpret_cast<char*>(&ds64) + 8, sizeof(ds64) - 8) )
+                mDs64DataSize = ds64.datasz;
         }
-        else
+        else if( !strncmp(hdr, "fmt ", 4) )
         {
-            fmtit = it + 4;  // skip fmtid and try again
-            continue;
+            char fmtChunk[sizeof(FMTHeader) + sizeof(FMTExtension)];
+            size_t fmtsz = std::min<uint64_t>(size, sizeof(fmtChunk) - sizeof(hdr));
+            fmtsz = std::min<uint64_t>(fmtsz, mTotalSize - bodyPos);
+            memcpy(fmtChunk, hdr, sizeof(hdr));
+            FMTHeader fmth;
+            uint32_t chanmask;
+            if( readAt(bodyPos, fmtChunk + sizeof(hdr), fmtsz) &&
+                parseFormat(fmtChunk, sizeof(hdr) + fmtsz, fmth, chanmask) )
+            {
+                mFmtHeader = fmth;
+                mChannelMask = chanmask;
+                mFmtHPtr = &mFmtHeader;
+            }
+        }
+        else if( !strncmp(hdr, "data", 4) )
+        {
+            if( NULL == mFmtHPtr )
+            {
+                LOG("Can't find PCM or float FMT header with 1 to 8 channels in file " <<
+                        mFileUri << std::endl);
+                mDataHPtr = NULL;
+                return false;
+            }
+            memcpy(&mDataHeader, hdr, sizeof(hdr));
+            mDataHPtr = &mDataHeader;
+            mDataPos = bodyPos;
+            return true;
         }
     }
-    if( NULL == mFmtHPtr )
+
+    if( NULL == mDataHPtr )  // No previous data header
     {
-        LOG("Can't find PCM FMT header with 1 or 2 channels, 8, 16, 24 or 32 bps in file " <<
-                mFileUri << std::endl);
-        mDataHPtr = NULL;
-        return false;
+        LOG("Can't find Data header in file " << mFileUri << std::endl);
     }
+    mDataHPtr = NULL;
+    return false;
+}
 
-    // Find next data header
-    std::vector<char>::iterator it;
-    const char* dataid = "data";
-    if( ((mFileData.end() - beg) < (int)sizeof(DataHeader)) ||
-        ((it = std::search(beg, mFileData.end(), dataid, dataid + 4)) == mFileData.end()) )
-    {
-        if( NULL == mDataHPtr )  // No previous data header
+
+bool WavFile::probe( const std::string& uri, WavInfo& info )
+{
+    memset(&info, 0, sizeof(info));
+    try {
+        WavFile wavFile(uri, READ_STREAM);
+        while( wavFile.findNextWavChunk() )
         {
-            LOG("Can't find Data header in file " << mFileUri << std::endl);
+            if( 0 == info.numChunks++ )
+            {
+                info.fmt = wavFile.getFormat();
+                info.chanmask = wavFile.getChannelMask();
+            }
+            uint64_t datasz = wavFile.getRawAudioDataSize();
+            uint16_t framesz = wavFile.getFrameSize();
+            uint64_t frames = framesz ? datasz / framesz : 0;
+            info.dataSize += datasz;
+            info.numFrames += frames;
+            if( wavFile.getSampleRate() ) info.duration += (double) frames / wavFile.getSampleRate();
         }
-        mDataHPtr = NULL;
-        return false;
-    }
-    else
-    {
-        mDataHPtr = reinterpret_cast<DataHeader*>(&mFileData[0] + (it - mFileData.begin()));
-        return true;
+    } catch(...) {
+        info.numChunks = 0;
     }
+    return info.numChunks > 0;
 }
 
 
@@ -238,11 +562,34 @@ uint16_t WavFile::getBitsPerSample() const
 }
 
 
+bool WavFile::isFloat() const
+{
+    return (NULL != mFmtHPtr) && (WAVE_FORMAT_IEEE_FLOAT == mFmtHPtr->fmttag);
+}
+
+
+uint32_t WavFile::getChannelMask() const
+{
+    return (NULL != mFmtHPtr) ? mChannelMask : 0;
+}
+
+
+FMTHeader WavFile::getFormat() const
+{
+    FMTHeader fmth;
+    if( NULL != mFmtHPtr )
+        fmth = *mFmtHPtr;
+    else
+        memset(&fmth, 0, sizeof(fmth));
+    return fmth;
+}
+
+
 const char* WavFile::getRawAudioDataPtr() const
 {
-    if( NULL != mDataHPtr )
+    if( (NULL != mDataHPtr) && (READ_STREAM != mReadMode) )
     {
-        return (reinterpret_cast<char*>(mDataHPtr) + sizeof(DataHeader));
+        return mFileBeg + mDataPos;
     }
     else
     {
@@ -254,17 +601,81 @@ const char* WavFile::getRawAudioDataPtr() const
 /*
  * @return the smaller of: data size in the header and the remaining file size
  */
-uint32_t WavFile::getRawAudioDataSize() const
+uint64_t WavFile::getRawAudioDataSize() const
 {
     if( NULL != mDataHPtr )
     {
-        uint32_t datasz = mDataHPtr->datasz;
-        uint32_t space  = mFileData.size() - (reinterpret_cast<char*>(mDataHPtr)
-                                          + sizeof(DataHeader) - &mFileData[0]);
-        return std::min(datasz, space);
+        uint64_t space = (mTotalSize > mDataPos) ? (mTotalSize - mDataPos) : 0;
+        return std::min<uint64_t>(this->getDataSize(), space);
     }
     else
     {
         return 0;
     }
 }
+
+
+uint64_t WavFile::getRawAudioDataOffset() const
+{
+    return (NULL != mDataHPtr) ? mDataPos : 0;
+}
+
+
+const char* WavFile::getNextAudioBlock( uint32_t maxBytes, uint32_t& size )
+{
+    size = 0;
+    uint64_t total = this->getRawAudioDataSize();
+    uint16_t framesz = this->getFrameSize();
+    if( (NULL == mDataHPtr) || (0 == framesz) || (mBlockPos >= total) ) return NULL;
+
+    // Whole frames only
+    size = (uint32_t) std::min<uint64_t>(maxBytes, total - mBlockPos);
+    size -= size % framesz;
+    if( 0 == size ) return NULL;
+
+    const char* block;
+    if( READ_STREAM != mReadMode )
+    {
+        block = this->getRawAudioDataPtr() + mBlockPos;
+    }
+    else
+    {
+        if( (mBlockBuf.size() < size) && !mBlockBuf.resize(size) )
+        {
+            LOG("Error allocating block buffer for file " << mFileUri << std::endl);
+            mReadError = true;
+            size = 0;
+            return NULL;
+        }
+        if( NULL != mStream )
+        {
+            if( (0 == mBlockPos) && !skipStream(mDataPos) ) size = 0;
+            else size = readStream(mBlockBuf.data(), size, framesz);
+        }
+        else
+        {
+            if( 0 == mBlockPos )
+            {
+                mFile.clear();
+                mFile.seekg(mDataPos, std::ios::beg);
+            }
+            mFile.read(mBlockBuf.data(), size);
+            size = mFile.gcount();
+        }
+        size -= size % framesz;
+        if( 0 == size )
+        {
+            // A chunk of unknown size ends with the stream, other data ends early on errors
+            if( (NULL == mStream) || (total < mTotalSize - mDataPos) )
+            {
+                LOG("Error reading audio data from file " << mFileUri << std::endl);
+                mReadError = true;
+            }
+            return NULL;
+        }
+        block = mBlockBuf.data();
+    }
+
+    mBlockPos += size;
+    return block;
+}
@@ -18,19 +18,44 @@
 
 #ifdef _WIN32
  #include <windows.h>
+ #include <io.h>
+ #include <fcntl.h>
 #else  // POSIX
  #include <unistd.h>
+ #include <csignal>
 #endif  // _WIN32
 
 #include <vector>
+#include <algorithm>
 #include <string>
+#include <sstream>
 #include <climits>
 #include <cstring>
-#include <dirent.h>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <stdint.h>
+#include <getopt.h>
+#include <sys/stat.h>
 
-#include "SyncQueue.h"
+#include "Stage.h"
 #include "WavFile.h"
 #include "Encoder.h"
+#include "Converter.h"
+#include "Server.h"
+#include "EncodeJob.h"
+#include "MemoryBudget.h"
+#include "ReadAhead.h"
+#include "Progress.h"
+#include "Shutdown.h"
+#include "SchedulePolicy.h"
+#include "FolderWatcher.h"
+#include "EncodeCache.h"
+#include "Mp3Writer.h"
+#include "BufferPool.h"
+#include "Tracer.h"
+#include "SampleConv.h"
+#include "CpuAffinity.h"
 #include "Log.h"
 
 using namespace wav2mp3;
@@ -38,10 +63,30 @@ using namespace wav2mp3;
 
 namespace {
 
+/// A wav file admitted by the manager (within the memory budget), to be read by the read stage
+struct ReadTask
+{
+    std::string       uri;
+    uint64_t          fileSize;
+    WavFile::ReadMode mode;
+    uint64_t          bytes;        // Acquired from the memory budget for the file
+    int               numWavFiles;  // Files to be processed, for the split decision
+    shared_ptr<EncodeCache::Ticket> ticket;
+    shared_ptr<Progress::Ticket> progress;
+};
+
+typedef Stage< shared_ptr<ReadTask> > ReadStage;
+typedef Stage< shared_ptr<EncodeJob> > EncodeStage;
+
+const size_t WORKER_POOL_BYTES = 64 * 1024 * 1024;   // Max free buffer bytes kept by a worker
+const size_t SHARED_POOL_BYTES = 256 * 1024 * 1024;  // Max free wav data bytes kept for reuse
+
+
 /**
  * Use a global variable to track the number of remaining files to be processed.
  * (Re)Initialize it in the manager thread with total number of wav files.
- * Decrease it after a file is encoded. When it becomes 0 all files are processed.
+ * A file split in segments adds a job for each segment after the first one.
+ * Decrease it after a file (or segment) is encoded. When it becomes 0 all files are processed.
  * Signal this with a condition variable.
  * We can set it to 0 manually to flag a stop request.
  */
@@ -58,6 +103,14 @@ void decNFilesToProcess()
 }
 
 
+/// Adds new files to be processed, unless stop is requested
+void incNFilesToProcess( int n )
+{
+    Locker lock(gNFilesMutex);
+    if( gNFilesToProcess > 0 ) gNFilesToProcess += n;
+}
+
+
 int getNFilesToProcess()
 {
     Locker lock(gNFilesMutex);
@@ -66,122 +119,935 @@ int getNFilesToProcess()
 
 
 std::vector<std::string> gWavFileURIs;
+long gNumWorkers = 1;  // Set in main() before the manager thread is started
+MemoryBudget* gMemoryBudget = NULL;  // Bytes held by in-flight wav files. Set in main().
+SchedulePolicy* gSchedulePolicy = NULL;  // Order of wav files. Set in main().
+FolderWatcher* gFolderWatcher = NULL;  // Reports new wav files in watch mode. Set in main().
+EncodeCache* gEncodeCache = NULL;  // Skips up to date files. Set in main() if enabled.
+Mp3Writer* gMp3Writer = NULL;  // Output stage. Set in main().
+CpuAffinity* gCpuAffinity = NULL;  // Thread placement. Set in main().
+ReadStage* gReadStage = NULL;  // Reads admitted files. Set in main().
+EncodeStage* gEncodeStage = NULL;  // Encodes files and segments. Set in main().
+ReadAhead* gReadAhead = NULL;  // Hints the OS to read queued files. Set in main().
+Progress* gProgress = NULL;  // Done and pending files. Set in main().
 
-} // anonymous namespace
 
+/// Command line options
+struct Options
+{
+    bool     stream;           // Stream all files block by block, don't read them in memory
+    bool     mmap;             // Memory map files instead of reading them
+    uint64_t streamThreshold;  // Stream files bigger than this (in bytes)
+    uint32_t blockFrames;      // Number of frames converted and encoded at once
+    bool     split;            // Split big files in segments encoded in parallel
+    uint64_t splitThreshold;   // Split files bigger than this (in bytes)
+    uint64_t maxBufferedBytes; // Memory budget for in-flight wav files, 0 - unlimited
+    bool     budgetSet;        // maxBufferedBytes was given in the command line
+    std::string schedule;      // Scheduling policy name
+    bool     recursive;        // Process the subfolders too
+    bool     watch;            // Keep running and process new files
+    std::string cacheUri;      // Manifest of encoded files, empty - no cache
+    bool     cacheHash;        // Compare content hashes instead of modification times
+    unsigned int writerThreads;// Threads writing mp3 files, 0 - written by the workers
+    bool     atomicWrite;      // Write mp3 files with a temporary name and rename them
+    bool     hugePages;        // Back big buffers with transparent huge pages
+    std::string traceUri;      // Chrome trace output file, empty - no tracing
+    unsigned int jobs;         // Encoding threads, 0 - one per available CPU core
+    CpuAffinity::Mode affinity;// Pinning of the threads to CPUs
+    unsigned int queueSize;    // Encode queue capacity, 0 - twice the encoding threads
+    unsigned int readThreads;  // Threads reading wav files
+    unsigned int readDepth;    // Reads in flight per read thread
+    unsigned int graceSeconds; // Time for the files in progress after SIGINT/SIGTERM
+    std::string listenUri;     // Serve requests on this Unix socket, empty - encode a folder
+    unsigned int maxConnections; // Connections served at once in server mode
+    uint64_t maxRequestSize;   // Bigger requests are refused in server mode, 0 - default
+    EncodeProfile profile;     // LAME encoding parameters
+
+    Options():
+        stream(false),
+        mmap(false),
+        streamThreshold(256ULL << 20),
+        blockFrames(Encoder::DEFAULT_BLOCK_FRAMES),
+        split(true),
+        splitThreshold(128ULL << 20),
+        maxBufferedBytes(0),
+        budgetSet(false),
+        schedule("fifo"),
+        recursive(false),
+        watch(false),
+        cacheUri(),
+        cacheHash(false),
+        writerThreads(1),
+        atomicWrite(false),
+        hugePages(false),
+        traceUri(),
+        jobs(0),
+        affinity(CpuAffinity::NONE),
+        queueSize(0),
+        readThreads(1),
+        readDepth(1),
+        graceSeconds(20),
+        listenUri(),
+        maxConnections(Server::DEFAULT_MAX_CONNECTIONS),
+        maxRequestSize(0),
+        profile()
+    {}
+};
 
-pthread_mutex_t gLogMutex;  // TODO put it in wav2mp3 namespace
+Options gOptions;
 
 
-void* work_manager(void* arg)
+void printUsage( const char* prog )
 {
-    // Get the work queue pointer
-    SyncQueue< shared_ptr<WavFile> >* wavFileQueue =
-                                  (SyncQueue< shared_ptr<WavFile> >*) arg;
-    if( NULL == wavFileQueue ) pthread_exit((void*) 0);  // Signal CV before exit?
+    std::cerr << "Usage: " << prog << " [options] wav_folder_uri" << std::endl
+              << "       " << prog << " [options] - [mp3_file_uri|-]" << std::endl
+              << "         encode a wav stream from stdin to stdout (default) or to a file," << std::endl
+              << "         writing mp3 frames as they are produced" << std::endl
+              << "       " << prog << " [options] --listen=socket_uri" << std::endl
+              << "         serve conversion requests on a Unix socket (see ServerProtocol.h)" << std::endl
+              << "Options:" << std::endl
+              << "  -s, --stream               stream all files instead of reading them in memory" << std::endl
+              << "  -t, --stream-threshold=N   stream files bigger than N bytes (default 256M)" << std::endl
+              << "  -m, --mmap                 memory map files that are not streamed" << std::endl
+              << "  -b, --block-frames=N       frames converted and encoded at once (default "
+              << Encoder::DEFAULT_BLOCK_FRAMES << ")" << std::endl
+              << "  -p, --split-threshold=N    encode files bigger than N bytes in parallel segments" << std::endl
+              << "                             (default 128M). Files are also split if there are" << std::endl
+              << "                             fewer files than CPU cores" << std::endl
+              << "  -n, --no-split             always encode each file by a single thread" << std::endl
+              << "  -M, --max-buffered-bytes=N don't read more files while wav data in memory" << std::endl
+              << "                             exceeds N bytes (default half of RAM, 0 - unlimited)" << std::endl
+              << "  -S, --schedule=POLICY      order of files: fifo (directory order, default)," << std::endl
+              << "                             lpt (longest first - shortest batch time)" << std::endl
+              << "                             or sjf (shortest first - lowest mean latency)" << std::endl
+              << "  -r, --recursive            process wav files in subfolders too" << std::endl
+              << "  -w, --watch                keep running and encode new wav files when they" << std::endl
+              << "                             are written in the folder (Linux only)" << std::endl
+              << "  -c, --cache=FILE           skip files encoded with the same settings, which" << std::endl
+              << "                             haven't changed since. FILE keeps the list." << std::endl
+              << "  -H, --cache-hash           detect changes by content hash, not by mtime" << std::endl
+              << "  -W, --writer-threads=N     threads writing mp3 files (default 1, 0 - the" << std::endl
+              << "                             encoding threads write them)" << std::endl
+              << "  -a, --atomic-write         write mp3 files with a temporary name and rename" << std::endl
+              << "                             them when complete" << std::endl
+              << "  -L, --huge-pages           use transparent huge pages for big buffers (Linux)" << std::endl
+              << "  -T, --trace=FILE           time the processing stages, write a Chrome trace" << std::endl
+              << "                             (JSON) in FILE and print a summary" << std::endl
+              << "  -j, --jobs=N               encoding threads (default one per CPU core"  << std::endl
+              << "                             available to the process, within its cgroup" << std::endl
+              << "                             CPU quota)" << std::endl
+              << "  -A, --affinity=MODE        pin encoding threads: none (default), core (one" << std::endl
+              << "                             CPU each) or numa (the CPUs of a NUMA node). The" << std::endl
+              << "                             manager thread gets the CPUs left over" << std::endl
+              << "  -q, --queue-size=N         encode queue capacity (default twice the encoding" << std::endl
+              << "                             threads)" << std::endl
+              << "  -R, --read-threads=N       threads reading wav files (default 1)" << std::endl
+              << "  -g, --grace=SECONDS        after SIGINT or SIGTERM give the files in progress" << std::endl
+              << "                             this time to finish, then abort them (default 20)" << std::endl
+              << "  -l, --listen=SOCKET        keep the encoding threads running and convert the" << std::endl
+              << "                             requests of clients on a Unix socket (POSIX only)" << std::endl
+              << "  -C, --max-connections=N    connections served at once, more wait (default "
+              << Server::DEFAULT_MAX_CONNECTIONS << ")" << std::endl
+              << "  -x, --max-request-size=N   refuse bigger requests, closing the connection" << std::endl
+              << "                             (default 256M, at most 4G-1)" << std::endl
+              << "  -d, --read-depth=N         reads in flight per read thread (default 1). Files" << std::endl
+              << "                             queued for reading are read ahead by the OS" << std::endl
+              << "  -P, --profile=NAME         encoding profile: standard (CBR, bitrate from the" << std::endl
+              << "                             wav data, quality 5, default), fast (CBR 128 kbps," << std::endl
+              << "                             quality 7) or archive (VBR V2, quality 3)" << std::endl
+              << "  -e, --encoding=MODE        cbr, abr or vbr. This and the options below" << std::endl
+              << "                             override a profile given before them" << std::endl
+              << "  -B, --bitrate=KBPS         CBR bitrate or ABR mean bitrate (8-320)" << std::endl
+              << "  -Q, --quality=N            LAME algorithm quality 0 (best, slowest) - 9 (fastest)" << std::endl
+              << "  -V, --vbr-quality=N        VBR quality 0 (best) - 9 (smallest), implies vbr" << std::endl
+              << "  -D, --downmix=MATRIX       stereo downmix of files with MATRIX channels, given" << std::endl
+              << "                             as left,gains/right,gains, e.g. for 3 channels" << std::endl
+              << "                             1,0,0.7/0,1,0.7. Other files with more than 2" << std::endl
+              << "                             channels use the standard ITU downmix" << std::endl
+              << "  -h, --help                 print this help" << std::endl
+              << "Sizes may have K, M or G suffix." << std::endl;
+}
 
-    int numWavFiles = gWavFileURIs.size();
 
-    // Set gNFilesToProcess. Workers are not active yet, so this is safe.
-    gNFilesToProcess = numWavFiles;
+/**
+ * Parses a size with optional K, M or G (binary) suffix.
+ *
+ * @return true on success
+ */
+bool parseSize( const char* str, uint64_t& size )
+{
+    char* end = NULL;
+    unsigned long long val = strtoull(str, &end, 10);
+    if( end == str ) return false;
+    switch( *end )
+    {
+        case 'k': case 'K': val <<= 10; end++; break;
+        case 'm': case 'M': val <<= 20; end++; break;
+        case 'g': case 'G': val <<= 30; end++; break;
+        default: break;
+    }
+    if( *end != '\0' ) return false;
+    size = val;
+    return true;
+}
 
-    // Enqueue wav files in the work queue until the list is empty (or stop is requested)
-    int i=0;
-    for( ; i<numWavFiles && getNFilesToProcess()>0; i++ )
+
+/**
+ * Parses command line options in gOptions.
+ *
+ * @return index of the first non-option argument, -1 on error
+ */
+int parseOptions( int argc, char* argv[] )
+{
+    static const struct option longOpts[] = {
+        { "stream",           no_argument,       NULL, 's' },
+        { "stream-threshold", required_argument, NULL, 't' },
+        { "mmap",             no_argument,       NULL, 'm' },
+        { "block-frames",     required_argument, NULL, 'b' },
+        { "split-threshold",  required_argument, NULL, 'p' },
+        { "no-split",         no_argument,       NULL, 'n' },
+        { "max-buffered-bytes", required_argument, NULL, 'M' },
+        { "schedule",         required_argument, NULL, 'S' },
+        { "recursive",        no_argument,       NULL, 'r' },
+        { "watch",            no_argument,       NULL, 'w' },
+        { "cache",            required_argument, NULL, 'c' },
+        { "cache-hash",       no_argument,       NULL, 'H' },
+        { "writer-threads",   required_argument, NULL, 'W' },
+        { "atomic-write",     no_argument,       NULL, 'a' },
+        { "huge-pages",       no_argument,       NULL, 'L' },
+        { "trace",            required_argument, NULL, 'T' },
+        { "jobs",             required_argument, NULL, 'j' },
+        { "affinity",         required_argument, NULL, 'A' },
+        { "queue-size",       required_argument, NULL, 'q' },
+        { "read-threads",     required_argument, NULL, 'R' },
+        { "read-depth",       required_argument, NULL, 'd' },
+        { "grace",            required_argument, NULL, 'g' },
+        { "listen",           required_argument, NULL, 'l' },
+        { "max-connections",  required_argument, NULL, 'C' },
+        { "max-request-size", required_argument, NULL, 'x' },
+        { "profile",          required_argument, NULL, 'P' },
+        { "encoding",         required_argument, NULL, 'e' },
+        { "bitrate",          required_argument, NULL, 'B' },
+        { "quality",          required_argument, NULL, 'Q' },
+        { "vbr-quality",      required_argument, NULL, 'V' },
+        { "downmix",          required_argument, NULL, 'D' },
+        { "help",             no_argument,       NULL, 'h' },
+        { NULL,               0,                 NULL, 0   }
+    };
+
+    int opt;
+    uint64_t val;
+    while( (opt = getopt_long(argc, argv, "st:mb:p:nM:S:rwc:HW:aLT:j:A:q:R:d:g:l:C:x:P:e:B:Q:V:D:h", longOpts, NULL)) != -1 )
+    {
+        switch( opt )
+        {
+            case 's':
+                gOptions.stream = true;
+                break;
+            case 't':
+                if( !parseSize(optarg, gOptions.streamThreshold) ) return -1;
+                break;
+            case 'm':
+                gOptions.mmap = true;
+                break;
+            case 'b':
+                if( !parseSize(optarg, val) || (0 == val) || (val > (1U << 24)) ) return -1;
+                gOptions.blockFrames = (uint32_t) val;
+                break;
+            case 'p':
+                if( !parseSize(optarg, gOptions.splitThreshold) ) return -1;
+                break;
+            case 'n':
+                gOptions.split = false;
+                break;
+            case 'M':
+                if( !parseSize(optarg, gOptions.maxBufferedBytes) ) return -1;
+                gOptions.budgetSet = true;
+                break;
+            case 'S':
+                gOptions.schedule = optarg;
+                break;
+            case 'r':
+                gOptions.recursive = true;
+                break;
+            case 'w':
+                gOptions.watch = true;
+                break;
+            case 'c':
+                gOptions.cacheUri = optarg;
+                break;
+            case 'H':
+                gOptions.cacheHash = true;
+                break;
+            case 'W':
+                if( !parseSize(optarg, val) || (val > 256) ) return -1;
+                gOptions.writerThreads = (unsigned int) val;
+                break;
+            case 'a':
+                gOptions.atomicWrite = true;
+                break;
+            case 'L':
+                gOptions.hugePages = true;
+                break;
+            case 'T':
+                gOptions.traceUri = optarg;
+                break;
+            case 'j':
+                if( !parseSize(optarg, val) || (0 == val) || (val > 4096) ) return -1;
+                gOptions.jobs = (unsigned int) val;
+                break;
+            case 'A':
+                if( !CpuAffinity::parseMode(optarg, gOptions.affinity) ) return -1;
+                break;
+            case 'q':
+                if( !parseSize(optarg, val) || (0 == val) || (val > (1U << 20)) ) return -1;
+                gOptions.queueSize = (unsigned int) val;
+                break;
+            case 'R':
+                if( !parseSize(optarg, val) || (0 == val) || (val > 256) ) return -1;
+                gOptions.readThreads = (unsigned int) val;
+                break;
+            case 'd':
+                if( !parseSize(optarg, val) || (0 == val) || (val > 256) ) return -1;
+                gOptions.readDepth = (unsigned int) val;
+                break;
+            case 'g':
+                if( !parseSize(optarg, val) || (val > 86400) ) return -1;
+                gOptions.graceSeconds = (unsigned int) val;
+                break;
+            case 'l':
+                gOptions.listenUri = optarg;
+                break;
+            case 'C':
+                if( !parseSize(optarg, val) || (0 == val) || (val > 65536) ) return -1;
+                gOptions.maxConnections = (unsigned int) val;
+                break;
+            case 'x':
+                if( !parseSize(optarg, val) || (0 == val) || (val > 0xFFFFFFFFULL) ) return -1;
+                gOptions.maxRequestSize = val;
+                break;
+            case 'P':
+                // A profile sets all parameters, so it must come before the others
+                if( !gOptions.profile.setName(optarg) ) return -1;
+                break;
+            case 'e':
+                if( !gOptions.profile.setMode(optarg) ) return -1;
+                break;
+            case 'B':
+                if( !parseSize(optarg, val) || (val < EncodeProfile::MIN_BITRATE) ||
+                    (val > EncodeProfile::MAX_BITRATE) ) return -1;
+                gOptions.profile.bitrate = (int) val;
+                break;
+            case 'Q':
+                if( !parseSize(optarg, val) || (val > 9) ) return -1;
+                gOptions.profile.quality = (int) val;
+                break;
+            case 'V':
+                if( !parseSize(optarg, val) || (val > 9) ) return -1;
+                gOptions.profile.vbrQuality = (int) val;
+                gOptions.profile.mode = EncodeProfile::VBR;
+                break;
+            case 'D':
+            {
+                Downmix matrix;
+                if( !matrix.parse(optarg) ) return -1;
+                gOptions.profile.downmix = optarg;
+                break;
+            }
+            default:
+                return -1;
+        }
+    }
+    return optind;
+}
+
+
+uint64_t getFileSize( const std::string& uri )
+{
+    struct stat st;
+    if( 0 == stat(uri.c_str(), &st) ) return st.st_size;
+    return 0;
+}
+
+
+/// Streams big files (or all files if requested), reads or maps the rest
+WavFile::ReadMode getReadMode( uint64_t fileSize )
+{
+    // RF64 files over 4 GB are always streamed, whatever the threshold
+    static const uint64_t MAX_IN_MEMORY_SIZE = 0xFFFFFFFFULL;
+    if( gOptions.stream || (fileSize > gOptions.streamThreshold) ||
+        (fileSize > MAX_IN_MEMORY_SIZE) )
+        return WavFile::READ_STREAM;
+
+    return gOptions.mmap ? WavFile::READ_MMAP : WavFile::READ_ENTIRE;
+}
+
+
+/// @return bytes of wav data a file of this size will hold in memory
+uint64_t getBufferedBytes( uint64_t fileSize, WavFile::ReadMode mode )
+{
+    // Streamed files hold only a block per worker
+    return (WavFile::READ_STREAM == mode) ? 0 : fileSize;
+}
+
+
+/// @return half of the physical memory, 0 (unlimited) if unknown
+uint64_t getDefaultMemoryBudget()
+{
+#if defined(_SC_PHYS_PAGES) && defined(_SC_PAGESIZE)
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if( (pages > 0) && (pageSize > 0) ) return (uint64_t) pages * pageSize / 2;
+#endif
+    return 0;
+}
+
+
+/**
+ * Splits the chunks of a wav file in segments to be encoded in parallel, if the
+ * file is big or there are fewer files than workers.
+ *
+ * @return the number of submitted segment jobs, 0 if the file should be encoded as a whole
+ */
+int submitSegments( shared_ptr<WavFile> wavFile, uint64_t fileSize, int numWavFiles,
+                    shared_ptr<EncodeCache::Ticket> ticket, shared_ptr<Progress::Ticket> progress )
+{
+    if( !gOptions.split || (gNumWorkers < 2) ) return 0;
+    if( (fileSize <= gOptions.splitThreshold) && (numWavFiles >= gNumWorkers) ) return 0;
+
+    std::vector< shared_ptr<SegmentedChunk> > chunks;
+    int numJobs = 0;
+    bool split = false;
+    for( int chunkNum=0; wavFile->findNextWavChunk(); chunkNum++ )
+    {
+        shared_ptr<SegmentedChunk> chunk(new SegmentedChunk(wavFile,
+                Encoder::getMp3Uri(wavFile->getURI(), chunkNum), gNumWorkers, gMp3Writer));
+        chunk->setCacheTicket(ticket);
+        chunk->setProgressTicket(progress);
+        numJobs += chunk->getNumSegments();
+        if( chunk->getNumSegments() > 1 ) split = true;
+        chunks.push_back(chunk);
+    }
+    if( !split )  // Too short - encode it as a whole
     {
+        wavFile->rewind();
+        return 0;
+    }
+
+    // One job is already counted for the file
+    pthread_mutex_lock(&gNFilesMutex);
+    gNFilesToProcess += numJobs - 1;
+    pthread_mutex_unlock(&gNFilesMutex);
+
+    LOG("Splitting '" << wavFile->getURI() << "' in " << numJobs << " segment(s)" << std::endl);
+    if( ticket ) ticket->setNumOutputs(chunks.size());
+    for( size_t c=0; c<chunks.size(); c++ )
+    {
+        for( int seg=0; seg<chunks[c]->getNumSegments(); seg++ )
+        {
+            shared_ptr<EncodeJob> job(new EncodeJob(chunks[c], seg, ticket));
+            job->progress = progress;
+            gEncodeStage->submit(job);
+        }
+    }
+    return numJobs;
+}
+
+
+/**
+ * Admits a wav file in the pipeline: skips it if it is up to date or has no
+ * supported audio, waits for its bytes in the memory budget and passes it to
+ * the read stage. Blocks while the memory budget or the read queue is full.
+ *
+ * @param[in] numWavFiles - files to be processed, small files are split only if
+ *            there are fewer than workers
+ */
+void admitWavFile( const std::string& uri, int numWavFiles )
+{
+    if( Shutdown::isCancelled() )  // The file stays pending
+    {
+        decNFilesToProcess();
+        return;
+    }
+    TRACE_FILE_SCOPE("manage_file", uri);
+
+    // Skip files which are up to date, before reading them
+    shared_ptr<EncodeCache::Ticket> ticket;
+    bool upToDate = false;
+    if( gEncodeCache )
+    {
+        TRACE_SCOPE("cache_check");
+        upToDate = gEncodeCache->check(uri, ticket);
+    }
+    if( upToDate )
+    {
+        LOG("Skipping up to date '" << uri << "'" << std::endl);
+        gProgress->finish(uri, true);
+        decNFilesToProcess();
+        return;
+    }
+
+    // Check the headers before committing memory to the file
+    WavInfo info;
+    {
+        TRACE_SCOPE("probe");
+        if( !WavFile::probe(uri, info) )
+        {
+            LOG("Skipping '" << uri << "' without supported wav data" << std::endl);
+            gProgress->finish(uri, false);
+            decNFilesToProcess();
+            return;
+        }
+    }
+
+    shared_ptr<ReadTask> task(new ReadTask());
+    task->uri = uri;
+    task->fileSize = getFileSize(uri);
+    task->mode = getReadMode(task->fileSize);
+    task->bytes = getBufferedBytes(task->fileSize, task->mode);
+    task->numWavFiles = numWavFiles;
+    task->ticket = ticket;
+    task->progress.reset(new Progress::Ticket(*gProgress, uri));
+
+    // Wait until the wav data in memory drops below the budget
+    if( !gMemoryBudget->tryAcquire(task->bytes) )
+    {
+        LOG("Waiting for memory: " << gMemoryBudget->getInFlight() << " bytes in flight, "
+            << task->bytes << " needed" << std::endl);
+        TRACE_SCOPE("memory_wait");
+        gMemoryBudget->acquire(task->bytes);
+    }
+    if( Shutdown::isCancelled() )  // Cancelled while waiting
+    {
+        gMemoryBudget->release(task->bytes);
+        task->progress->interrupt();
+        decNFilesToProcess();
+        return;
+    }
+
+    // Streamed files are read block by block, don't pull them in the page cache.
+    // Before submitting, so a read thread can't take the file before it is queued here.
+    if( WavFile::READ_STREAM != task->mode ) gReadAhead->queued(uri);
+
+    TRACE_SCOPE("read_queue_wait");
+    gReadStage->submit(task);
+}
+
+
+/// Read stage: reads (or opens) admitted wav files and submits them for encoding
+class ReadHandler: public ReadStage::Handler
+{
+  public:
+    virtual void initThread( unsigned int /*thread*/ )
+    {
+        // Readers share the manager's CPUs, away from the encoding threads
+        CpuAffinity::pinCurrentThread(gCpuAffinity->getManagerCpus());
+    }
+
+    virtual void process( shared_ptr<ReadTask>& task, unsigned int /*thread*/ )
+    {
+        if( WavFile::READ_STREAM != task->mode ) gReadAhead->started(task->uri);
+        if( Shutdown::isCancelled() )  // Don't start reading
+        {
+            gMemoryBudget->release(task->bytes);
+            task->progress->interrupt();
+            decNFilesToProcess();
+            return;
+        }
+
+        TRACE_FILE_SCOPE("read_file", task->uri);
         shared_ptr<WavFile> wavFile;
-        std::string uri = gWavFileURIs[i];
         try {
-            wavFile.reset(new WavFile(uri));  // Will be freed automatically
-            wavFile->readEntireFile();  // Should be more effective here than in workers
+            // Will be freed automatically, the bytes are released with it
+            wavFile.reset(new WavFile(task->uri, task->mode),
+                          MemoryBudget::Releaser<WavFile>(*gMemoryBudget, task->bytes));
+            // Should be more effective here than in workers. Streamed files are read by workers.
+            size_t size = wavFile->readEntireFile();
+            if( task->ticket && task->ticket->needsHash() )
+            {
+                // Hash mode: new and changed files are hashed here, off the manager thread,
+                // from the data in memory. Streamed files have to be read once more.
+                TRACE_FILE_SCOPE("hash_file", task->uri);
+                task->ticket->setHash(wavFile->getFileData() ?
+                        EncodeCache::hashData(wavFile->getFileData(), size) :
+                        EncodeCache::hashFile(task->uri));
+            }
+            if( submitSegments(wavFile, task->fileSize, task->numWavFiles, task->ticket,
+                               task->progress) > 0 )
+                return;
         } catch(...) {
-            LOG("Error opening wav file " << uri << std::endl);
+            LOG("Error opening wav file " << task->uri << std::endl);
+            if( !wavFile ) gMemoryBudget->release(task->bytes);  // Not owned by a file object
+            task->progress->fail();
             decNFilesToProcess();
-            continue;
+            return;
         }
-        wavFileQueue->enqueue(wavFile);
-    }
-    LOG("Work manager is done" << std::endl);
 
-    return ((void*) (numWavFiles-i));  // The remaining files (should be 0)
-}
+        shared_ptr<EncodeJob> job(new EncodeJob(wavFile, task->ticket));
+        job->progress = task->progress;
+        gEncodeStage->submit(job);
+    }
+};
 
 
-void* worker(void* arg)
+/// Encode stage: converts and encodes whole files or segments, passes mp3 data to the writer
+class EncodeHandler: public EncodeStage::Handler
 {
-    // Get the work queue pointer
-    SyncQueue< shared_ptr<WavFile> >* wavFileQueue =
-                                  (SyncQueue< shared_ptr<WavFile> >*) arg;
-    if( NULL == wavFileQueue ) pthread_exit((void*) 0);
+  public:
+    explicit EncodeHandler( unsigned int numThreads ): mPools(numThreads, (BufferPool*) NULL) {}
 
-    unsigned int numProcFiles=0;  // Number of files processed by this thread
+    virtual ~EncodeHandler()
+    {
+        for( size_t i=0; i<mPools.size(); i++ ) delete mPools[i];
+    }
 
-    while( true )
+    virtual void initThread( unsigned int thread )
     {
-        // Dequeue wav file from work queue and encode it. Block if the queue is empty
-        shared_ptr<WavFile> wavFile = wavFileQueue->dequeue();
+        const std::vector<int>& cpus = gCpuAffinity->getWorkerCpus(thread);
+        if( !cpus.empty() && !CpuAffinity::pinCurrentThread(cpus) )
+            LOG("Can't pin worker " << thread + 1 << " to CPUs " << CpuAffinity::toString(cpus) << std::endl);
+
+        // Encoding buffers are reused by all jobs of this thread
+        mPools[thread] = new BufferPool(WORKER_POOL_BYTES, gOptions.hugePages);
+    }
 
-        if( wavFile )
+    virtual void process( shared_ptr<EncodeJob>& job, unsigned int thread )
+    {
+        BufferPool* bufferPool = mPools[thread];
+        if( Shutdown::isCancelled() )
         {
+            // Don't start queued jobs. A failed segment removes the mp3 file of its chunk
+            // only if other segments were written to it - an old mp3 file is kept.
+            if( job->chunk )
+            {
+                std::vector<unsigned char> none;
+                job->chunk->addSegmentOutput(job->segment, none, false);
+            }
+            if( job->ticket ) job->ticket->fail();
+            if( job->progress ) job->progress->interrupt();
+        }
+        else if( job->chunk )
+        {
+            TRACE_FILE_SCOPE("encode_segment", job->chunk->getMp3Uri());
+            // Encode a segment of a wav chunk
+            Encoder encoder(job->wavFile, gOptions.blockFrames, gMp3Writer, bufferPool);
+            encoder.setProfile(gOptions.profile);
+            encoder.setAbortFlag(Shutdown::getAbortFlag());
+            bool ok = encoder.encodeSegment(*job->chunk, job->segment);
+            if( job->ticket && (!ok || job->chunk->hasFailed()) ) job->ticket->fail();
+            if( job->progress && !ok ) setFailed(*job->progress, encoder.isAborted());
+        }
+        else if( job->wavFile )
+        {
+            const std::string wavUri = job->wavFile->getURI();
+            TRACE_FILE_SCOPE("encode_file", wavUri);
             // Encode wav file
-            Encoder encoder(wavFile);
-            encoder.encode();
-
-            numProcFiles++;
+            Encoder encoder(job->wavFile, gOptions.blockFrames, gMp3Writer, bufferPool);
+            encoder.setProfile(gOptions.profile);
+            encoder.setCacheTicket(job->ticket);
+            encoder.setProgressTicket(job->progress);
+            encoder.setAbortFlag(Shutdown::getAbortFlag());
+            int numChunks = encoder.encode();
+            if( job->ticket )
+            {
+                job->ticket->setNumOutputs(numChunks);
+                if( encoder.getNumErrors() ) job->ticket->fail();
+            }
+            if( job->progress && encoder.getNumErrors() ) setFailed(*job->progress, encoder.isAborted());
         }  // Resources will be freed here
-        else
+
+        // Free the job (and store its cache entry) before the main thread may stop us
+        job.reset();
+        decNFilesToProcess();
+    }
+
+  private:
+    /// An aborted file stays pending, others failed
+    static void setFailed( Progress::Ticket& progress, bool aborted )
+    {
+        if( aborted ) progress.interrupt();
+        else progress.fail();
+    }
+
+    std::vector<BufferPool*> mPools;  // One per thread
+};
+
+
+/// Admits new wav files reported by the folder watcher, until stop is requested
+void watchFolder()
+{
+    LOG("Watching for new wav files" << std::endl);
+    std::vector<std::string> uris;
+    while( getNFilesToProcess() > 0 )
+    {
+        uris.clear();
+        if( !gFolderWatcher->waitForFiles(uris) ) break;
+
+        incNFilesToProcess(uris.size());
+        for( size_t i=0; i<uris.size() && getNFilesToProcess()>0; i++ )
         {
-            LOG("Error in dequeue()!" << std::endl);
+            LOG("New wav file '" << uris[i] << "'" << std::endl);
+            gProgress->add(uris[i]);
+            // The whole backlog (files and segments in flight and pending), so small
+            // files aren't split while the workers are busy. Minus the watcher's count.
+            admitWavFile(uris[i], getNFilesToProcess() - 1);
         }
+    }
+    LOG("Stopped watching for new wav files" << std::endl);
+    decNFilesToProcess();  // The watcher's own count
+}
 
-        decNFilesToProcess();
+
+/// Called by the signal thread on the first signal
+void onCancel( void* /*arg*/ )
+{
+    if( gFolderWatcher ) gFolderWatcher->stop();  // Wakes up the manager
+}
+
+
+/// Wav data from a pipe or a file, e.g. stdin. Returns what is available.
+class StdioWavStream: public WavStream
+{
+  public:
+    explicit StdioWavStream( FILE* file ): mFile(file) {}
+
+    virtual size_t read( char* buf, size_t size )
+    {
+        // fread() would wait for the whole buffer, read() returns what the pipe has
+#ifdef _WIN32
+        return fread(buf, 1, size, mFile);
+#else
+        while( true )
+        {
+            ssize_t n = ::read(fileno(mFile), buf, size);
+            if( n >= 0 ) return (size_t) n;
+            if( EINTR != errno ) return 0;
+        }
+#endif  // _WIN32
+    }
+
+  private:
+    FILE* mFile;
+};
+
+
+/// Writes mp3 frames to a file or to stdout as soon as they are encoded
+class StdioMp3Sink: public Mp3Sink
+{
+  public:
+    explicit StdioMp3Sink( FILE* file ): mFile(file) {}
+
+    virtual bool write( const unsigned char* data, size_t size )
+    {
+        return (fwrite(data, 1, size, mFile) == size) && (0 == fflush(mFile));
+    }
+
+  private:
+    FILE* mFile;
+};
+
+
+/**
+ * Streaming mode: encodes a wav stream from stdin to stdout (or to a file),
+ * without seeking. Mp3 frames are written as soon as they are produced, so a
+ * consumer gets the first bytes while the input is still being written.
+ *
+ * @param[in] output - "-" for stdout or the mp3 file URI
+ * @return exit status
+ */
+int encodeStdin( const std::string& output )
+{
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(_fileno(stdout), _O_BINARY);
+#else
+    signal(SIGPIPE, SIG_IGN);  // A closed reader fails the write instead of killing us
+#endif  // _WIN32
+
+    bool toStdout = ("-" == output);
+    FILE* out = toStdout ? stdout : fopen(output.c_str(), "wb");
+    if( NULL == out )
+    {
+        std::cerr << "Error opening '" << output << "': " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    StdioWavStream wav(stdin);
+    StdioMp3Sink mp3(out);
+    bool ok;
+    {
+        Converter converter(1, gOptions.profile, gOptions.blockFrames);
+        ok = converter.encode(wav, mp3);
     }
 
-    pthread_exit((void*) numProcFiles);
+    if( !toStdout && ((0 != fclose(out)) || !ok) )
+    {
+        ok = false;
+        remove(output.c_str());  // No partial mp3 files
+    }
+    return ok ? 0 : 1;
+}
+
+
+/// Called by the signal thread on the first signal in server mode
+void stopServer( void* server )
+{
+    static_cast<Server*>(server)->stop();
+}
+
+
+/**
+ * Server mode: converts the requests of clients on a Unix socket until
+ * SIGINT or SIGTERM. The encoding threads and their buffers are kept between
+ * requests. Requests in progress get the grace period.
+ *
+ * @return exit status
+ */
+int serveRequests()
+{
+    // SIGINT and SIGTERM are taken by the signal thread. Blocked before any thread is created.
+    Shutdown::blockSignals();
+#ifndef _WIN32
+    signal(SIGPIPE, SIG_IGN);  // A client gone fails the response instead of killing us
+#endif  // _WIN32
+
+    Converter converter(gOptions.jobs, gOptions.profile, gOptions.blockFrames);
+    converter.setAbortFlag(Shutdown::getAbortFlag());
+    Server server(converter, gOptions.listenUri, gOptions.maxConnections,
+                  (uint32_t) gOptions.maxRequestSize);
+    if( !server.isListening() )
+    {
+        std::cerr << "Error listening on '" << gOptions.listenUri << "'" << std::endl;
+        return 1;
+    }
+    LOG("Encoding threads: " << converter.getNumThreads() << std::endl);
+
+    bool ok;
+    {
+        Shutdown shutdown(gOptions.graceSeconds, stopServer, &server);
+        ok = server.run();
+    }
+    LOG("Requests served: " << server.getNumRequests() << std::endl);
+
+    // Exit status as if killed by the signal, so callers can tell
+    if( Shutdown::isCancelled() ) return 128 + Shutdown::getSignal();
+    return ok ? 0 : 1;
+}
+
+} // anonymous namespace
+
+
+/// First stage of the pipeline: orders the wav files and admits them for reading
+void* work_manager(void* /*arg*/)
+{
+    Tracer::setThreadName("manager");
+    if( CpuAffinity::pinCurrentThread(gCpuAffinity->getManagerCpus()) )
+    {
+        LOG("Manager pinned to CPUs " << CpuAffinity::toString(gCpuAffinity->getManagerCpus())
+            << std::endl);
+    }
+
+    int numWavFiles = gWavFileURIs.size();
+
+    // Set gNFilesToProcess. Workers are not active yet, so this is safe.
+    // In watch mode the watcher counts as one more file, until it stops.
+    gNFilesToProcess = numWavFiles + (gFolderWatcher ? 1 : 0);
+
+    // Order the files according to the scheduling policy
+    std::vector<ScheduledFile> files;
+    for( int i=0; i<numWavFiles; i++ )
+    {
+        gProgress->add(gWavFileURIs[i]);
+        files.push_back(ScheduledFile(gWavFileURIs[i]));
+        if( gSchedulePolicy->usesCost() )
+            files.back().cost = SchedulePolicy::estimateCost(gWavFileURIs[i]);
+    }
+    gSchedulePolicy->order(files);
+
+    // Admit wav files until the list is empty (or stop is requested). After a
+    // signal the rest are counted down without being admitted.
+    int i=0;
+    for( ; i<numWavFiles && getNFilesToProcess()>0; i++ )
+    {
+        admitWavFile(files[i].uri, numWavFiles);
+    }
+
+    if( gFolderWatcher ) watchFolder();
+    LOG("Work manager is done" << std::endl);
+
+    return ((void*) (numWavFiles-i));  // The remaining files (should be 0)
 }
 
 
 int main(int argc, char* argv[])
 {
     // Parse arguments and set gWavFileURIs
-    if( argc < 2 )
+    int argi = parseOptions(argc, argv);
+    if( (argi >= 0) && !gOptions.listenUri.empty() ) return serveRequests();
+    if( (argi < 0) || (argi >= argc) )
     {
-        std::cerr << "Usage: " << argv[0] << " wav_folder_uri" << std::endl;
+        printUsage(argv[0]);
         return 1;
     }
 
+    // Streaming from stdin
+    if( !strcmp(argv[argi], "-") ) return encodeStdin((argi + 1 < argc) ? argv[argi + 1] : "-");
+
     // Fill the list of wav file URIs
-    std::string wavFolder(argv[1]);
+    std::string wavFolder(argv[argi]);
     size_t len = wavFolder.length();
     if( wavFolder[len-1] != '/' && wavFolder[len-1] != '\\' ) wavFolder += "/";
-    DIR* dir;
-    if( (dir = opendir (wavFolder.c_str())) == NULL )
+
+    // Start watching before the scan, so files written meanwhile are not missed
+#if defined(__GXX_EXPERIMENTAL_CXX0X) || __cplusplus >= 201103L
+    std::unique_ptr<FolderWatcher> folderWatcherPtr;
+#else
+    std::auto_ptr<FolderWatcher> folderWatcherPtr;
+#endif  // c++11
+    if( gOptions.watch )
+    {
+        folderWatcherPtr.reset(new FolderWatcher(wavFolder, gOptions.recursive));
+        if( !folderWatcherPtr->isWatching() )
+        {
+            std::cerr << "Error watching folder '" << wavFolder << "'" << std::endl;
+            return 1;
+        }
+        gFolderWatcher = folderWatcherPtr.get();
+    }
+
+    if( !FolderWatcher::findWavFiles(wavFolder, gOptions.recursive, gWavFileURIs) )
     {
         std::cerr << "Error opening folder '" << wavFolder << "'" << std::endl;
         return 1;
     }
-    struct dirent* dent;
-    while( (dent = readdir (dir)) != NULL )
+    if( (0 == gWavFileURIs.size()) && !gOptions.watch )
     {
-        const char* fname = dent->d_name;
-        if( !strcmp(".", fname) || !strcmp("..", fname) ) continue;
-        len = strlen(fname);
-        if( (len > 4) && (!strcasecmp(".wav", fname+len-4)) )
-            gWavFileURIs.push_back(wavFolder + std::string(fname));
+        std::cerr << "There are no wav files in '" << wavFolder << "' folder" << std::endl;
+        return 1;
     }
-    closedir (dir);
-    if( 0 == gWavFileURIs.size() )
+
+    // Create the scheduling policy
+#if defined(__GXX_EXPERIMENTAL_CXX0X) || __cplusplus >= 201103L
+    std::unique_ptr<SchedulePolicy> schedulePolicyPtr(SchedulePolicy::create(gOptions.schedule));
+#else
+    std::auto_ptr<SchedulePolicy> schedulePolicyPtr(SchedulePolicy::create(gOptions.schedule));
+#endif  // c++11
+    if( !schedulePolicyPtr.get() )
     {
-        std::cerr << "There are no wav files in '" << wavFolder << "' folder" << std::endl;
+        std::cerr << "Unknown scheduling policy '" << gOptions.schedule << "'" << std::endl;
+        printUsage(argv[0]);
         return 1;
     }
+    gSchedulePolicy = schedulePolicyPtr.get();
+
+    if( !gOptions.traceUri.empty() ) Tracer::enable();
 
     // Initialize global condition variable and mutexes
-    pthread_mutex_init(&gLogMutex, NULL);
     pthread_mutex_init(&gNFilesMutex, NULL);
     pthread_cond_init(&gNFilesCVar, NULL);
 
-    // TODO Add signal handler for CTRL+C to set gNFilesToProcess=0 and signal gNFilesCVar
+    // SIGINT and SIGTERM are taken by the signal thread. Blocked before any thread is created.
+    Shutdown::blockSignals();
 
     // Get the number of CPU cores
     long numCores;
@@ -195,28 +1061,86 @@ int main(int argc, char* argv[])
     numCores = sysconf(_SC_NPROCESSORS_ONLN);
 #endif
     LOG("Number of CPU cores: " << numCores << std::endl);
+    if( numCores < 1 ) numCores = 1;
+
+    // Only the CPUs in the affinity mask (cpuset), within the cgroup CPU quota, are usable
+    std::vector<int> allowedCpus = CpuAffinity::getAllowedCpus(numCores);
+    long availCores = allowedCpus.size();
+    unsigned int cpuLimit = CpuAffinity::getCgroupCpuLimit();
+    if( cpuLimit && (cpuLimit < availCores) ) availCores = cpuLimit;
+    LOG("Available CPU cores: " << availCores << " (allowed CPUs " << CpuAffinity::toString(allowedCpus)
+        << ", cgroup CPU limit " << cpuLimit << ")" << std::endl);
+
+    // With pinning, leave a CPU to the manager if the workers would take them all
+    long numWorkers = gOptions.jobs;
+    if( 0 == numWorkers )
+    {
+        numWorkers = availCores;
+        if( (CpuAffinity::NONE != gOptions.affinity) && (numWorkers > 1) &&
+            (numWorkers >= (long) allowedCpus.size()) )
+            numWorkers--;
+    }
+    CpuAffinity cpuAffinity(gOptions.affinity, allowedCpus, numWorkers);
+    gCpuAffinity = &cpuAffinity;
+    unsigned int queueSize = gOptions.queueSize ? gOptions.queueSize : 2*numWorkers;
+    LOG("Encoding threads: " << numWorkers << ", encode queue size: " << queueSize << std::endl);
+    LOG("Read threads: " << gOptions.readThreads << ", reads in flight per thread: "
+        << gOptions.readDepth << std::endl);
+    LOG("CPU affinity: " << CpuAffinity::getModeName(gOptions.affinity) << std::endl);
+    LOG("Sample conversion: " << SampleConv::getImplName() << std::endl);
+    LOG("Scheduling policy: " << gSchedulePolicy->getName() << std::endl);
+    LOG("Encoder settings: " << Encoder::getSettingsId(gOptions.profile) << std::endl);
+    gNumWorkers = numWorkers;
 
-    // Create work queue for wav files.
 #if defined(__GXX_EXPERIMENTAL_CXX0X) || __cplusplus >= 201103L
-    std::unique_ptr<SyncQueue<shared_ptr<WavFile> > >
-        wavFileQueuePtr(new SyncQueue<shared_ptr<WavFile> >(2*numCores));
+    std::unique_ptr<EncodeCache> encodeCachePtr;
 #else
-    std::auto_ptr<SyncQueue<shared_ptr<WavFile> > >
-        wavFileQueuePtr(new SyncQueue<shared_ptr<WavFile> >(2*numCores));
+    std::auto_ptr<EncodeCache> encodeCachePtr;
 #endif  // c++11
+    if( !gOptions.cacheUri.empty() )
+    {
+        encodeCachePtr.reset(new EncodeCache(gOptions.cacheUri, Encoder::getSettingsId(gOptions.profile),
+                                             gOptions.cacheHash));
+        gEncodeCache = encodeCachePtr.get();
+        LOG("Encoded files in cache: " << gEncodeCache->getNumEntries() << std::endl);
+    }
 
-    // Create a manager thread to read wav files and fill the work queue
-    pthread_t managerThread;
-    pthread_create(&managerThread, 0, work_manager, wavFileQueuePtr.get());
+    if( !gOptions.budgetSet ) gOptions.maxBufferedBytes = getDefaultMemoryBudget();
 
-    // Wait until work queue is at least half full? Use a barier?
+    // Keep no more free wav data than a quarter of the memory budget
+    size_t sharedPoolBytes = SHARED_POOL_BYTES;
+    if( gOptions.maxBufferedBytes )
+        sharedPoolBytes = std::min<uint64_t>(sharedPoolBytes, gOptions.maxBufferedBytes / 4);
+    BufferPool::configureShared(sharedPoolBytes, gOptions.hugePages);
+    Mp3Writer mp3Writer(gOptions.writerThreads, gOptions.atomicWrite);
+    gMp3Writer = &mp3Writer;
 
-    // Create pool of encoding threads (workers) and point them to the work queue
-    pthread_t encoderThreads[numCores];
-    for( int i=0; i<numCores; i++ )
-    {
-        pthread_create(&(encoderThreads[i]), 0, worker, wavFileQueuePtr.get());
-    }
+    MemoryBudget memoryBudget(gOptions.maxBufferedBytes);
+    gMemoryBudget = &memoryBudget;
+    LOG("Memory budget for wav data: " << gOptions.maxBufferedBytes << " bytes" << std::endl);
+
+    Progress progress;
+    gProgress = &progress;
+    Shutdown shutdown(gOptions.graceSeconds, onCancel, NULL);
+
+    // Files queued for reading beyond the first of each read thread are read ahead
+    ReadAhead readAhead((gOptions.readDepth - 1) * gOptions.readThreads);
+    gReadAhead = &readAhead;
+
+    // Create the pipeline stages. The read queue holds files already within the memory budget.
+    ReadHandler readHandler;
+    ReadStage readStage("read", gOptions.readThreads,
+                        std::max(2, (int) gOptions.readDepth) * gOptions.readThreads, readHandler);
+    gReadStage = &readStage;
+    EncodeHandler encodeHandler(numWorkers);
+    EncodeStage encodeStage("encode", numWorkers, queueSize, encodeHandler);
+    gEncodeStage = &encodeStage;
+    encodeStage.start();
+    readStage.start();
+
+    // Create a manager thread to admit wav files in the pipeline
+    pthread_t managerThread;
+    pthread_create(&managerThread, 0, work_manager, NULL);
 
     // Wait for all files to be processed
     pthread_mutex_lock(&gNFilesMutex);
@@ -228,22 +1152,47 @@ int main(int argc, char* argv[])
     pthread_join(managerThread, NULL);
     LOG("Work manager joined" << std::endl);
 
-    // Cancel and join worker threads
-    for( int i=0; i<numCores; i++ )
+    // The queues are empty - stop the stage threads
+    readStage.stop();
+    encodeStage.stop();
+    LOG("Readers and workers joined" << std::endl);
+
+    // Finish writing mp3 files
+    mp3Writer.stop();
+    LOG("Writers stopped" << std::endl);
+
+    // The stage with the highest occupancy is the bottleneck
+    std::ostringstream stageStats;
+    readStage.getStats().print(stageStats);
+    encodeStage.getStats().print(stageStats);
+    mp3Writer.getStats().print(stageStats);
+    LOG("Pipeline stages:" << std::endl << stageStats.str());
+    LOG("Shared buffer pool: " << BufferPool::getShared().getNumAllocations() << " allocations, "
+        << BufferPool::getShared().getNumReuses() << " reuses" << std::endl);
+    LOG("Peak wav data in memory: " << memoryBudget.getPeak() << " bytes" << std::endl);
+    if( readAhead.getWindow() )
+        LOG("Files read ahead: " << readAhead.getNumHints() << std::endl);
+
+    // After a signal, list the files left for the next run
+    shutdown.stop();
+    std::vector<std::string> pending = progress.getPending();
+    LOG("Files done: " << progress.getNumDone() << ", failed: " << progress.getNumFailed()
+        << ", pending: " << pending.size() << std::endl);
+    for( size_t i=0; i<pending.size(); i++ )
+        LOG("Pending: " << pending[i] << std::endl);
+
+    if( Tracer::isEnabled() )
     {
-        pthread_cancel(encoderThreads[i]);
-        unsigned int res=0;
-        pthread_join(encoderThreads[i], (void**)&res);
-        //LOG("Worker thread " << i << " joined with result " << res << std::endl);
+        if( !Tracer::writeChromeTrace(gOptions.traceUri) )
+            std::cerr << "Error writing trace file '" << gOptions.traceUri << "'" << std::endl;
+        Tracer::printSummary(std::cerr);
+        Tracer::reset();
     }
-    LOG("Workers joined" << std::endl);
-
-    // Destroy work queue and globals
-    wavFileQueuePtr.reset();
 
+    // Destroy globals
     pthread_cond_destroy(&gNFilesCVar);
     pthread_mutex_destroy(&gNFilesMutex);
-    pthread_mutex_destroy(&gLogMutex);  // Logs in destructors may crash. Leave this to the OS. Or don't use logs in destructors. Or destroy objects before tis point.
 
-    return 0;
+    // Exit status as if killed by the signal, so callers can tell
+    return Shutdown::isCancelled() ? 128 + Shutdown::getSignal() : 0;
 }